@@ -0,0 +1,103 @@
+/**********************************
+ * FILE NAME: BufferPool.h
+ *
+ * DESCRIPTION: Pool of reusable outbound message buffers
+ **********************************/
+
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+
+#define POOL_MAX_BUFFERS		16
+// buffers that grew past this are freed instead of pooled
+#define POOL_MAX_BUFFER_SIZE	(64 * 1024)
+
+/**
+ * CLASS NAME: BufferPool
+ *
+ * DESCRIPTION: Keeps serialized-message buffers (and their capacity) alive
+ * 				between sends. EmulNet copies the payload in ENsend, so a
+ * 				buffer can go back to the pool as soon as the last send of
+ * 				a fan-out returns.
+ */
+class BufferPool {
+private:
+	vector<string *> freeList;
+	size_t allocated;
+
+	BufferPool(const BufferPool &);
+	BufferPool & operator=(const BufferPool &);
+
+public:
+	BufferPool() : allocated(0) {}
+
+	~BufferPool() {
+		for ( size_t i = 0; i < freeList.size(); i++ ) {
+			delete freeList[i];
+		}
+	}
+
+	string * acquire() {
+		if ( freeList.empty() ) {
+			allocated++;
+			return new string();
+		}
+		string *buf = freeList.back();
+		freeList.pop_back();
+		buf->clear();
+		return buf;
+	}
+
+	void release(string *buf) {
+		if ( freeList.size() >= POOL_MAX_BUFFERS || buf->capacity() > POOL_MAX_BUFFER_SIZE ) {
+			delete buf;
+			allocated--;
+			return;
+		}
+		freeList.push_back(buf);
+	}
+
+	// buffers ever allocated and still alive, pooled or in use
+	size_t getAllocated() const {
+		return allocated;
+	}
+};
+
+/**
+ * CLASS NAME: PooledBuffer
+ *
+ * DESCRIPTION: Scoped handle that returns its buffer to the pool on destruction
+ */
+class PooledBuffer {
+private:
+	BufferPool &pool;
+	string *buf;
+
+	PooledBuffer(const PooledBuffer &);
+	PooledBuffer & operator=(const PooledBuffer &);
+
+public:
+	PooledBuffer(BufferPool &pool) : pool(pool), buf(pool.acquire()) {}
+
+	~PooledBuffer() {
+		pool.release(buf);
+	}
+
+	string & get() {
+		return *buf;
+	}
+
+	char * data() {
+		return buf->empty() ? NULL : &(*buf)[0];
+	}
+
+	int size() const {
+		return (int)buf->size();
+	}
+};
+
+#endif /* BUFFERPOOL_H_ */
@@ -0,0 +1,306 @@
+/**********************************
+ * FILE NAME: BulkTransfer.h
+ *
+ * DESCRIPTION: Chunked, windowed, acknowledged bulk transfer of key/value
+ * 				pairs used by the stabilization protocol
+ **********************************/
+
+#ifndef BULKTRANSFER_H_
+#define BULKTRANSFER_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <climits>
+#include <deque>
+#include <list>
+#include <set>
+#include "Member.h"
+#include "Message.h"
+#include "MessageCodec.h"
+#include "TransID.h"
+
+/**
+ * Message types beyond the framework's MessageType enum. They only exist in
+ * the binary wire format: the value field of a REPLICATE_BATCH frame holds
+ * the packed pairs, and the transID is the chunk ID echoed by the ack.
+ */
+enum BulkMessageType {
+	REPLICATE_BATCH = READREPLY + 1,
+	REPLICATE_BATCH_ACK
+};
+
+// payload bytes per chunk; EmulNet drops anything near MAX_MSG_SIZE (4000)
+#define BATCH_MAX_BYTES		2048
+// unacknowledged chunks per destination
+#define BATCH_WINDOW		4
+// ticks before an unacknowledged chunk is resent
+#define BATCH_RETRY_TICKS	5
+// sends of one chunk before the destination is given up on
+#define BATCH_MAX_ATTEMPTS	8
+// chunk IDs a receiver remembers to drop retransmitted duplicates
+#define BATCH_SEEN_CHUNKS	4096
+
+/**
+ * CLASS NAME: BatchCodec
+ *
+ * DESCRIPTION: Packs key/value pairs into a chunk payload and unpacks them.
+ * 				Payload: (key length, value length, key, value) per pair,
+ * 				lengths as LEB128.
+ */
+class BatchCodec {
+public:
+	static void appendPair(string &payload, StrRef key, StrRef value) {
+		MessageCodec::putVarint(payload, key.size());
+		MessageCodec::putVarint(payload, value.size());
+		payload.append(key.data, key.size());
+		payload.append(value.data, value.size());
+	}
+
+	static size_t pairSize(StrRef key, StrRef value) {
+		return key.size() + value.size() + 2 * 5;
+	}
+
+	/**
+	 * Splits a payload into pairs; returns false if it is malformed
+	 */
+	static bool unpack(StrRef payload, vector<pair<StrRef, StrRef> > &pairs) {
+		const unsigned char *p = (const unsigned char *)payload.data;
+		const unsigned char *end = p + payload.len;
+		while ( p < end ) {
+			unsigned long long keyLen, valueLen;
+			if ( !MessageCodec::getVarint(p, end, keyLen) || !MessageCodec::getVarint(p, end, valueLen) ) {
+				return false;
+			}
+			if ( keyLen > (unsigned long long)(end - p) || valueLen > (unsigned long long)(end - p) - keyLen ) {
+				return false;
+			}
+			pairs.push_back(make_pair(StrRef((const char *)p, keyLen), StrRef((const char *)p + keyLen, valueLen)));
+			p += keyLen + valueLen;
+		}
+		return true;
+	}
+};
+
+/**
+ * STRUCT NAME: OutboundChunk
+ *
+ * DESCRIPTION: One chunk ready to go on the wire
+ */
+struct OutboundChunk {
+	Address dest;
+	// REPLICATE_BATCH, or another frame type carrying the same payload
+	int frameType;
+	TransID chunkID;
+	const string *payload;
+};
+
+/**
+ * STRUCT NAME: AbandonedStream
+ *
+ * DESCRIPTION: A stream given up on, and how many of its chunks never got through
+ */
+struct AbandonedStream {
+	Address dest;
+	int frameType;
+	size_t chunks;
+};
+
+/**
+ * CLASS NAME: ReplicationSender
+ *
+ * DESCRIPTION: Streams of chunks per destination and frame type. Pairs are
+ * 				packed into size-bounded chunks; each tick pump() releases
+ * 				chunks up to the per-stream window and resends chunks whose
+ * 				ack is overdue. A chunk leaves the stream when its ack arrives.
+ */
+class ReplicationSender {
+private:
+	struct Chunk {
+		TransID id;
+		string payload;
+		int sentAt;
+		int attempts;
+	};
+
+	struct Stream {
+		Address dest;
+		int frameType;
+		// chunk being filled
+		string open;
+		// closed chunks not sent yet
+		deque<Chunk> queued;
+		// sent, waiting for an ack; a list so payload pointers survive other acks
+		list<Chunk> inFlight;
+	};
+
+	// keyed by Address::getAddress() and frame type
+	map<pair<string, int>, Stream> streams;
+	TransIDAllocator *ids;
+	unsigned long chunksSent;
+	unsigned long chunksResent;
+	unsigned long chunksAbandoned;
+
+	void close(Stream &s) {
+		if ( s.open.empty() ) {
+			return;
+		}
+		Chunk c;
+		c.id = ids->next((MessageType)TRANSID_OP_REPLICATION);
+		c.payload.swap(s.open);
+		c.sentAt = 0;
+		c.attempts = 0;
+		s.queued.push_back(c);
+	}
+
+public:
+	ReplicationSender(TransIDAllocator *ids) : ids(ids), chunksSent(0), chunksResent(0), chunksAbandoned(0) {}
+
+	/**
+	 * Queues one pair for dest, closing the open chunk when it is full
+	 */
+	void enqueue(Address &dest, StrRef key, StrRef value, int frameType = REPLICATE_BATCH) {
+		Stream &s = streams[make_pair(dest.getAddress(), frameType)];
+		s.dest = dest;
+		s.frameType = frameType;
+		if ( !s.open.empty() && s.open.size() + BatchCodec::pairSize(key, value) > BATCH_MAX_BYTES ) {
+			close(s);
+		}
+		BatchCodec::appendPair(s.open, key, value);
+	}
+
+	/**
+	 * Collects the chunks to send at tick now: overdue retransmissions first,
+	 * then new chunks while the window has room. Payload pointers stay valid
+	 * until that chunk is acked or its stream is abandoned. Streams whose
+	 * destination stopped acking are dropped and appended to abandoned.
+	 */
+	void pump(int now, vector<OutboundChunk> &out, vector<AbandonedStream> &abandoned) {
+		for ( map<pair<string, int>, Stream>::iterator it = streams.begin(); it != streams.end(); ) {
+			Stream &s = it->second;
+			close(s);
+			bool abandon = false;
+			for ( list<Chunk>::iterator c = s.inFlight.begin(); c != s.inFlight.end() && !abandon; ++c ) {
+				abandon = now - c->sentAt >= BATCH_RETRY_TICKS && c->attempts >= BATCH_MAX_ATTEMPTS;
+			}
+			if ( abandon ) {
+				AbandonedStream a = { s.dest, s.frameType, s.inFlight.size() + s.queued.size() };
+				abandoned.push_back(a);
+				chunksAbandoned += a.chunks;
+				streams.erase(it++);
+				continue;
+			}
+			for ( list<Chunk>::iterator chunk = s.inFlight.begin(); chunk != s.inFlight.end(); ++chunk ) {
+				Chunk &c = *chunk;
+				if ( now - c.sentAt < BATCH_RETRY_TICKS ) {
+					continue;
+				}
+				c.sentAt = now;
+				c.attempts++;
+				chunksResent++;
+				OutboundChunk o = { s.dest, s.frameType, c.id, &c.payload };
+				out.push_back(o);
+			}
+			while ( s.inFlight.size() < BATCH_WINDOW && !s.queued.empty() ) {
+				s.inFlight.push_back(s.queued.front());
+				s.queued.pop_front();
+				Chunk &c = s.inFlight.back();
+				c.sentAt = now;
+				c.attempts = 1;
+				chunksSent++;
+				OutboundChunk o = { s.dest, s.frameType, c.id, &c.payload };
+				out.push_back(o);
+			}
+			if ( s.inFlight.empty() && s.queued.empty() ) {
+				streams.erase(it++);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	/**
+	 * Marks a chunk as delivered
+	 */
+	void ack(Address &from, TransID chunkID) {
+		string dest = from.getAddress();
+		for ( map<pair<string, int>, Stream>::iterator it = streams.lower_bound(make_pair(dest, INT_MIN));
+				it != streams.end() && it->first.first == dest; ++it ) {
+			list<Chunk> &inFlight = it->second.inFlight;
+			for ( list<Chunk>::iterator c = inFlight.begin(); c != inFlight.end(); ++c ) {
+				if ( c->id == chunkID ) {
+					inFlight.erase(c);
+					return;
+				}
+			}
+		}
+	}
+
+	bool idle() const {
+		return streams.empty();
+	}
+
+	/**
+	 * Payload bytes of dest's stream of frameType not acked yet
+	 */
+	size_t pendingBytes(Address &dest, int frameType) const {
+		map<pair<string, int>, Stream>::const_iterator it = streams.find(make_pair(dest.getAddress(), frameType));
+		if ( it == streams.end() ) {
+			return 0;
+		}
+		const Stream &s = it->second;
+		size_t total = s.open.size();
+		for ( deque<Chunk>::const_iterator c = s.queued.begin(); c != s.queued.end(); ++c ) {
+			total += c->payload.size();
+		}
+		for ( list<Chunk>::const_iterator c = s.inFlight.begin(); c != s.inFlight.end(); ++c ) {
+			total += c->payload.size();
+		}
+		return total;
+	}
+
+	unsigned long getChunksSent() const {
+		return chunksSent;
+	}
+
+	unsigned long getChunksResent() const {
+		return chunksResent;
+	}
+
+	unsigned long getChunksAbandoned() const {
+		return chunksAbandoned;
+	}
+};
+
+/**
+ * CLASS NAME: ChunkDeduplicator
+ *
+ * DESCRIPTION: Remembers the most recent chunk IDs a node applied, so a
+ * 				retransmitted chunk whose ack was lost is acked again
+ * 				without being applied twice
+ */
+class ChunkDeduplicator {
+private:
+	set<TransID> seen;
+	deque<TransID> order;
+
+public:
+	/**
+	 * Returns true the first time chunkID is offered
+	 */
+	bool firstTime(TransID chunkID) {
+		if ( !seen.insert(chunkID).second ) {
+			return false;
+		}
+		order.push_back(chunkID);
+		if ( order.size() > BATCH_SEEN_CHUNKS ) {
+			seen.erase(order.front());
+			order.pop_front();
+		}
+		return true;
+	}
+};
+
+#endif /* BULKTRANSFER_H_ */
@@ -0,0 +1,251 @@
+/**********************************
+ * FILE NAME: HashRing.h
+ *
+ * DESCRIPTION: Consistent-hash ring with precomputed replica preference lists
+ **********************************/
+
+#ifndef HASHRING_H_
+#define HASHRING_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Member.h"
+#include "Node.h"
+
+#define REPLICATION_FACTOR	3
+
+/**
+ * STRUCT NAME: ReplicaView
+ *
+ * DESCRIPTION: Non-owning view of the replicas of one key, primary first.
+ * 				Valid until the ring is rebuilt.
+ */
+struct ReplicaView {
+	Node *nodes;
+	size_t count;
+
+	ReplicaView() : nodes(NULL), count(0) {}
+	ReplicaView(Node *nodes, size_t count) : nodes(nodes), count(count) {}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	Node & operator[](size_t i) const {
+		return nodes[i];
+	}
+
+	Node * begin() const {
+		return nodes;
+	}
+
+	Node * end() const {
+		return nodes + count;
+	}
+};
+
+/**
+ * CLASS NAME: HashRing
+ *
+ * DESCRIPTION: Sorted array of ring tokens plus, for every token, the list of
+ * 				distinct physical nodes that store keys falling into that
+ * 				token's range (the owner and its successors). Built once per
+ * 				membership change; a lookup is a binary search and returns a
+ * 				view into the table.
+ *
+ * 				Each physical node places tokensPerNode tokens on the ring,
+ * 				scaled by an optional per-node weight. Token 0 is the node's
+ * 				own hash code, so one token per node (the default) is the
+ * 				classic one-position-per-node ring.
+ */
+class HashRing {
+private:
+	struct Token {
+		size_t hash;
+		// unreduced hash; orders tokens that collide on the ring without favouring any node
+		size_t tiebreak;
+		size_t member;
+		bool operator<(const Token &another) const {
+			if ( hash != another.hash ) {
+				return hash < another.hash;
+			}
+			return tiebreak < another.tiebreak || (tiebreak == another.tiebreak && member < another.member);
+		}
+	};
+
+	// hash code of every token, ascending
+	vector<size_t> slotHashes;
+	// physical owner (index into members) of every token
+	vector<size_t> slotOwners;
+	// replicas of every token, flattened: token i owns [i*replicas, (i+1)*replicas)
+	vector<Node> preference;
+	// replicas per token, the replication factor capped at the number of members
+	size_t replicas;
+	size_t replicationFactor;
+	// membership the table was built from, sorted by hash code
+	vector<Node> members;
+
+	// virtual node configuration
+	int tokensPerNode;
+	map<string, double> weights;
+	bool configChanged;
+
+	int tokensFor(Node &node) {
+		map<string, double>::iterator it = weights.find(node.getAddress()->getAddress());
+		double weight = (it == weights.end()) ? 1.0 : it->second;
+		int tokens = (int)(tokensPerNode * weight + 0.5);
+		return tokens < 1 ? 1 : tokens;
+	}
+
+	static size_t fullTokenHash(Node &node, int token) {
+		std::hash<string> hashFunc;
+		return hashFunc(node.getAddress()->getAddress() + "#" + to_string(token));
+	}
+
+public:
+	HashRing() : replicas(0), replicationFactor(0), tokensPerNode(1), configChanged(false) {}
+
+	static bool sameAddress(Node &a, Node &b) {
+		return memcmp(a.getAddress()->addr, b.getAddress()->addr, sizeof(a.getAddress()->addr)) == 0;
+	}
+
+	/**
+	 * Number of tokens each physical node of weight 1 places on the ring
+	 */
+	void setTokensPerNode(int tokens) {
+		tokensPerNode = tokens < 1 ? 1 : tokens;
+		configChanged = true;
+	}
+
+	int getTokensPerNode() const {
+		return tokensPerNode;
+	}
+
+	/**
+	 * Relative capacity of one node; it gets weight * tokensPerNode tokens
+	 */
+	void setWeight(Address &addr, double weight) {
+		weights[addr.getAddress()] = weight;
+		configChanged = true;
+	}
+
+	/**
+	 * False once the tokens or the replication factor are no longer those the
+	 * ring was built with, whatever the membership
+	 */
+	bool isConfiguredFor(size_t replicationFactor) const {
+		return !configChanged && replicationFactor == this->replicationFactor;
+	}
+
+	/**
+	 * True if sortedMembers is the membership the ring was built from
+	 */
+	bool isBuiltFrom(vector<Node> &sortedMembers, size_t replicationFactor) {
+		if ( configChanged || replicationFactor != this->replicationFactor || sortedMembers.size() != members.size() ) {
+			return false;
+		}
+		for ( size_t i = 0; i < members.size(); i++ ) {
+			if ( !sameAddress(members[i], sortedMembers[i]) ) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Rebuilds the token table from a membership list sorted by hash code
+	 */
+	void build(vector<Node> &sortedMembers, size_t replicationFactor) {
+		members = sortedMembers;
+		this->replicationFactor = replicationFactor;
+		replicas = min(replicationFactor, members.size());
+		configChanged = false;
+
+		vector<Token> tokens;
+		for ( size_t m = 0; m < members.size(); m++ ) {
+			int count = tokensFor(members[m]);
+			for ( int t = 0; t < count; t++ ) {
+				Token token;
+				token.tiebreak = fullTokenHash(members[m], t);
+				token.hash = (t == 0) ? members[m].getHashCode() : token.tiebreak % RING_SIZE;
+				token.member = m;
+				tokens.push_back(token);
+			}
+		}
+		sort(tokens.begin(), tokens.end());
+
+		slotHashes.clear();
+		slotOwners.clear();
+		preference.clear();
+		slotHashes.reserve(tokens.size());
+		slotOwners.reserve(tokens.size());
+		preference.reserve(tokens.size() * replicas);
+		vector<size_t> picked;
+		for ( size_t i = 0; i < tokens.size(); i++ ) {
+			slotHashes.push_back(tokens[i].hash);
+			slotOwners.push_back(tokens[i].member);
+			// walk clockwise, skipping tokens of nodes already in the list
+			picked.clear();
+			for ( size_t j = i; picked.size() < replicas; j = (j + 1) % tokens.size() ) {
+				if ( find(picked.begin(), picked.end(), tokens[j].member) == picked.end() ) {
+					picked.push_back(tokens[j].member);
+					preference.push_back(members[tokens[j].member]);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Index of the token that owns hash: the first token whose hash code is
+	 * >= hash, wrapping to token 0 past the largest one
+	 */
+	size_t slotFor(size_t hash) const {
+		size_t slot = lower_bound(slotHashes.begin(), slotHashes.end(), hash) - slotHashes.begin();
+		return slot == slotHashes.size() ? 0 : slot;
+	}
+
+	ReplicaView lookup(size_t hash) {
+		if ( slotHashes.empty() ) {
+			return ReplicaView();
+		}
+		return ReplicaView(&preference[slotFor(hash) * replicas], replicas);
+	}
+
+	// number of tokens on the ring
+	size_t size() const {
+		return slotHashes.size();
+	}
+
+	size_t memberCount() const {
+		return members.size();
+	}
+
+	Node & member(size_t i) {
+		return members[i];
+	}
+
+	/**
+	 * Fraction of the ring (as primary owner) held by each member, indexed like member()
+	 */
+	vector<double> ownershipShares() const {
+		vector<double> shares(members.size(), 0.0);
+		for ( size_t i = 0; i < slotHashes.size(); i++ ) {
+			// token i owns (previous token, token i]
+			size_t prev = slotHashes[(i + slotHashes.size() - 1) % slotHashes.size()];
+			size_t span = (slotHashes[i] + RING_SIZE - prev) % RING_SIZE;
+			if ( slotHashes.size() == 1 ) {
+				span = RING_SIZE;
+			}
+			shares[slotOwners[i]] += (double)span / RING_SIZE;
+		}
+		return shares;
+	}
+};
+
+#endif /* HASHRING_H_ */
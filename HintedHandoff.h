@@ -0,0 +1,124 @@
+/**********************************
+ * FILE NAME: HintedHandoff.h
+ *
+ * DESCRIPTION: Bounded per-target buffers of writes a replica missed
+ **********************************/
+
+#ifndef HINTEDHANDOFF_H_
+#define HINTEDHANDOFF_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <deque>
+#include "Member.h"
+
+// hints kept per target; the oldest are dropped beyond this
+#define HINT_MAX_PER_TARGET		1024
+
+/**
+ * STRUCT NAME: Hint
+ *
+ * DESCRIPTION: One missed write, in the stored (versioned) form so replay is
+ * 				idempotent and never overwrites a newer value
+ */
+struct Hint {
+	string key;
+	string stored;
+};
+
+/**
+ * CLASS NAME: HintStore
+ *
+ * DESCRIPTION: Hints grouped by the replica that missed them. A target's
+ * 				hints are handed back in one batch, either once the target
+ * 				is heard from again after its first hint or once it has left
+ * 				the ring and the hints must go to the keys' new owners.
+ */
+class HintStore {
+public:
+	struct Target {
+		Address addr;
+		deque<Hint> hints;
+		// tick of the first hint still buffered, and of the last message from the target
+		int since;
+		int lastHeard;
+	};
+
+private:
+	// keyed by the 6 address bytes
+	map<unsigned long long, Target> targets;
+	unsigned long hintsStored;
+	unsigned long hintsDropped;
+
+	static unsigned long long keyOf(Address &addr) {
+		unsigned long long k = 0;
+		memcpy(&k, addr.addr, sizeof(addr.addr));
+		return k;
+	}
+
+public:
+	HintStore() : hintsStored(0), hintsDropped(0) {}
+
+	void add(Address &target, const string &key, const string &stored, int now) {
+		Target &t = targets[keyOf(target)];
+		if ( t.hints.empty() ) {
+			t.addr = target;
+			t.since = now;
+			t.lastHeard = -1;
+		}
+		if ( t.hints.size() >= HINT_MAX_PER_TARGET ) {
+			t.hints.pop_front();
+			hintsDropped++;
+		}
+		Hint h = { key, stored };
+		t.hints.push_back(h);
+		hintsStored++;
+	}
+
+	/**
+	 * Notes that a message from addr arrived at tick now; cheap when no hints are buffered
+	 */
+	void heardFrom(Address &addr, int now) {
+		if ( targets.empty() ) {
+			return;
+		}
+		map<unsigned long long, Target>::iterator it = targets.find(keyOf(addr));
+		if ( it != targets.end() ) {
+			it->second.lastHeard = now;
+		}
+	}
+
+	bool empty() const {
+		return targets.empty();
+	}
+
+	map<unsigned long long, Target>::iterator begin() {
+		return targets.begin();
+	}
+
+	map<unsigned long long, Target>::iterator end() {
+		return targets.end();
+	}
+
+	/**
+	 * Removes a target whose hints were replayed; returns the next one
+	 */
+	map<unsigned long long, Target>::iterator erase(map<unsigned long long, Target>::iterator it) {
+		map<unsigned long long, Target>::iterator next = it;
+		++next;
+		targets.erase(it);
+		return next;
+	}
+
+	unsigned long getHintsStored() const {
+		return hintsStored;
+	}
+
+	unsigned long getHintsDropped() const {
+		return hintsDropped;
+	}
+};
+
+#endif /* HINTEDHANDOFF_H_ */
@@ -0,0 +1,133 @@
+/**********************************
+ * FILE NAME: LatencyTracker.h
+ *
+ * DESCRIPTION: Coordinator-side reply latency estimates per replica, and
+ * 				latency distributions for hedging and reporting
+ **********************************/
+
+#ifndef LATENCYTRACKER_H_
+#define LATENCYTRACKER_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Member.h"
+
+// weight of a new sample in a peer's moving average
+#define LATENCY_EWMA_ALPHA		0.2
+// histogram buckets, one per tick; the last also counts anything slower
+#define LATENCY_BUCKETS			64
+// samples after which a histogram is halved, so old behaviour fades out
+#define LATENCY_DECAY_SAMPLES	4096
+
+/**
+ * CLASS NAME: LatencyHistogram
+ *
+ * DESCRIPTION: Counts of latencies in whole ticks
+ */
+class LatencyHistogram {
+private:
+	vector<unsigned long> buckets;
+	unsigned long total;
+	bool decays;
+
+public:
+	LatencyHistogram(bool decays = false) : buckets(LATENCY_BUCKETS, 0), total(0), decays(decays) {}
+
+	void record(int ticks) {
+		buckets[min(max(ticks, 0), LATENCY_BUCKETS - 1)]++;
+		total++;
+		if ( decays && total >= LATENCY_DECAY_SAMPLES ) {
+			total = 0;
+			for ( size_t i = 0; i < buckets.size(); i++ ) {
+				buckets[i] /= 2;
+				total += buckets[i];
+			}
+		}
+	}
+
+	/**
+	 * Smallest latency at or below which a fraction p of the samples fall; -1 if empty
+	 */
+	int percentile(double p) const {
+		if ( total == 0 ) {
+			return -1;
+		}
+		unsigned long rank = (unsigned long)(p * total);
+		unsigned long seen = 0;
+		for ( size_t i = 0; i < buckets.size(); i++ ) {
+			seen += buckets[i];
+			if ( seen > rank || seen == total ) {
+				return (int)i;
+			}
+		}
+		return LATENCY_BUCKETS - 1;
+	}
+
+	unsigned long count() const {
+		return total;
+	}
+};
+
+/**
+ * CLASS NAME: LatencyTracker
+ *
+ * DESCRIPTION: Per replica, a moving average of the ticks between sending it
+ * 				a request and its reply. Replies of all replicas also go into
+ * 				one decaying histogram whose percentiles set the hedge delay.
+ * 				Completed reads go into a separate histogram for reporting.
+ */
+class LatencyTracker {
+private:
+	// keyed by the 6 address bytes
+	map<unsigned long long, double> estimates;
+	LatencyHistogram replies;
+	LatencyHistogram reads;
+
+	static unsigned long long keyOf(const Address &addr) {
+		unsigned long long k = 0;
+		memcpy(&k, addr.addr, sizeof(addr.addr));
+		return k;
+	}
+
+public:
+	LatencyTracker() : replies(true), reads(false) {}
+
+	void recordReply(const Address &peer, int ticks) {
+		map<unsigned long long, double>::iterator it = estimates.find(keyOf(peer));
+		if ( it == estimates.end() ) {
+			estimates[keyOf(peer)] = ticks;
+		}
+		else {
+			it->second += LATENCY_EWMA_ALPHA * (ticks - it->second);
+		}
+		replies.record(ticks);
+	}
+
+	void recordRead(int ticks) {
+		reads.record(ticks);
+	}
+
+	/**
+	 * Moving average for peer; peers never heard from get 0 so they are tried
+	 */
+	double estimate(const Address &peer) const {
+		map<unsigned long long, double>::const_iterator it = estimates.find(keyOf(peer));
+		return it == estimates.end() ? 0 : it->second;
+	}
+
+	int replyPercentile(double p) const {
+		return replies.percentile(p);
+	}
+
+	int readPercentile(double p) const {
+		return reads.percentile(p);
+	}
+
+	unsigned long readCount() const {
+		return reads.count();
+	}
+};
+
+#endif /* LATENCYTRACKER_H_ */
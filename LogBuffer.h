@@ -0,0 +1,633 @@
+/**********************************
+ * FILE NAME: LogBuffer.h
+ *
+ * DESCRIPTION: Front for the framework Log that can hold a thread's CRUD log
+ * 				lines and replay them later from the thread that owns the Log,
+ * 				and can hand formatting and writing them to a background
+ * 				thread that owns the Log
+ **********************************/
+
+#ifndef LOGBUFFER_H_
+#define LOGBUFFER_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Log.h"
+#include "MessageCodec.h"
+#include "MPSCRing.h"
+
+// events the background writer can be behind by before producers wait
+#define ASYNC_LOG_CAPACITY		16384
+// events the writer takes off the ring between looking at its traces
+#define ASYNC_LOG_BATCH			256
+// dbg.log lines handed to one Log::LOG call; Log formats into a 30000-byte buffer
+#define ASYNC_LOG_BLOCK_BYTES	16384
+// trace bytes buffered before a write()
+#define ASYNC_LOG_WRITE_BYTES	65536
+#define TRACE_MAGIC				"MP2TRACE"
+
+class TraceFile;
+
+/**
+ * STRUCT NAME: LogEvent
+ *
+ * DESCRIPTION: Arguments of one Log call, and the tick it was made at
+ */
+struct LogEvent {
+	enum Kind { CREATE_OK, CREATE_FAIL, READ_OK, READ_FAIL, UPDATE_OK, UPDATE_FAIL, DELETE_OK, DELETE_FAIL, TEXT,
+			NODE_ADD, NODE_REMOVE };
+
+	Kind kind;
+	Address addr;
+	// the member a NODE_ADD / NODE_REMOVE is about
+	Address peer;
+	bool isCoordinator;
+	int transID;
+	int time;
+	string key;
+	// the value, or a TEXT event's message
+	string value;
+	// goes to dbg.log
+	bool text;
+	// also recorded there, unless NULL
+	TraceFile *trace;
+
+	LogEvent() : kind(TEXT), isCoordinator(false), transID(0), time(0), text(false), trace(NULL) {}
+
+	/**
+	 * Makes the Log call the event stands for
+	 */
+	void writeTo(Log *log) const {
+		switch ( kind ) {
+			case CREATE_OK:		log->logCreateSuccess((Address *)&addr, isCoordinator, transID, key, value); break;
+			case CREATE_FAIL:	log->logCreateFail((Address *)&addr, isCoordinator, transID, key, value); break;
+			case READ_OK:		log->logReadSuccess((Address *)&addr, isCoordinator, transID, key, value); break;
+			case READ_FAIL:		log->logReadFail((Address *)&addr, isCoordinator, transID, key); break;
+			case UPDATE_OK:		log->logUpdateSuccess((Address *)&addr, isCoordinator, transID, key, value); break;
+			case UPDATE_FAIL:	log->logUpdateFail((Address *)&addr, isCoordinator, transID, key, value); break;
+			case DELETE_OK:		log->logDeleteSuccess((Address *)&addr, isCoordinator, transID, key); break;
+			case DELETE_FAIL:	log->logDeleteFail((Address *)&addr, isCoordinator, transID, key); break;
+			case TEXT:			log->LOG((Address *)&addr, "%s", value.c_str()); break;
+			case NODE_ADD:		log->logNodeAdd((Address *)&addr, (Address *)&peer); break;
+			case NODE_REMOVE:	log->logNodeRemove((Address *)&addr, (Address *)&peer); break;
+		}
+	}
+};
+
+/**
+ * CLASS NAME: LogFormat
+ *
+ * DESCRIPTION: The exact bytes the framework's Log::LOG and Log::log* write to
+ * 				dbg.log for an event, so lines formatted elsewhere can be
+ * 				handed to Log::LOG in bulk without changing the file. Must be
+ * 				kept in step with Log.cpp.
+ */
+class LogFormat {
+public:
+	/**
+	 * False for lines Log would not write verbatim as part of a block: it
+	 * passes its buffer to fprintf as the format, so a '%' is expanded, and
+	 * a message starting with #STATSLOG# goes to stats.log. Those, and the
+	 * membership lines, are written by their own Log call.
+	 */
+	static bool batchable(const LogEvent &e) {
+		if ( e.kind > LogEvent::TEXT ) {
+			return false;
+		}
+		if ( e.kind == LogEvent::TEXT && e.value.compare(0, 10, "#STATSLOG#") == 0 ) {
+			return false;
+		}
+		return e.key.find('%') == string::npos && e.value.find('%') == string::npos;
+	}
+
+	// "\n <addr> [<time>] ", written by Log::LOG in front of every message
+	static void appendPrefix(string &out, const Address &addr, int time) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "\n %d.%d.%d.%d:%d [%d] ", addr.addr[0], addr.addr[1], addr.addr[2], addr.addr[3],
+				*(short *)&addr.addr[4], time);
+		out.append(buf);
+	}
+
+	// the message Log::log* passes to Log::LOG
+	static void appendBody(string &out, const LogEvent &e) {
+		static const char *what[] = { "create success", "create fail", "read success", "read fail",
+				"update success", "update fail", "delete success", "delete fail" };
+		if ( e.kind == LogEvent::TEXT ) {
+			out.append(e.value.c_str());
+			return;
+		}
+		char buf[96];
+		snprintf(buf, sizeof(buf), "%s: %s at time %d, transID=%d, key=", e.isCoordinator ? "coordinator" : "server",
+				what[e.kind], e.time, e.transID);
+		out.append(buf);
+		// Log prints the strings with %s, i.e. up to the first NUL
+		out.append(e.key.c_str());
+		if ( e.kind != LogEvent::READ_FAIL && e.kind != LogEvent::DELETE_OK && e.kind != LogEvent::DELETE_FAIL ) {
+			out.append(", value=");
+			out.append(e.value.c_str());
+		}
+	}
+};
+
+/**
+ * CLASS NAME: TraceFile
+ *
+ * DESCRIPTION: Compact binary trace of CRUD log events. Record: kind (top
+ * 				bit: coordinator), address, then varints of time, zigzag
+ * 				transID and key and value lengths, then key and value.
+ * 				Appended to and written by the AsyncLog thread only, in
+ * 				ASYNC_LOG_WRITE_BYTES pieces.
+ */
+class TraceFile {
+private:
+	int fd;
+	string buffer;
+
+	TraceFile(const TraceFile &);
+	TraceFile & operator=(const TraceFile &);
+
+	static void writeAll(int fd, const string &bytes) {
+		size_t done = 0;
+		while ( done < bytes.size() ) {
+			ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+			if ( n < 0 && errno == EINTR ) {
+				continue;
+			}
+			if ( n <= 0 ) {
+				return;
+			}
+			done += n;
+		}
+	}
+
+public:
+	TraceFile(const string &path) {
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ( fd >= 0 ) {
+			writeAll(fd, TRACE_MAGIC);
+		}
+	}
+
+	~TraceFile() {
+		if ( fd >= 0 ) {
+			flush(true);
+			::close(fd);
+		}
+	}
+
+	bool isOpen() const {
+		return fd >= 0;
+	}
+
+	/**
+	 * Returns true if the buffer was empty before
+	 */
+	bool append(const LogEvent &e) {
+		bool wasEmpty = buffer.empty();
+		buffer.push_back((char)(e.kind | (e.isCoordinator ? 0x80 : 0)));
+		buffer.append(e.addr.addr, sizeof(e.addr.addr));
+		MessageCodec::putVarint(buffer, (unsigned int)e.time);
+		MessageCodec::putVarint(buffer, ((unsigned int)e.transID << 1) ^ (unsigned int)(e.transID >> 31));
+		MessageCodec::putVarint(buffer, e.key.size());
+		buffer.append(e.key);
+		MessageCodec::putVarint(buffer, e.value.size());
+		buffer.append(e.value);
+		return wasEmpty;
+	}
+
+	/**
+	 * Writes the buffer once it is large enough, or now if force; returns
+	 * true if nothing is left in it
+	 */
+	bool flush(bool force) {
+		if ( fd >= 0 && !buffer.empty() && (force || buffer.size() >= ASYNC_LOG_WRITE_BYTES) ) {
+			writeAll(fd, buffer);
+			buffer.clear();
+		}
+		return buffer.empty();
+	}
+};
+
+/**
+ * CLASS NAME: AsyncLog
+ *
+ * DESCRIPTION: The process's one log writer thread, and the one Log it writes
+ * 				through (Log keeps its state in statics, so two writers would
+ * 				race). Producers copy events into the cells of a lock-free
+ * 				ring; the cells keep their string buffers, so once warmed up
+ * 				queuing an event allocates nothing. The thread pops them in
+ * 				batches, formats consecutive dbg.log lines into blocks of up
+ * 				to ASYNC_LOG_BLOCK_BYTES and passes each block to Log::LOG as
+ * 				one message, so Log's prefix, vsprintf and fflush are paid
+ * 				once per block; it also makes the trace appends. Nobody ever
+ * 				waits for it except to tear a trace down.
+ *
+ * 				Its Log runs on a copy of the framework Params whose time
+ * 				the thread sets to the tick of the block's first line, so
+ * 				the file reads as if each line had been logged directly.
+ * 				getLog() is the Log to hand the nodes; nothing may call it
+ * 				except through a LogBuffer.
+ */
+class AsyncLog {
+private:
+	Params clock;
+	Log log;
+	MPSCRing<LogEvent> events;
+	std::atomic<unsigned long> pushed;
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable drained;
+	// guarded by lock: events written out, counted while the ring is empty
+	unsigned long consumed;
+	bool stopping;
+	// writer thread only
+	unsigned long popped;
+	vector<TraceFile *> dirty;
+	string block;
+	size_t blockLines;
+	Address blockAddr;
+	int blockTime;
+	string line;
+
+	AsyncLog(const AsyncLog &);
+	AsyncLog & operator=(const AsyncLog &);
+
+	static std::mutex & registryLock() {
+		static std::mutex guard;
+		return guard;
+	}
+
+	static std::weak_ptr<AsyncLog> & registry() {
+		static std::weak_ptr<AsyncLog> current;
+		return current;
+	}
+
+	void writeBlock() {
+		if ( blockLines > 0 ) {
+			clock.globaltime = blockTime;
+			log.LOG(&blockAddr, "%s", block.c_str());
+			block.clear();
+			blockLines = 0;
+		}
+	}
+
+	void write(const LogEvent &e) {
+		if ( !LogFormat::batchable(e) ) {
+			writeBlock();
+			clock.globaltime = e.time;
+			e.writeTo(&log);
+			return;
+		}
+		line.clear();
+		LogFormat::appendBody(line, e);
+		if ( blockLines > 0 && block.size() + line.size() + 64 > ASYNC_LOG_BLOCK_BYTES ) {
+			writeBlock();
+		}
+		if ( blockLines == 0 ) {
+			// Log writes this line's prefix itself
+			blockAddr = e.addr;
+			blockTime = e.time;
+		}
+		else {
+			LogFormat::appendPrefix(block, e.addr, e.time);
+		}
+		block.append(line);
+		blockLines++;
+	}
+
+	void run() {
+		LogEvent e;
+		for ( ;; ) {
+			size_t n = 0;
+			while ( n < ASYNC_LOG_BATCH && events.tryPop(e) ) {
+				if ( e.trace != NULL && e.trace->append(e) ) {
+					dirty.push_back(e.trace);
+				}
+				if ( e.text ) {
+					write(e);
+				}
+				n++;
+			}
+			writeBlock();
+			popped += n;
+			if ( n > 0 ) {
+				for ( size_t i = 0; i < dirty.size(); ) {
+					if ( dirty[i]->flush(false) ) {
+						dirty[i] = dirty.back();
+						dirty.pop_back();
+					}
+					else {
+						i++;
+					}
+				}
+				continue;
+			}
+
+			for ( size_t i = 0; i < dirty.size(); i++ ) {
+				dirty[i]->flush(true);
+			}
+			dirty.clear();
+			std::unique_lock<std::mutex> guard(lock);
+			if ( consumed != popped ) {
+				consumed = popped;
+				drained.notify_all();
+			}
+			if ( stopping && consumed == pushed.load() ) {
+				return;
+			}
+			wake.wait_for(guard, std::chrono::milliseconds(1), [&] { return stopping || consumed != pushed.load(); });
+		}
+	}
+
+public:
+	AsyncLog(Params *par) : clock(par != NULL ? *par : Params()), log(&clock), events(ASYNC_LOG_CAPACITY), pushed(0),
+			consumed(0), stopping(false), popped(0), blockLines(0), blockTime(0) {
+		block.reserve(ASYNC_LOG_BLOCK_BYTES);
+		thread = std::thread(&AsyncLog::run, this);
+	}
+
+	~AsyncLog() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+
+	/**
+	 * The writer, started for the first caller and stopped once the last
+	 * one lets go of it
+	 */
+	static std::shared_ptr<AsyncLog> shared(Params *par) {
+		std::lock_guard<std::mutex> hold(registryLock());
+		std::shared_ptr<AsyncLog> writer = registry().lock();
+		if ( !writer ) {
+			writer = std::make_shared<AsyncLog>(par);
+			registry() = writer;
+		}
+		return writer;
+	}
+
+	/**
+	 * The running writer if sink is its Log, else NULL
+	 */
+	static std::shared_ptr<AsyncLog> owner(Log *sink) {
+		std::lock_guard<std::mutex> hold(registryLock());
+		std::shared_ptr<AsyncLog> writer = registry().lock();
+		if ( writer && &writer->log != sink ) {
+			writer.reset();
+		}
+		return writer;
+	}
+
+	Log * getLog() {
+		return &log;
+	}
+
+	/**
+	 * Any thread; copies e into the ring, waiting only while it is full
+	 */
+	void push(const LogEvent &e) {
+		while ( !events.tryPush(e) ) {
+			wake.notify_one();
+			std::this_thread::yield();
+		}
+		pushed++;
+	}
+
+	/**
+	 * Waits until everything pushed so far is written, traces included, and
+	 * the writer holds no trace pointer any more
+	 */
+	void drain() {
+		std::unique_lock<std::mutex> guard(lock);
+		unsigned long target = pushed.load();
+		wake.notify_one();
+		drained.wait(guard, [&] { return consumed >= target; });
+	}
+};
+
+/**
+ * CLASS NAME: LogBuffer
+ *
+ * DESCRIPTION: Same calls as Log. They go straight to the Log unless the
+ * 				calling thread has set a capture list with captureInto(), in
+ * 				which case they are appended there and written by replay().
+ * 				Log is not thread-safe; worker threads capture, the main
+ * 				thread replays.
+ *
+ * 				When the sink is the Log an AsyncLog owns, the main thread
+ * 				only queues its lines there, and the writer thread writes
+ * 				them in the same order with the tick they were logged at.
+ * 				Every line of the process then has to come through
+ * 				LogBuffers, membership lines included (logNodeAdd and
+ * 				logNodeRemove), as in KVBench. With any other Log, such as
+ * 				the one the framework Application shares with MP1Node,
+ * 				lines are written directly and setAsync(true) is refused.
+ * 				setTrace() also records every CRUD event in a binary trace,
+ * 				and can leave dbg.log out altogether.
+ */
+class LogBuffer {
+private:
+	Log *sink;
+	Params *par;
+	std::shared_ptr<AsyncLog> async;
+	TraceFile *trace;
+	bool asyncText;
+	bool textLog;
+	// main thread's next event; reused so queuing one allocates nothing
+	LogEvent scratch;
+
+	LogBuffer(const LogBuffer &);
+	LogBuffer & operator=(const LogBuffer &);
+
+	static vector<LogEvent> *& capture() {
+		static thread_local vector<LogEvent> *events = NULL;
+		return events;
+	}
+
+	void fill(LogEvent &e, LogEvent::Kind kind, Address *address, bool isCoordinator, int transID, const string &key, const string &value) {
+		e.kind = kind;
+		e.addr = *address;
+		e.isCoordinator = isCoordinator;
+		e.transID = transID;
+		e.time = par != NULL ? par->getcurrtime() : 0;
+		e.key = key;
+		e.value = value;
+		e.text = kind == LogEvent::TEXT || textLog;
+		e.trace = NULL;
+	}
+
+	void emit(LogEvent::Kind kind, Address *address, bool isCoordinator, int transID, const string &key, const string &value,
+			Address *peer = NULL) {
+		vector<LogEvent> *events = capture();
+		LogEvent *e = &scratch;
+		if ( events != NULL ) {
+			events->push_back(LogEvent());
+			e = &events->back();
+		}
+		fill(*e, kind, address, isCoordinator, transID, key, value);
+		if ( peer != NULL ) {
+			e->peer = *peer;
+		}
+		if ( events == NULL ) {
+			deliver(scratch);
+		}
+	}
+
+	/**
+	 * Main thread: writes e now, or queues it on the AsyncLog
+	 */
+	void deliver(LogEvent &e) {
+		bool queueText = e.text && asyncText;
+		if ( e.text && !queueText ) {
+			e.writeTo(sink);
+		}
+		e.trace = e.kind < LogEvent::TEXT ? trace : NULL;
+		if ( queueText || e.trace != NULL ) {
+			e.text = queueText;
+			async->push(e);
+		}
+	}
+
+	void release() {
+		if ( async != NULL ) {
+			async->drain();
+		}
+		delete trace;
+		trace = NULL;
+	}
+
+public:
+	LogBuffer(Log *sink, Params *par = NULL) : sink(sink), par(par), async(AsyncLog::owner(sink)), trace(NULL),
+			asyncText(async != NULL), textLog(true) {}
+
+	~LogBuffer() {
+		release();
+	}
+
+	/**
+	 * Whether dbg.log lines are written by the background thread follows
+	 * from the sink; returns false if that is not what enabled asks for
+	 */
+	bool setAsync(bool enabled) {
+		return enabled == asyncText;
+	}
+
+	/**
+	 * Records every CRUD event in a binary trace at path; textLog=false leaves
+	 * them out of dbg.log. Call between ticks.
+	 */
+	bool setTrace(const string &path, bool textLog = true) {
+		this->textLog = textLog;
+		release();
+		trace = new TraceFile(path);
+		if ( !trace->isOpen() ) {
+			delete trace;
+			trace = NULL;
+			return false;
+		}
+		if ( async == NULL ) {
+			async = AsyncLog::shared(par);
+		}
+		return true;
+	}
+
+	/**
+	 * Redirects this thread's calls into events; NULL writes through again
+	 */
+	static void captureInto(vector<LogEvent> *events) {
+		capture() = events;
+	}
+
+	/**
+	 * Writes captured events in order and empties the list
+	 */
+	void replay(vector<LogEvent> &events) {
+		for ( size_t i = 0; i < events.size(); i++ ) {
+			deliver(events[i]);
+		}
+		events.clear();
+	}
+
+	/**
+	 * Free-form line, formatted like Log::LOG's arguments
+	 */
+	void LOG(Address *address, const char *format, ...) {
+		char line[1024];
+		va_list args;
+		va_start(args, format);
+		int size = vsnprintf(line, sizeof(line), format, args);
+		va_end(args);
+		if ( size < 0 ) {
+			return;
+		}
+		string message;
+		if ( (size_t)size < sizeof(line) ) {
+			message.assign(line, size);
+		}
+		else {
+			message.resize(size + 1);
+			va_start(args, format);
+			vsnprintf(&message[0], message.size(), format, args);
+			va_end(args);
+			message.resize(size);
+		}
+		emit(LogEvent::TEXT, address, false, 0, string(), message);
+	}
+
+	void logCreateSuccess(Address *address, bool isCoordinator, int transID, string key, string value) {
+		emit(LogEvent::CREATE_OK, address, isCoordinator, transID, key, value);
+	}
+
+	void logCreateFail(Address *address, bool isCoordinator, int transID, string key, string value) {
+		emit(LogEvent::CREATE_FAIL, address, isCoordinator, transID, key, value);
+	}
+
+	void logReadSuccess(Address *address, bool isCoordinator, int transID, string key, string value) {
+		emit(LogEvent::READ_OK, address, isCoordinator, transID, key, value);
+	}
+
+	void logReadFail(Address *address, bool isCoordinator, int transID, string key) {
+		emit(LogEvent::READ_FAIL, address, isCoordinator, transID, key, string());
+	}
+
+	void logUpdateSuccess(Address *address, bool isCoordinator, int transID, string key, string newValue) {
+		emit(LogEvent::UPDATE_OK, address, isCoordinator, transID, key, newValue);
+	}
+
+	void logUpdateFail(Address *address, bool isCoordinator, int transID, string key, string newValue) {
+		emit(LogEvent::UPDATE_FAIL, address, isCoordinator, transID, key, newValue);
+	}
+
+	void logDeleteSuccess(Address *address, bool isCoordinator, int transID, string key) {
+		emit(LogEvent::DELETE_OK, address, isCoordinator, transID, key, string());
+	}
+
+	void logDeleteFail(Address *address, bool isCoordinator, int transID, string key) {
+		emit(LogEvent::DELETE_FAIL, address, isCoordinator, transID, key, string());
+	}
+
+	void logNodeAdd(Address *thisNode, Address *addedAddr) {
+		emit(LogEvent::NODE_ADD, thisNode, false, 0, string(), string(), addedAddr);
+	}
+
+	void logNodeRemove(Address *thisNode, Address *removedAddr) {
+		emit(LogEvent::NODE_REMOVE, thisNode, false, 0, string(), string(), removedAddr);
+	}
+};
+
+#endif /* LOGBUFFER_H_ */
@@ -5,38 +5,190 @@
  **********************************/
 #include "MP2Node.h"
 
+// the calling worker's deferred effects while a parallel phase runs, NULL otherwise
+static thread_local WorkerContext *activeContext = NULL;
 
 
 /**
  * constructor
  */
-MP2Node::MP2Node(Member *memberNode, Params *par, EmulNet * emulNet, Log * log, Address * address) {
+MP2Node::MP2Node(Member *memberNode, Params *par, EmulNet * emulNet, Log * log, Address * address) : replicator(&transIDs), opLog(log, par) {
 	this->memberNode = memberNode;
 	this->par = par;
 	this->emulNet = emulNet;
 	this->log = log;
-	ht = new HashTable();
+	ht = new OpenHashStorage();
+	customEngine = false;
 	this->memberNode->addr = *address;
 
 	coordinator = false;
 	initialRingSetup = true;
 	ringHasChanged = false;
 	ringSize = 0;
-	posQuorum = new HashTable();
-	negQuorum = new HashTable();
-	readQuorum = new HashTable();	
-	updateQuorum = new HashTable();
+	replyTimeout = REPLY_TIMEOUT;
+	replicationFactor = REPLICATION_FACTOR;
+	textWireFormat = false;
+	timeouts = TimingWheel(par->getcurrtime());
+	transIDs.setNodeID(*(int *)(&memberNode->addr.addr));
+	antiEntropyPeriod = ANTI_ENTROPY_PERIOD;
+	lastAntiEntropy = par->getcurrtime();
+	antiEntropyRound = 0;
+	leaseTicks = READ_LEASE_TICKS;
+	digestReads = false;
+	hedgedReads = false;
+	wal = NULL;
+	snapshotPeriod = SNAPSHOT_PERIOD;
+	lastSnapshot = par->getcurrtime();
+	recovered = false;
+	metricsOut = NULL;
+	metricsPeriod = METRICS_DUMP_PERIOD;
+	lastMetricsDump = par->getcurrtime();
+	pendingShards.resize(1);
+	workers = NULL;
+	inbound = NULL;
 }
 
 /**
  * Destructor
  */
 MP2Node::~MP2Node() {
+	if ( metricsOut != NULL ) {
+		dumpMetrics(true);
+		fclose(metricsOut);
+	}
+	delete workers;
+	if ( inbound != NULL ) {
+		InboundFrame frame;
+		while ( inbound->tryPop(frame) ) {
+			free(frame.data);
+		}
+		delete inbound;
+	}
+	delete wal;
 	delete ht;
 	delete memberNode;
-	delete readQuorum;
-	delete posQuorum;
-	delete negQuorum;
+}
+
+/**
+ * FUNCTION NAME: replaceStorage
+ *
+ * DESCRIPTION: Swaps the local store for another engine, copying the current
+ * 				pairs into it. The key index and Merkle tree describe the
+ * 				contents, not the engine, so they stay valid.
+ */
+void MP2Node::replaceStorage(StorageEngine *engine) {
+	ht->forEach([engine](StrRef key, StrRef value) {
+		engine->create(key.str(), value.str());
+	});
+	delete ht;
+	ht = engine;
+}
+
+/**
+ * FUNCTION NAME: setStorageEngine
+ *
+ * DESCRIPTION: Uses engine (e.g. MapStorage or SegmentStorage) as the local
+ * 				store. A single engine cannot be split between worker
+ * 				threads, so in threaded mode only a ShardedStorage with one
+ * 				shard per worker is accepted; anything else is refused and
+ * 				stays with the caller. setWorkerThreads keeps an accepted
+ * 				engine and refuses to shard it; use setStorageFactory for
+ * 				engines that should follow the thread count.
+ */
+bool MP2Node::setStorageEngine(StorageEngine *engine) {
+	if ( workers != NULL ) {
+		ShardedStorage *sharded = dynamic_cast<ShardedStorage *>(engine);
+		if ( sharded == NULL || sharded->shardCount() != pendingShards.size() ) {
+			opLog.LOG(&memberNode->addr, "storage engine %s refused: %lu worker threads need a sharded store",
+					engine->name(), (unsigned long)pendingShards.size());
+			return false;
+		}
+	}
+	replaceStorage(engine);
+	customEngine = true;
+	return true;
+}
+
+/**
+ * FUNCTION NAME: setStorageFactory
+ *
+ * DESCRIPTION: Rebuilds the local store with factory, as one engine or, in
+ * 				threaded mode, one shard per worker, and keeps using it when
+ * 				the thread count changes
+ */
+void MP2Node::setStorageFactory(const StorageFactory &factory) {
+	storageFactory = factory;
+	customEngine = false;
+	int threads = (int)pendingShards.size();
+	if ( threads > 1 ) {
+		replaceStorage(new ShardedStorage(threads, storageFactory));
+	} else {
+		replaceStorage(storageFactory ? storageFactory(0, 1) : new OpenHashStorage());
+	}
+}
+
+/**
+ * FUNCTION NAME: setWorkerThreads
+ *
+ * DESCRIPTION: Threaded mode. recvLoop pushes receive buffers into a lock-free
+ * 				ring, and checkMessages hands each worker the messages of one
+ * 				shard: requests by the ring position of their key (the local
+ * 				store is split the same way, each shard built by the storage
+ * 				factory), replies by transaction ID (the pending table is
+ * 				split the same way). Workers share no mutable state, so no
+ * 				locks are taken while handling. In-flight operations are
+ * 				moved to their new shard. An engine given to setStorageEngine
+ * 				is kept with one thread and cannot be sharded, so more
+ * 				threads are refused then.
+ */
+bool MP2Node::setWorkerThreads(int threads) {
+	if ( threads < 1 ) {
+		threads = 1;
+	}
+	if ( threads == (int)pendingShards.size() ) {
+		return true;
+	}
+	if ( threads > 1 && customEngine ) {
+		opLog.LOG(&memberNode->addr, "%d worker threads refused: storage engine %s cannot be sharded, set a storage factory instead",
+				threads, ht->name());
+		return false;
+	}
+
+	vector<PendingOpTable> old;
+	old.swap(pendingShards);
+	pendingShards.resize(threads);
+	for ( size_t s = 0; s < old.size(); s++ ) {
+		for ( size_t i = 0; i < old[s].capacity(); i++ ) {
+			PendingOp *op = old[s].slot(i);
+			if ( op != NULL ) {
+				*pendingFor(op->transID).insert(op->transID) = std::move(*op);
+			}
+		}
+	}
+
+	delete workers;
+	workers = NULL;
+	workerContexts.clear();
+	metrics.setThreads(threads == 1 ? 0 : threads);
+	if ( wal != NULL ) {
+		wal->setShards(threads);
+	}
+	if ( threads == 1 ) {
+		if ( !customEngine ) {
+			replaceStorage(storageFactory ? storageFactory(0, 1) : new OpenHashStorage());
+		}
+		return true;
+	}
+	replaceStorage(new ShardedStorage(threads, storageFactory));
+	workers = new WorkerPool(threads);
+	workerContexts.resize(threads);
+	for ( int w = 0; w < threads; w++ ) {
+		workerContexts[w].metrics = &metrics.shard(w + 1);
+	}
+	if ( inbound == NULL ) {
+		inbound = new MPSCRing<InboundFrame>(INBOUND_RING_CAPACITY);
+	}
+	return true;
 }
 
 /**
@@ -50,32 +202,71 @@ MP2Node::~MP2Node() {
  */
 void MP2Node::updateRing() {
 	
-	vector<Node> curMemList;
+	// Steps 1 and 2 only when MP1's list or the ring settings moved since the last check;
+	// rebuilding and comparing the sorted list costs O(n) every tick otherwise
+	if(!hashRing.isConfiguredFor(replicationFactor) || membershipChanged())
+	{
+		vector<Node> curMemList;
 
-	// Step 1. Get the current membership list from Membership Protocol / MP1
-	curMemList = getMembershipList();
+		// Step 1. Get the current membership list from Membership Protocol / MP1
+		curMemList = getMembershipList();
 
-	//Step 2: Construct the ring
-	sort(curMemList.begin(), curMemList.end());		// sort ring based on hashCode
-	ring = curMemList;
+		//Step 2: Construct the ring
+		sort(curMemList.begin(), curMemList.end());		// sort ring based on hashCode
+		if(!hashRing.isBuiltFrom(curMemList, replicationFactor))		// membership changed
+		{
+			ring = curMemList;
+			previousRing = hashRing;
+			hashRing.build(ring, replicationFactor);
+			ringHasChanged = true;
+		}
+	}
 
 	if(initialRingSetup == true)
 	{
-		int pos = getNodeRingPosition();
-		hasMyReplicas.emplace_back(ring.at((pos+1)%ring.size()));
-		hasMyReplicas.emplace_back(ring.at((pos+2)%ring.size()));
 		ringSize = ring.size();
 		initialRingSetup = false;
 	}
 
 	// Step 3: Run the stabilization protocol IF REQUIRED
-	// Run stabilization protocol if the hash table size is greater than zero and if there has been a changed in the ring
-	// check to see if the size has changed since last ringsetup
+	// Run stabilization protocol if there has been a change in the ring; it moves keys
+	// only if the size has changed since last ringsetup
 
-	if(ringSize != ring.size())	// change in number of nodes in the ring. need to engadge the stabilizers!
+	if(ringHasChanged)
 	{
 		stabilizationProtocol();
 	}
+
+	// back from disk: fetch only what changed while this node was down
+	if(recovered)
+	{
+		for(unsigned int i = 0; i < sharingPeers.size(); i++)
+			startAntiEntropy(sharingPeers[i]);
+		recovered = sharingPeers.empty();
+	}
+}
+
+/**
+ * FUNCTION NAME: membershipChanged
+ *
+ * DESCRIPTION: Compares MP1's membership list, entry by entry, with the one
+ * 				seen at the last call and remembers it. Heartbeats and
+ * 				timestamps are ignored; a reordered list counts as a change
+ * 				and falls through to the full comparison in updateRing.
+ */
+bool MP2Node::membershipChanged() {
+	vector<MemberListEntry> &list = memberNode->memberList;
+	bool changed = list.size() != ringSource.size();
+	for ( size_t i = 0; i < list.size() && !changed; i++ ) {
+		changed = list[i].getid() != ringSource[i].first || list[i].getport() != ringSource[i].second;
+	}
+	if ( changed ) {
+		ringSource.resize(list.size());
+		for ( size_t i = 0; i < list.size(); i++ ) {
+			ringSource[i] = make_pair(list[i].getid(), list[i].getport());
+		}
+	}
+	return changed;
 }
 
 /**
@@ -117,6 +308,22 @@ size_t MP2Node::hashFunction(string key) {
 	return ret%RING_SIZE;
 }
 
+/**
+ * FUNCTION NAME: logRingOwnership
+ *
+ * DESCRIPTION: Logs the share of the ring each physical node owns as primary,
+ * 				so the spread from virtual nodes / weights can be checked
+ */
+void MP2Node::logRingOwnership() {
+	vector<double> shares = hashRing.ownershipShares();
+	double fairShare = hashRing.memberCount() > 0 ? 1.0 / hashRing.memberCount() : 0;
+	opLog.LOG(&memberNode->addr, "ring ownership: %d nodes, %d tokens", (int)hashRing.memberCount(), (int)hashRing.size());
+	for ( unsigned int i = 0; i < shares.size(); i++ ) {
+		opLog.LOG(&memberNode->addr, "ring ownership: node %s share %.4f (%.2fx fair)",
+				hashRing.member(i).getAddress()->getAddress().c_str(), shares[i], fairShare > 0 ? shares[i] / fairShare : 0);
+	}
+}
+
 /**
  * FUNCTION NAME: clientCreate
  *
@@ -125,26 +332,27 @@ size_t MP2Node::hashFunction(string key) {
  * 				1) Constructs the message
  * 				2) Finds the replicas of this key
  * 				3) Sends a message to the replica
+ * 				The ConsistencyLevel overload chooses W; the default is QUORUM.
  */
-void MP2Node::clientCreate(string key, string value) {		// treat this memberNode as coordinator
+void MP2Node::clientCreate(string key, string value) {
+	clientCreate(key, value, CONSISTENCY_QUORUM);
+}
+
+void MP2Node::clientCreate(string key, string value, ConsistencyLevel w) {		// treat this memberNode as coordinator
 
 	// 1) construct the messages
-	int msgID = rand() % 2000;
-	Message *newMsgPrimary = new Message(msgID, memberNode->addr.getAddress(), CREATE, key, value, PRIMARY);
+	TransID msgID = transIDs.next(CREATE);
+	Version version = clock.next(par->getcurrtime(), transIDs.getNodeID());
+	Message newMsgPrimary(transIDWire(msgID), memberNode->addr.getAddress(), CREATE, key, value, PRIMARY);
 
 	// 2) find the replicas of key
-	vector<Node> nodeReplicaList = findNodes(key);
+	ReplicaView nodeReplicaList = findNodes(key);
 	
 	// 3) sends message to the replicas 
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[0].getAddress(), newMsgPrimary->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[1].getAddress(), newMsgPrimary->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[2].getAddress(), newMsgPrimary->toString());
+	sendToReplicas(nodeReplicaList, newMsgPrimary, msgID, &version);
+	readCache.invalidate(key);
 
-	// format: quorumCount key data time
-	string delim = " ";
-	string idData = "0" + delim + key + delim + value + delim + to_string(par->getcurrtime());
-	posQuorum->create(to_string(msgID), idData);
-	negQuorum->create(to_string(msgID), idData);
+	trackOperation(msgID, CREATE, key, value, nodeReplicaList, w)->version = version;
 }
 
 /**
@@ -155,27 +363,63 @@ void MP2Node::clientCreate(string key, string value) {		// treat this memberNode
  * 				1) Constructs the message
  * 				2) Finds the replicas of this key
  * 				3) Sends a message to the replica
+ * 				The ConsistencyLevel overload chooses R; the default is QUORUM.
  */
 void MP2Node::clientRead(string key){
+	clientRead(key, CONSISTENCY_QUORUM);
+}
+
+void MP2Node::clientRead(string key, ConsistencyLevel r){
+
+	if(readCached(key))
+		return;
 
 	// step 1 - create the message
-	int msgID = rand() % 2000 + 4001;  // random number from 4001 and 6000
+	TransID msgID = transIDs.next(READ);
 
-	Message *newReadMsg = new Message(msgID, memberNode->addr.getAddress(), READ, key); 
+	Message newReadMsg(transIDWire(msgID), memberNode->addr.getAddress(), READ, key);
 
 	// 2) find the replicas of key
-	vector<Node> nodeReplicaList = findNodes(key);
+	ReplicaView nodeReplicaList = findNodes(key);
 
-	// 3) sends message to the replicas 
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[0].getAddress(), newReadMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[1].getAddress(), newReadMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[2].getAddress(), newReadMsg->toString());
+	if(hedgedReads && nodeReplicaList.size() > 1)
+	{
+		PendingOp *op = trackOperation(msgID, READ, key, "", nodeReplicaList, r);
+		// fastest first; ring order among equal estimates
+		stable_sort(op->replicas.begin(), op->replicas.end(), [this](const Address &a, const Address &b) {
+			return latency.estimate(a) < latency.estimate(b);
+		});
+		op->hedged = true;
+		while(op->sent < (size_t)op->required)
+			hedgeRead(*op);
+		int next = op->startTime + hedgeDelay();
+		if(op->sent < op->replicas.size() && next <= op->deadline)
+			timeouts.schedule(msgID, next);
+		return;
+	}
 
-	string delim = " ";
-	long msgTime = par->getcurrtime();
-	string idData = key + delim + "EMPTY" + delim + to_string(msgTime);
-	
-	readQuorum->create(to_string(msgID), idData);
+	// 3) sends message to the replicas, asking for leases if results are cached
+	unsigned char flags = readCache.enabled() ? WIRE_FLAG_LEASE : 0;
+	if(!digestReads || textWireFormat || nodeReplicaList.size() < 2)
+	{
+		sendToReplicas(nodeReplicaList, newReadMsg, msgID, NULL, flags);
+		trackOperation(msgID, READ, key, "", nodeReplicaList, r);
+		return;
+	}
+
+	// the value comes from this node if it is a replica, else from a replica chosen in turn
+	Node me(memberNode->addr);
+	size_t data = (size_t)(msgID & TRANSID_SEQ_MASK) % nodeReplicaList.size();
+	for(size_t i = 0; i < nodeReplicaList.size(); i++)
+		if(HashRing::sameAddress(nodeReplicaList[i], me))
+			data = i;
+	for(size_t i = 0; i < nodeReplicaList.size(); i++)
+		sendMessage(nodeReplicaList[i].getAddress(), newReadMsg, msgID, NULL, i == data ? flags : flags | WIRE_FLAG_DIGEST);
+
+	PendingOp *op = trackOperation(msgID, READ, key, "", nodeReplicaList, r);
+	op->digestRead = true;
+	op->dataReplica = *nodeReplicaList[data].getAddress();
+	timeouts.schedule(msgID, op->startTime + DIGEST_CHECK_TICKS);
 }
 
 /**
@@ -186,23 +430,23 @@ void MP2Node::clientRead(string key){
  * 				1) Constructs the message
  * 				2) Finds the replicas of this key
  * 				3) Sends a message to the replica
+ * 				The ConsistencyLevel overload chooses W; the default is QUORUM.
  */
 void MP2Node::clientUpdate(string key, string value){
+	clientUpdate(key, value, CONSISTENCY_QUORUM);
+}
 
-	vector<Node> nodeReplicaList = findNodes(key);
-	int msgID = rand() % 2000 + 6001;  // random number from 6001 and 8000 
-	Message *updateMsg = new Message(msgID, memberNode->addr.getAddress(), UPDATE, key, value);
-	
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[0].getAddress(), updateMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[1].getAddress(), updateMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[2].getAddress(), updateMsg->toString());
+void MP2Node::clientUpdate(string key, string value, ConsistencyLevel w){
 
-	// format: quorumCount key value time
-	string delim = " ";
-	string idData = "0" + delim + key + delim + value + delim + to_string(par->getcurrtime());
+	ReplicaView nodeReplicaList = findNodes(key);
+	TransID msgID = transIDs.next(UPDATE);
+	Version version = clock.next(par->getcurrtime(), transIDs.getNodeID());
+	Message updateMsg(transIDWire(msgID), memberNode->addr.getAddress(), UPDATE, key, value);
+	
+	sendToReplicas(nodeReplicaList, updateMsg, msgID, &version);
+	readCache.invalidate(key);
 
-	posQuorum->create(to_string(msgID), idData);
-	negQuorum->create(to_string(msgID), idData);
+	trackOperation(msgID, UPDATE, key, value, nodeReplicaList, w)->version = version;
 }
 
 /**
@@ -213,26 +457,113 @@ void MP2Node::clientUpdate(string key, string value){
  * 				1) Constructs the message
  * 				2) Finds the replicas of this key
  * 				3) Sends a message to the replica
+ * 				The ConsistencyLevel overload chooses W; the default is QUORUM.
  */
 void MP2Node::clientDelete(string key){
-	/*
-	 * Implement this
-	 */
+	clientDelete(key, CONSISTENCY_QUORUM);
+}
+
+void MP2Node::clientDelete(string key, ConsistencyLevel w){
+
+	ReplicaView nodeReplicaList = findNodes(key);
+	TransID msgID = transIDs.next(DELETE);
+	Message deleteMsg(transIDWire(msgID), memberNode->addr.getAddress(), DELETE, key);
+
+	sendToReplicas(nodeReplicaList, deleteMsg, msgID);
+	readCache.invalidate(key);
+
+	trackOperation(msgID, DELETE, key, "", nodeReplicaList, w);
+}
+
+/**
+ * FUNCTION NAME: multiGet / multiPut / multiDelete
+ *
+ * DESCRIPTION: client side batch APIs: clientRead / clientCreate / clientDelete
+ * 				for every key, but the requests for all keys a node replicates
+ * 				travel in as few MULTI_REQUEST frames as fit. Every key still
+ * 				gets its own transID, quorum tracking, timeout and log line.
+ */
+void MP2Node::multiGet(const vector<string> &keys, ConsistencyLevel r) {
+	sendMulti(READ, keys, vector<string>(), r);
+}
+
+void MP2Node::multiPut(const vector<pair<string, string> > &pairs, ConsistencyLevel w) {
+	vector<string> keys, values;
+	for ( unsigned int i = 0; i < pairs.size(); i++ ) {
+		keys.push_back(pairs[i].first);
+		values.push_back(pairs[i].second);
+	}
+	sendMulti(CREATE, keys, values, w);
+}
+
+void MP2Node::multiDelete(const vector<string> &keys, ConsistencyLevel w) {
+	sendMulti(DELETE, keys, vector<string>(), w);
+}
+
+/**
+ * FUNCTION NAME: sendMulti
+ *
+ * DESCRIPTION: Groups one operation on many keys by replica node. A node's
+ * 				frame is sent once it reaches BATCH_MAX_BYTES and at the end.
+ * 				The text wire format has no multi-key frame, so there it
+ * 				falls back to the single-key calls.
+ */
+void MP2Node::sendMulti(MessageType op, const vector<string> &keys, const vector<string> &values, ConsistencyLevel level) {
+	static const string none;
+	if ( textWireFormat ) {
+		for ( unsigned int i = 0; i < keys.size(); i++ ) {
+			if ( op == READ )
+				clientRead(keys[i], level);
+			else if ( op == DELETE )
+				clientDelete(keys[i], level);
+			else
+				clientCreate(keys[i], values[i], level);
+		}
+		return;
+	}
 
-	vector<Node> nodeReplicaList = findNodes(key);
-	int msgID = rand() % 2000 + 2001;  // random number from 4001 and 6000 
-	Message *deleteMsg = new Message(msgID, memberNode->addr.getAddress(), DELETE, key);
+	// pending frame per replica node, keyed by the 6 address bytes
+	map<unsigned long long, pair<Address, string> > frames;
+	bool lease = op == READ && readCache.enabled();
+	for ( unsigned int i = 0; i < keys.size(); i++ ) {
+		if ( op == READ ) {
+			if ( readCached(keys[i]) ) {
+				continue;
+			}
+		}
+		else {
+			readCache.invalidate(keys[i]);
+		}
+		const string &value = op == CREATE ? values[i] : none;
+		TransID msgID = transIDs.next(op);
+		Version version;
+		if ( op == CREATE ) {
+			version = clock.next(par->getcurrtime(), transIDs.getNodeID());
+		}
 
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[0].getAddress(), deleteMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[1].getAddress(), deleteMsg->toString());
-	emulNet->ENsend(&memberNode->addr, nodeReplicaList[2].getAddress(), deleteMsg->toString());
+		ReplicaView replicas = findNodes(keys[i]);
+		for ( unsigned int j = 0; j < replicas.size(); j++ ) {
+			unsigned long long addrKey = 0;
+			memcpy(&addrKey, replicas[j].getAddress()->addr, sizeof(replicas[j].getAddress()->addr));
+			pair<Address, string> &frame = frames[addrKey];
+			if ( frame.second.empty() ) {
+				frame.first = *replicas[j].getAddress();
+			}
+			else if ( frame.second.size() + MultiCodec::itemSize(keys[i], value) > BATCH_MAX_BYTES ) {
+				sendFrame(frame.first, (MessageType)MULTI_REQUEST, 0, frame.second);
+				frame.second.clear();
+			}
+			MultiCodec::append(frame.second, op, PRIMARY, msgID, false, &version, keys[i], value, lease);
+		}
 
-	// format: quorumCount key value time
-	string delim = " ";
-	string idData = "0" + delim + key + delim + "EMPTY" + delim + to_string(par->getcurrtime());
+		trackOperation(msgID, op, keys[i], value, replicas, level)->version = version;
+	}
 
-	posQuorum->create(to_string(msgID), idData);
-	negQuorum->create(to_string(msgID), idData);
+	for ( map<unsigned long long, pair<Address, string> >::iterator it = frames.begin(); it != frames.end(); ++it ) {
+		if ( !it->second.second.empty() ) {
+			sendFrame(it->second.first, (MessageType)MULTI_REQUEST, 0, it->second.second);
+		}
+	}
 }
 
 /**
@@ -243,21 +574,53 @@ void MP2Node::clientDelete(string key){
  * 			   	1) Inserts key value into the local hash table
  * 			   	2) Return true or false based on success or failure
  */
-bool MP2Node::createKeyValue(string key, string value, ReplicaType replica, int transID) {
+bool MP2Node::createKeyValue(string key, string value, ReplicaType replica, int transID, Version version) {
 	/*
 	 * Implement this
 	 */
-	// Insert key, value, replicaType into the hash table
-	if(ht->create(key,value))
+	// unversioned writes (text wire format) are stamped here
+	if(version.isNull())
+		version = clock.next(par->getcurrtime(), transIDs.getNodeID());
+	else
+		observeVersion(version);
+
+	// Insert key, value, replicaType into the hash table. A create of a key held
+	// already (replication chunks, hint replays) succeeds like HashTable::create;
+	// last writer wins, so an older create leaves the newer value in place.
+	string stored = VersionedValue::pack(version, value);
+	string oldStored = ht->read(key);
+	size_t pos = hashFunction(key);
+	if(oldStored.empty())
 	{
-		log->logCreateSuccess(&memberNode->addr, coordinator, transID, key, value);
-		return true;
+		if(!ht->create(key, stored))
+		{
+			opLog.logCreateFail(&memberNode->addr, coordinator, transID, key, value);
+			return false;
+		}
+		merkle.add(pos, key, stored);
+		keyIndex.add(pos, StorageEngine::keyHash(key));
+		persist(pos, WAL_PUT, key, stored);
 	}
 	else
 	{
-		log->logCreateFail(&memberNode->addr, coordinator, transID, key, value);
-		return false;
-	}	
+		string oldValue;
+		Version oldVersion;
+		VersionedValue::unpack(oldStored, oldVersion, oldValue);
+		if(oldVersion < version)
+		{
+			if(!ht->update(key, stored))
+			{
+				opLog.logCreateFail(&memberNode->addr, coordinator, transID, key, value);
+				return false;
+			}
+			merkle.remove(pos, key, oldStored);
+			merkle.add(pos, key, stored);
+			persist(pos, WAL_PUT, key, stored);
+			revokeLeases(key);
+		}
+	}
+	opLog.logCreateSuccess(&memberNode->addr, coordinator, transID, key, value);
+	return true;
 }
 
 /**
@@ -271,11 +634,21 @@ bool MP2Node::createKeyValue(string key, string value, ReplicaType replica, int
 string MP2Node::readKey(string key, int transID) {
 
 	string result;
-	result = ht->read(key);
+	Version version;
+	readVersioned(key, result, version);
 
 	return result;
 }
 
+/**
+ * FUNCTION NAME: readVersioned
+ *
+ * DESCRIPTION: Reads a key and the version of its value; false if it is not stored here
+ */
+bool MP2Node::readVersioned(const string &key, string &value, Version &version) {
+	return VersionedValue::unpack(ht->read(key), version, value);
+}
+
 /**
  * FUNCTION NAME: updateKeyValue
  *
@@ -284,19 +657,38 @@ string MP2Node::readKey(string key, int transID) {
  * 				1) Update the key to the new value in the local hash table
  * 				2) Return true or false based on success or failure
  */
-bool MP2Node::updateKeyValue(string key, string value, ReplicaType replica, int transID) {
+bool MP2Node::updateKeyValue(string key, string value, ReplicaType replica, int transID, Version version) {
 	/*
 	 * Implement this
 	 */
 	// Update key in local hash table and return true or false
-	if(ht->update(key, value))
+	string oldStored = ht->read(key);
+	string oldValue;
+	Version oldVersion;
+	if(VersionedValue::unpack(oldStored, oldVersion, oldValue))
 	{
-		log->logUpdateSuccess(&memberNode->addr, coordinator, transID, key, value);
+		if(version.isNull())
+			version = clock.next(par->getcurrtime(), transIDs.getNodeID());
+		else
+			observeVersion(version);
+
+		// last writer wins: an update older than the stored value is acknowledged but not applied
+		if(!(version < oldVersion))
+		{
+			string stored = VersionedValue::pack(version, value);
+			ht->update(key, stored);
+			size_t pos = hashFunction(key);
+			merkle.remove(pos, key, oldStored);
+			merkle.add(pos, key, stored);
+			persist(pos, WAL_PUT, key, stored);
+			revokeLeases(key);
+		}
+		opLog.logUpdateSuccess(&memberNode->addr, coordinator, transID, key, value);
 		return true;
 	}
 	else
 	{
-		log->logUpdateFail(&memberNode->addr, coordinator, transID, key, value);
+		opLog.logUpdateFail(&memberNode->addr, coordinator, transID, key, value);
 		return false;
 	}
 }
@@ -314,277 +706,1139 @@ bool MP2Node::deletekey(string key, int transID) {
 	 * Implement this
 	 */
 	// Delete the key from the local hash table
+	string oldValue = ht->read(key);
 	if(ht->deleteKey(key))
 	{
-		log->logDeleteSuccess(&memberNode->addr, coordinator, transID, key);
+		size_t pos = hashFunction(key);
+		merkle.remove(pos, key, oldValue);
+		keyIndex.remove(pos, StorageEngine::keyHash(key));
+		persist(pos, WAL_DELETE, key);
+		revokeLeases(key);
+		opLog.logDeleteSuccess(&memberNode->addr, coordinator, transID, key);
 		return true;
 	}
 	else
 	{
-		log->logDeleteFail(&memberNode->addr, coordinator, transID, key);
+		opLog.logDeleteFail(&memberNode->addr, coordinator, transID, key);
 		return false;
 	}
 }
 
 /**
- * FUNCTION NAME: checkMessages
+ * FUNCTION NAME: repairKeyValue
  *
- * DESCRIPTION: This function is the message handler of this node.
- * 				This function does the following:
- * 				1) Pops messages from the queue
- * 				2) Handles the messages according to message types
+ * DESCRIPTION: Applies a value received through anti-entropy or read repair if
+ * 				the key is missing here or stored with an older version.
+ * 				Does not log.
  */
-void MP2Node::checkMessages() {
-	/*
-	 * Implement this. Parts of it are already implemented
-	 */
-	char * data;
-	int size;
-	
-	/*
-	 * Declare your local variables here
-	 */
-
-	// dequeue all messages and handle them
-	while ( !memberNode->mp2q.empty() ) {
-		/*
-		 * Pop a message from the queue
-		 */
-		data = (char *)memberNode->mp2q.front().elt;
-		size = memberNode->mp2q.front().size;
-		memberNode->mp2q.pop();
-
-		string message(data, data + size);
-		Message receivedMessage(message);
-
-		MessageType msgType = receivedMessage.type;
-		Address fromAddress = receivedMessage.fromAddr;
-		int transID = receivedMessage.transID;
-		string sTransID = to_string(transID);
-
-		string key = receivedMessage.key;
-		string value = receivedMessage.value;
-		ReplicaType type = receivedMessage.replica;			// may not need this
-
-		string qCount;		// current quorum count
-		string readResult;	// results from read request
-		coordinator = false;
-
-		Message *replyMsg;
-
-		bool requestSucessfull = false;
-
-		switch(msgType)
-    	{
-        	case(CREATE):
-			{					
-				requestSucessfull = createKeyValue(key, value, type, transID);
-				if(type == PRIMARY)
-				{
-					replyMsg = new Message(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
-					emulNet->ENsend(&memberNode->addr, &fromAddress, replyMsg->toString());
-				}
-				requestSucessfull = false;
-				break;
-			}
-
-			case(DELETE):
-			{
-				requestSucessfull = deletekey(key, transID);
-				replyMsg = new Message(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
-				emulNet->ENsend(&memberNode->addr, &fromAddress, replyMsg->toString());
-				break;
-			}
-
-			case(READ):
-			{
-				readResult = readKey(key, transID);
-
-				if(readResult.length() > 0)
-				{
-					log->logReadSuccess(&memberNode->addr, coordinator, transID, key, readResult);	
-					replyMsg = new Message(transID, memberNode->addr.getAddress(), READREPLY, key, readResult);
-					emulNet->ENsend(&memberNode->addr, &fromAddress, replyMsg->toString());
-				}
-				else
-					log->logReadFail(&memberNode->addr, coordinator, transID, key);
-				
-				break;
-			}
-			case(UPDATE):
-			{
-				requestSucessfull = updateKeyValue(key, value, type, transID);
-				replyMsg = new Message(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
-				emulNet->ENsend(&memberNode->addr, &fromAddress, replyMsg->toString());
-				break;
-			}
-
-			case(READREPLY):	
-			{
-				coordinator = true;
-				string transID_Data;
-				string tempData;
-				string tempID, tempKey, tempValue, msgTime;
-				string delim = " ";
-
-				transID_Data = readQuorum->read(sTransID);	// get the data for this transID
-				if(transID_Data.length() < 1)
-					break;
-	
-				vector <string> tokens;
-				std::stringstream streamData(transID_Data);
-				while(getline(streamData, tempData, ' '))
-				{
-					tokens.push_back(tempData);
-				}
-				tempKey = tokens[0];
-				tempValue = tokens[1];
-				msgTime = tokens[2];
-			
-				int iMsgTime = stoi(msgTime);
+bool MP2Node::repairKeyValue(const string &key, const string &value, Version version) {
+	if(version.isNull())
+		return false;
+	clock.observe(version);
 
-				if (tempValue == "EMPTY")
-				{
-					string newValue = tempKey + delim + value + delim + msgTime;
-					readQuorum->update(sTransID, newValue);
-				}
-				else
-				{
-					if(tempValue == value)			// second read reply. quorum reached
-					{
-						log->logReadSuccess(&memberNode->addr, coordinator, transID, tempKey, value);
-						readQuorum->deleteKey(sTransID);
-					}
-				}
-//				if(iMsgTime + 5 < par->getcurrtime())
-//				{
-//					cout << " reply msg not rec'd for transID " << transID << endl;
-//					log->logReadSuccess(&memberNode->addr, coordinator, transID, tempKey, value);
-//					readQuorum->deleteKey(sTransID);
-//				}
-			break;
-			}
+	string stored = VersionedValue::pack(version, value);
+	string oldStored = ht->read(key);
+	size_t pos = hashFunction(key);
+	if(oldStored.empty())
+	{
+		ht->create(key, stored);
+		merkle.add(pos, key, stored);
+		keyIndex.add(pos, StorageEngine::keyHash(key));
+		persist(pos, WAL_PUT, key, stored);
+		return true;
+	}
 
-			case(REPLY):	// used for create / delete / update. NOT USED DURING STABILIZATION
-			{
-				coordinator = true;
-				string transID_Data;
-				string replyKey, replyData, replyTime;
-				int replyStatus = 0;
-				bool msgSuccessful = receivedMessage.success;
-				transID_Data = posQuorum->read(sTransID);
-
-				if(transID_Data.length() < 1)
-					break;
-				
-				vector <string> tokens;
-				std::stringstream streamData(transID_Data);
-				string tempData;
+	string oldValue;
+	Version oldVersion;
+	VersionedValue::unpack(oldStored, oldVersion, oldValue);
+	if(!(oldVersion < version))
+		return false;
+	ht->update(key, stored);
+	merkle.remove(pos, key, oldStored);
+	merkle.add(pos, key, stored);
+	persist(pos, WAL_PUT, key, stored);
+	revokeLeases(key);
+	return true;
+}
 
-				while(getline(streamData, tempData, ' '))
-				{
-					tokens.push_back(tempData);
-				}
-				qCount = tokens[0];
-				replyKey = tokens[1];
-				replyData = tokens[2];
-				replyTime = tokens[3];
+/**
+ * FUNCTION NAME: setDurability
+ *
+ * DESCRIPTION: Makes the local store survive a restart. Whatever an earlier
+ * 				run left under pathPrefix is loaded first (snapshot, then the
+ * 				log tail) and compacted into a fresh snapshot. From then on
+ * 				every change is appended to the write-ahead log and a tick's
+ * 				changes are committed together at the end of checkMessages;
+ * 				the store is snapshotted, and the log emptied, every
+ * 				snapshotTicks ticks. A recovered node only asks its replica
+ * 				peers for what changed while it was away, through the Merkle
+ * 				exchange, instead of being refilled key by key.
+ */
+bool MP2Node::setDurability(const string &pathPrefix, int snapshotTicks, bool sync) {
+	delete wal;
+	wal = NULL;
+	snapshotPath = pathPrefix + ".snap";
+	snapshotPeriod = snapshotTicks;
+	size_t loaded = recoverLocal(pathPrefix);
+
+	wal = new WriteAheadLog(pathPrefix + ".wal", sync);
+	wal->setShards(pendingShards.size());
+	if ( loaded > 0 ) {
+		// also drops a torn record the crash may have left at the end of the log
+		takeSnapshot();
+	}
+	return wal->isOpen();
+}
 
-				if(qCount.length() > 0)
-				{
-					if(transID >= 0 && transID < 2001)			// create key
-					{
-						replyStatus = checkCreateReply(transID, qCount, replyKey, replyData, msgSuccessful, replyTime);
-						if(replyStatus == 1)
-						{
-							log->logCreateSuccess(&memberNode->addr, coordinator, transID, replyKey, replyData);	
-							posQuorum->deleteKey(sTransID);	
-						}
-					}
-					if(transID > 2000 && transID < 4001)		// delete key %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-					{
-						replyStatus = checkCreateReply(transID, qCount, replyKey, replyData, msgSuccessful, replyTime);
-						if(replyStatus == 1)
-						{
-							log->logDeleteSuccess(&memberNode->addr, coordinator, transID, replyKey);
-							posQuorum->deleteKey(sTransID);	
-						}
-						if(replyStatus == 3)
-						{
-							log->logDeleteFail(&memberNode->addr, coordinator, transID, replyKey);
-							posQuorum->deleteKey(sTransID);	
-						}
-					}
-					if(transID > 6000 && transID < 8001)		// update Key
-					{
-						replyStatus = checkCreateReply(transID, qCount, replyKey, replyData, msgSuccessful, replyTime);
-						if(replyStatus == 1)
-						{
-							log->logUpdateSuccess(&memberNode->addr, coordinator, transID, replyKey, replyData);
-							posQuorum->deleteKey(sTransID);	
-						}
-						if(replyStatus == 3)
-						{
-							log->logUpdateFail(&memberNode->addr, coordinator, transID, replyKey, replyData);
-							posQuorum->deleteKey(sTransID);	
-						}
-					}
-				}
-				break;
-			}
+/**
+ * FUNCTION NAME: recoverLocal
+ *
+ * DESCRIPTION: Loads the snapshot under pathPrefix and replays the log written
+ * 				after it; returns the number of keys in the store afterwards
+ */
+size_t MP2Node::recoverLocal(const string &pathPrefix) {
+	unsigned long fromSnapshot = Snapshot::load(snapshotPath, [this](StrRef key, StrRef stored) {
+		restoreKeyValue(key.str(), stored.str());
+	});
+	unsigned long fromLog = WriteAheadLog::replay(pathPrefix + ".wal", [this](WalRecordType type, StrRef key, StrRef stored) {
+		if ( type == WAL_PUT ) {
+			restoreKeyValue(key.str(), stored.str());
+			return;
 		}
+		string name = key.str();
+		string oldStored = ht->read(name);
+		if ( ht->deleteKey(name) ) {
+			size_t pos = hashFunction(name);
+			merkle.remove(pos, name, oldStored);
+			keyIndex.remove(pos, StorageEngine::keyHash(name));
+		}
+	});
+	if ( fromSnapshot + fromLog == 0 ) {
+		return 0;
 	}
-	checkForFailedReply();
-	if(posQuorum->hashTable.size() > 0)		
-		checkForFailedUpdateReply();		// *************** this is failing read test
-	/*
-	 * This function should also ensure all READ and UPDATE operation
-	 * get QUORUM replies
-	 */
+	recovered = true;
+	opLog.LOG(&memberNode->addr, "recovered %lu keys from %lu snapshot entries and %lu log records",
+			ht->currentSize(), fromSnapshot, fromLog);
+	return ht->currentSize();
 }
 
 /**
- * FUNCTION NAME: findNodes
+ * FUNCTION NAME: restoreKeyValue
  *
- * DESCRIPTION: Find the replicas of the given keyfunction
- * 				This function is responsible for finding the replicas of a key
+ * DESCRIPTION: Recovery: sets key to a stored (versioned) value as logged, whatever is there now
  */
-vector<Node> MP2Node::findNodes(string key) {
+void MP2Node::restoreKeyValue(const string &key, const string &stored) {
+	Version version;
+	string value;
+	if ( !VersionedValue::unpack(stored, version, value) ) {
+		return;
+	}
+	clock.observe(version);
 	size_t pos = hashFunction(key);
-	vector<Node> addr_vec;
-	if (ring.size() >= 3) {
-		// if pos <= min || pos > max, the leader is the min
-		if (pos <= ring.at(0).getHashCode() || pos > ring.at(ring.size()-1).getHashCode()) {
-			addr_vec.emplace_back(ring.at(0));
-			addr_vec.emplace_back(ring.at(1));
-			addr_vec.emplace_back(ring.at(2));
-		}
-		else {
-			// go through the ring until pos <= node
-			for (int i=1; i<ring.size(); i++){
-				Node addr = ring.at(i);
-				if (pos <= addr.getHashCode()) {
-					addr_vec.emplace_back(addr);
-					addr_vec.emplace_back(ring.at((i+1)%ring.size()));
-					addr_vec.emplace_back(ring.at((i+2)%ring.size()));
-					break;
-				}
-			}
-		}
+	string oldStored = ht->read(key);
+	if ( oldStored.empty() ) {
+		ht->create(key, stored);
+		keyIndex.add(pos, StorageEngine::keyHash(key));
 	}
-	return addr_vec;
+	else {
+		ht->update(key, stored);
+		merkle.remove(pos, key, oldStored);
+	}
+	merkle.add(pos, key, stored);
 }
 
 /**
- * FUNCTION NAME: recvLoop
+ * FUNCTION NAME: persist
  *
- * DESCRIPTION: Receive messages from EmulNet and push into the queue (mp2q)
+ * DESCRIPTION: Appends a local change to the write-ahead log, if there is one.
+ * 				The buffer is picked by ring position like the store's shards,
+ * 				so a worker only appends to its own.
  */
-bool MP2Node::recvLoop() {
+void MP2Node::persist(size_t pos, WalRecordType type, const string &key, const string &stored) {
+	if ( wal != NULL ) {
+		wal->append(ShardedStorage::shardOf(pos, wal->shards()), type, key, stored);
+	}
+}
+
+/**
+ * FUNCTION NAME: commitDurable
+ *
+ * DESCRIPTION: Group commit of the tick's changes, and the periodic snapshot.
+ * 				transmit() holds back the tick's acknowledgements; they go out
+ * 				only once the commit succeeded, so none reaches a coordinator
+ * 				before the write it covers is durable. If the commit fails
+ * 				they are dropped (the coordinators time out) and the changes
+ * 				stay queued for the next commit; if the log can no longer
+ * 				be synced at all this node stops and fails.
+ */
+void MP2Node::commitDurable() {
+	if ( wal == NULL ) {
+		return;
+	}
+	vector<pair<Address, string> > acks;
+	acks.swap(heldAcks);
+	if ( !wal->commit() ) {
+		opLog.LOG(&memberNode->addr, "write-ahead log commit failed: %lu acknowledgements withheld", (unsigned long)acks.size());
+		if ( wal->hasFailed() ) {
+			opLog.LOG(&memberNode->addr, "write-ahead log cannot be synced, node stopped");
+			memberNode->bFailed = true;
+		}
+		return;
+	}
+	for ( size_t i = 0; i < acks.size(); i++ ) {
+		string &frame = acks[i].second;
+		metrics.sent(MessageCodec::peekType(frame.data(), (int)frame.size()), frame.size());
+		emulNet->ENsend(&memberNode->addr, &acks[i].first, &frame[0], (int)frame.size());
+	}
+	if ( snapshotPeriod > 0 && par->getcurrtime() - lastSnapshot >= snapshotPeriod && wal->getFileBytes() > 0 ) {
+		takeSnapshot();
+	}
+}
+
+/**
+ * FUNCTION NAME: takeSnapshot
+ *
+ * DESCRIPTION: Writes the whole store to the snapshot file and empties the log.
+ * 				The log is only emptied once the snapshot is on disk.
+ */
+bool MP2Node::takeSnapshot() {
+	lastSnapshot = par->getcurrtime();
+	if ( !wal->commit() || !Snapshot::write(snapshotPath, *ht) ) {
+		opLog.LOG(&memberNode->addr, "snapshot to %s failed, keeping the write-ahead log", snapshotPath.c_str());
+		return false;
+	}
+	return wal->reset();
+}
+
+// name of a message type in the metrics, NULL for types that do not exist
+static const char * messageTypeName(int type) {
+	switch ( type ) {
+		case CREATE:				return "CREATE";
+		case READ:					return "READ";
+		case UPDATE:				return "UPDATE";
+		case DELETE:				return "DELETE";
+		case REPLY:					return "REPLY";
+		case READREPLY:				return "READREPLY";
+		case REPLICATE_BATCH:		return "REPLICATE_BATCH";
+		case REPLICATE_BATCH_ACK:	return "REPLICATE_BATCH_ACK";
+		case MERKLE_DIGEST:			return "MERKLE_DIGEST";
+		case MERKLE_PULL:			return "MERKLE_PULL";
+		case REPLICATE_REPAIR:		return "REPLICATE_REPAIR";
+		case READ_REPAIR:			return "READ_REPAIR";
+		case MULTI_REQUEST:			return "MULTI_REQUEST";
+		case MULTI_REPLY:			return "MULTI_REPLY";
+		case LEASE_REVOKE:			return "LEASE_REVOKE";
+		case LEASE_REVOKE_ACK:		return "LEASE_REVOKE_ACK";
+		default:					return NULL;
+	}
+}
+
+/**
+ * FUNCTION NAME: setMetricsOutput
+ *
+ * DESCRIPTION: Appends the metrics to path as one JSON object per line, every
+ * 				periodTicks (0: only at shutdown) and when the node is destroyed
+ */
+bool MP2Node::setMetricsOutput(const string &path, int periodTicks) {
+	if ( metricsOut != NULL ) {
+		fclose(metricsOut);
+	}
+	metricsOut = fopen(path.c_str(), "a");
+	metricsPeriod = periodTicks;
+	lastMetricsDump = par->getcurrtime();
+	return metricsOut != NULL;
+}
+
+/**
+ * FUNCTION NAME: metricsShard
+ *
+ * DESCRIPTION: The calling thread's operation metrics
+ */
+MetricsShard & MP2Node::metricsShard() {
+	return activeContext == NULL ? metrics.shard(0) : *activeContext->metrics;
+}
+
+/**
+ * FUNCTION NAME: recordOutcome
+ *
+ * DESCRIPTION: Counts a quorum decision and its latency since the client call
+ */
+void MP2Node::recordOutcome(PendingOp &op, MetricOutcome outcome) {
+	metricsShard().finished(op.op, outcome, par->getcurrtime() - op.startTime);
+}
+
+/**
+ * FUNCTION NAME: sampleMetrics
+ *
+ * DESCRIPTION: End of tick: samples the quorum tables and dumps the metrics
+ * 				if a period has passed
+ */
+void MP2Node::sampleMetrics() {
+	size_t inFlight = 0;
+	for ( size_t s = 0; s < pendingShards.size(); s++ ) {
+		inFlight += pendingShards[s].size();
+	}
+	metrics.sampleInFlight(inFlight);
+	if ( metricsOut != NULL && metricsPeriod > 0 && par->getcurrtime() - lastMetricsDump >= metricsPeriod ) {
+		dumpMetrics(false);
+	}
+}
+
+/**
+ * FUNCTION NAME: dumpMetrics
+ *
+ * DESCRIPTION: Writes the registry with the totals other components keep:
+ * 				stabilization chunks, hints, the read cache and the WAL
+ */
+void MP2Node::dumpMetrics(bool final) {
+	vector<pair<const char *, double> > extra;
+	extra.push_back(make_pair("chunksSent", (double)replicator.getChunksSent()));
+	extra.push_back(make_pair("chunksResent", (double)replicator.getChunksResent()));
+	extra.push_back(make_pair("chunksAbandoned", (double)replicator.getChunksAbandoned()));
+	extra.push_back(make_pair("hintsStored", (double)hints.getHintsStored()));
+	extra.push_back(make_pair("hintsDropped", (double)hints.getHintsDropped()));
+	extra.push_back(make_pair("readCacheHits", (double)readCache.getHits()));
+	extra.push_back(make_pair("readCacheMisses", (double)readCache.getMisses()));
+	extra.push_back(make_pair("keys", (double)ht->currentSize()));
+	if ( wal != NULL ) {
+		extra.push_back(make_pair("walCommits", (double)wal->getCommits()));
+		extra.push_back(make_pair("walBytes", (double)wal->getBytes()));
+	}
+	metrics.writeJson(metricsOut, memberNode->addr.getAddress(), par->getcurrtime(), final, messageTypeName, extra);
+	fflush(metricsOut);
+	lastMetricsDump = par->getcurrtime();
+}
+
+/**
+ * FUNCTION NAME: readCached
+ *
+ * DESCRIPTION: Coordinator side: answers a READ from the read cache if the key
+ * 				is there under a live lease, logging it like a quorum read.
+ * 				No message is sent.
+ */
+bool MP2Node::readCached(const string &key) {
+	string value;
+	if(!readCache.enabled() || !readCache.lookup(key, par->getcurrtime(), value))
+		return false;
+	TransID msgID = transIDs.next(READ);
+	opLog.logReadSuccess(&memberNode->addr, true, transIDWire(msgID), key, value);
+	recordReadLatency(0);
+	metricsShard().started(READ);
+	metricsShard().finished(READ, METRIC_SUCCEEDED, 0);
+	return true;
+}
+
+/**
+ * FUNCTION NAME: fillReadCache
+ *
+ * DESCRIPTION: Caches a successful leased read until the leases run out,
+ * 				counted from when the read was sent so it never outlives them
+ */
+void MP2Node::fillReadCache(PendingOp &op) {
+	int expires = op.startTime + leaseTicks;
+	if(activeContext == NULL)
+	{
+		readCache.fill(op.key, op.value, op.version, expires);
+		return;
+	}
+	WorkerContext::CacheFill fill = { op.key, op.value, op.version, expires };
+	activeContext->cacheFills.push_back(fill);
+}
+
+/**
+ * FUNCTION NAME: revokeLeases
+ *
+ * DESCRIPTION: Replica side: key changed here, so every coordinator still
+ * 				holding a read lease on it gets a LEASE_REVOKE
+ */
+void MP2Node::revokeLeases(const string &key) {
+	vector<Address> holders;
+	leases.revoke(hashFunction(key), key, par->getcurrtime(), holders);
+	for(unsigned int i = 0; i < holders.size(); i++)
+		sendFrame(holders[i], (MessageType)LEASE_REVOKE, 0, key);
+}
+
+/**
+ * FUNCTION NAME: sendWriteReply
+ *
+ * DESCRIPTION: Replica side: acknowledges a write to key, unless a coordinator
+ * 				may still serve the old value from its cache. Then the reply
+ * 				waits in the lease table until every revoked lease on key is
+ * 				acknowledged or has expired.
+ */
+void MP2Node::sendWriteReply(Address &toAddr, const string &key, Message &reply, TransID transID) {
+	size_t pos = hashFunction(key);
+	if(!leases.revoking(pos, key, par->getcurrtime()))
+	{
+		sendMessage(&toAddr, reply, transID);
+		return;
+	}
+	string frame;
+	encodeMessage(frame, reply, transID);
+	leases.hold(pos, key, toAddr, frame);
+}
+
+/**
+ * FUNCTION NAME: acknowledgeRevoke
+ *
+ * DESCRIPTION: A coordinator dropped its cached copy of key; sends the write
+ * 				replies that were only waiting for that
+ */
+void MP2Node::acknowledgeRevoke(Address &holder, const string &key) {
+	vector<pair<Address, string> > released;
+	leases.acknowledge(hashFunction(key), key, holder, par->getcurrtime(), released);
+	for(unsigned int i = 0; i < released.size(); i++)
+		transmit(&released[i].first, &released[i].second[0], released[i].second.size());
+}
+
+/**
+ * FUNCTION NAME: expireLeaseHolds
+ *
+ * DESCRIPTION: Sends the write replies whose revoked leases expired without
+ * 				an acknowledgement (the holder failed or the revoke was lost)
+ */
+void MP2Node::expireLeaseHolds() {
+	vector<pair<Address, string> > released;
+	leases.expire(par->getcurrtime(), released);
+	for(unsigned int i = 0; i < released.size(); i++)
+		transmit(&released[i].first, &released[i].second[0], released[i].second.size());
+}
+
+/**
+ * FUNCTION NAME: checkMessages
+ *
+ * DESCRIPTION: This function is the message handler of this node.
+ * 				This function does the following:
+ * 				1) Pops messages from the queue
+ * 				2) Handles the messages according to message types
+ */
+void MP2Node::checkMessages() {
+	/*
+	 * Implement this. Parts of it are already implemented
+	 */
+	char * data;
+	int size;
+	
+	/*
+	 * Declare your local variables here
+	 */
+
+	if ( workers != NULL ) {
+		checkMessagesParallel();
+	}
+	else {
+		// left over from threaded mode
+		InboundFrame frame;
+		while ( inbound != NULL && inbound->tryPop(frame) ) {
+			memberNode->mp2q.emplace((void *)frame.data, frame.size);
+		}
+		metrics.sampleQueue(memberNode->mp2q.size());
+	}
+
+	// dequeue all messages and handle them
+	while ( !memberNode->mp2q.empty() ) {
+		/*
+		 * Pop a message from the queue
+		 */
+		data = (char *)memberNode->mp2q.front().elt;
+		size = memberNode->mp2q.front().size;
+		memberNode->mp2q.pop();
+
+		// key and value point into data; copied only when stored
+		MessageView receivedMessage;
+		if(!MessageCodec::decodeAny(data, size, receivedMessage))
+		{
+			free(data);
+			continue;
+		}
+		hints.heardFrom(receivedMessage.fromAddr, par->getcurrtime());
+		handleMessage(receivedMessage);
+
+		// EmulNet hands ownership of the receive buffer to the queue
+		free(data);
+	}
+	checkForFailedReply();
+	runAntiEntropy();
+	replayHints();
+	pumpReplication();
+	expireLeaseHolds();
+	commitDurable();
+	ht->maintain();
+	sampleMetrics();
+	/*
+	 * This function should also ensure all READ and UPDATE operation
+	 * get QUORUM replies
+	 */
+}
+
+/**
+ * FUNCTION NAME: checkMessagesParallel
+ *
+ * DESCRIPTION: Threaded mode message handler. Decodes the ring's buffers (a
+ * 				header parse; key and value stay in the buffers), sorts them
+ * 				into one list per worker and lets every worker handle its list.
+ * 				Sends, log lines and clock updates made by workers are applied
+ * 				afterwards on this thread, since EmulNet and Log are not
+ * 				thread-safe. Frames that touch more than one shard (bulk
+ * 				transfer, anti-entropy, repair) and unversioned writes (text
+ * 				wire format, which need the clock) are handled here after the
+ * 				workers, in arrival order.
+ */
+void MP2Node::checkMessagesParallel() {
+	size_t shards = workerContexts.size();
+	vector<char *> buffers;
+	deque<MessageView> views;
+	InboundFrame frame;
+	while ( inbound->tryPop(frame) ) {
+		views.emplace_back();
+		if ( !MessageCodec::decodeAny(frame.data, frame.size, views.back()) ) {
+			views.pop_back();
+			free(frame.data);
+			continue;
+		}
+		buffers.push_back(frame.data);
+		hints.heardFrom(views.back().fromAddr, par->getcurrtime());
+	}
+	metrics.sampleQueue(views.size());
+	if ( views.empty() ) {
+		return;
+	}
+
+	vector<vector<MessageView *> > lists(shards);
+	vector<MessageView *> serial;
+	for ( size_t i = 0; i < views.size(); i++ ) {
+		MessageView &msg = views[i];
+		switch ( msg.type ) {
+			case CREATE:
+			case UPDATE:
+				if ( msg.version.isNull() ) {
+					serial.push_back(&msg);
+					break;
+				}
+				// fall through
+			case READ:
+			case DELETE:
+				lists[ShardedStorage::shardOf(hashFunction(msg.key.str()), shards)].push_back(&msg);
+				break;
+			case REPLY:
+			case READREPLY:
+				lists[(unsigned int)transIDWire(msg.transID) % shards].push_back(&msg);
+				break;
+			default:
+				serial.push_back(&msg);
+				break;
+		}
+	}
+
+	merkle.setDeferred(true);
+	workers->run([&](int w) {
+		WorkerContext &context = workerContexts[w];
+		activeContext = &context;
+		LogBuffer::captureInto(&context.logs);
+		for ( size_t i = 0; i < lists[w].size(); i++ ) {
+			handleMessage(*lists[w][i]);
+		}
+		LogBuffer::captureInto(NULL);
+		activeContext = NULL;
+	});
+	merkle.setDeferred(false);
+
+	for ( size_t w = 0; w < shards; w++ ) {
+		WorkerContext &context = workerContexts[w];
+		clock.observe(context.observed);
+		context.observed = Version();
+		opLog.replay(context.logs);
+		for ( size_t i = 0; i < context.cacheFills.size(); i++ ) {
+			WorkerContext::CacheFill &fill = context.cacheFills[i];
+			readCache.fill(fill.key, fill.value, fill.version, fill.expires);
+		}
+		context.cacheFills.clear();
+		for ( size_t i = 0; i < context.replyLatencies.size(); i++ ) {
+			latency.recordReply(context.replyLatencies[i].first, context.replyLatencies[i].second);
+		}
+		for ( size_t i = 0; i < context.readLatencies.size(); i++ ) {
+			latency.recordRead(context.readLatencies[i]);
+		}
+		context.replyLatencies.clear();
+		context.readLatencies.clear();
+		for ( size_t i = 0; i < context.outbound.size(); i++ ) {
+			string &bytes = context.outbound[i].second;
+			transmit(&context.outbound[i].first, &bytes[0], (int)bytes.size());
+		}
+		context.outbound.clear();
+	}
+
+	for ( size_t i = 0; i < serial.size(); i++ ) {
+		handleMessage(*serial[i]);
+	}
+	for ( size_t i = 0; i < buffers.size(); i++ ) {
+		free(buffers[i]);
+	}
+}
+
+/**
+ * FUNCTION NAME: handleMessage
+ *
+ * DESCRIPTION: Handles one received message. In threaded mode it runs on the
+ * 				worker owning the message's shard.
+ */
+void MP2Node::handleMessage(MessageView &receivedMessage) {
+	MessageType msgType = receivedMessage.type;
+	Address fromAddress = receivedMessage.fromAddr;
+	int transID = transIDWire(receivedMessage.transID);
+	// the ID as the sender issued it; a reply's is rebuilt from our own node ID
+	TransID fullTransID = transIDFromWire(*(int *)fromAddress.addr, transID);
+
+	StrRef key = receivedMessage.key;
+	StrRef value = receivedMessage.value;
+	ReplicaType type = receivedMessage.replica;			// may not need this
+
+	// bulk transfer, anti-entropy, multi-key and lease frames (binary wire format only)
+	if((int)msgType >= REPLICATE_BATCH && (int)msgType <= LEASE_REVOKE_ACK)
+	{
+		if((int)msgType == LEASE_REVOKE)
+		{
+			readCache.invalidate(value.str());
+			sendFrame(fromAddress, (MessageType)LEASE_REVOKE_ACK, 0, value.str());
+		}
+		else if((int)msgType == LEASE_REVOKE_ACK)
+			acknowledgeRevoke(fromAddress, value.str());
+		else if((int)msgType == MULTI_REQUEST)
+			handleMultiRequest(receivedMessage);
+		else if((int)msgType == MULTI_REPLY)
+			handleMultiReply(receivedMessage);
+		else if((int)msgType == READ_REPAIR)
+			repairKeyValue(key.str(), value.str(), receivedMessage.version);
+		else if((int)msgType == REPLICATE_BATCH || (int)msgType == REPLICATE_REPAIR)
+			handleReplicateBatch(receivedMessage);
+		else if((int)msgType == REPLICATE_BATCH_ACK)
+			replicator.ack(fromAddress, transIDFromWire(transIDs.getNodeID(), transID));
+		else if((int)msgType == MERKLE_DIGEST)
+			handleMerkleDigest(receivedMessage);
+		else
+			handleMerklePull(receivedMessage);
+		return;
+	}
+
+	string readResult;	// results from read request
+
+	bool requestSucessfull = false;
+
+	switch(msgType)
+    	{
+        	case(CREATE):
+		{					
+			requestSucessfull = createKeyValue(key.str(), value.str(), type, transID, receivedMessage.version);
+			if(type == PRIMARY)
+			{
+				Message replyMsg(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
+				sendWriteReply(fromAddress, key.str(), replyMsg, fullTransID);
+			}
+			requestSucessfull = false;
+			break;
+		}
+
+		case(DELETE):
+		{
+			requestSucessfull = deletekey(key.str(), transID);
+			Message replyMsg(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
+			sendWriteReply(fromAddress, key.str(), replyMsg, fullTransID);
+			break;
+		}
+
+		case(READ):
+		{
+			string readKeyStr = key.str();
+			Version version;
+
+			if(readVersioned(readKeyStr, readResult, version))
+			{
+				opLog.logReadSuccess(&memberNode->addr, coordinator, transID, readKeyStr, readResult);	
+				unsigned char flags = 0;
+				if(receivedMessage.digest)
+				{
+					// the hash anti-entropy uses, of version and value together
+					unsigned long long digest = MerkleTree::entryHash(readKeyStr, VersionedValue::pack(version, readResult));
+					readResult.assign((const char *)&digest, sizeof(digest));
+					flags = WIRE_FLAG_DIGEST;
+				}
+				Message replyMsg(transID, memberNode->addr.getAddress(), READREPLY, readKeyStr, readResult);
+				if(receivedMessage.lease && leaseTicks > 0)
+				{
+					int now = par->getcurrtime();
+					leases.grant(hashFunction(readKeyStr), readKeyStr, fromAddress, now, now + leaseTicks);
+					flags |= WIRE_FLAG_LEASE;
+				}
+				sendMessage(&fromAddress, replyMsg, fullTransID, &version, flags);
+			}
+			else
+			{
+				// an empty reply lets the coordinator fail or repair without waiting
+				opLog.logReadFail(&memberNode->addr, coordinator, transID, readKeyStr);
+				Message replyMsg(transID, memberNode->addr.getAddress(), READREPLY, readKeyStr, "");
+				sendMessage(&fromAddress, replyMsg, fullTransID);
+			}
+			
+			break;
+		}
+		case(UPDATE):
+		{
+			requestSucessfull = updateKeyValue(key.str(), value.str(), type, transID, receivedMessage.version);
+			Message replyMsg(transID, memberNode->addr.getAddress(), REPLY, requestSucessfull);
+			sendWriteReply(fromAddress, key.str(), replyMsg, fullTransID);
+			break;
+		}
+
+		case(READREPLY):	
+			handleReadReply(fromAddress, transID, value, receivedMessage.version, receivedMessage.lease, receivedMessage.digest);
+			break;
+
+		case(REPLY):	// used for create / delete / update. NOT USED DURING STABILIZATION
+			handleWriteReply(fromAddress, transID, receivedMessage.success);
+			break;
+	}
+}
+
+/**
+ * FUNCTION NAME: handleReadReply
+ *
+ * DESCRIPTION: Counts one replica's READREPLY towards the read's R; an empty
+ * 				value means the key was not found there. A digest reply
+ * 				counts like the value it stands for, but the read only
+ * 				succeeds once the value of the newest version is here: if the
+ * 				data replica's copy is older or missing, the value is read in
+ * 				full from a replica that reported the newest version. A read
+ * 				that succeeds with every answer current and leased is cached.
+ */
+void MP2Node::handleReadReply(Address &fromAddress, int transID, StrRef value, const Version &receivedVersion, bool lease, bool digest) {
+	TransID fullID = transIDFromWire(transIDs.getNodeID(), transID);
+	if(transIDOp(fullID) != READ)
+		return;
+	PendingOp *op = pendingFor(fullID).find(fullID);
+	if(op == NULL)
+		return;
+
+	bool found = !value.empty();
+	Version version = found ? receivedVersion : Version();
+	observeVersion(version);
+	if(op->done)					// late reply to a completed read
+	{
+		recordReplyLatency(fromAddress, *op);
+		if(version < op->version)
+			sendReadRepair(fromAddress, *op);
+		return;
+	}
+
+	// a second answer from a replica is the full read after its digest
+	bool again = false;
+	for(unsigned int i = 0; i < op->responses.size(); i++)
+		if(op->responses[i].first == fromAddress)
+			again = true;
+	if(!again)
+	{
+		recordReplyLatency(fromAddress, *op);
+		op->responses.push_back(make_pair(fromAddress, version));
+		if(found && lease)
+			op->leases++;
+	}
+	if(found && op->version < version)		// newest version so far
+		op->version = version;
+	if(found && !digest && op->dataVersion < version)		// newest value so far
+	{
+		op->value = value.str();
+		op->dataVersion = version;
+	}
+
+	int replyStatus = again ? 0 : checkCreateReply(*op, found);
+	if(replyStatus != 0 && replyStatus != 1)
+	{
+		opLog.logReadFail(&memberNode->addr, true, transID, op->key);
+		recordOutcome(*op, METRIC_FAILED);
+		pendingFor(fullID).erase(fullID);
+		return;
+	}
+	// a hedged READ needs another replica for every miss
+	if(!again && !found && op->hedged && op->acks < op->required && op->sent < op->replicas.size())
+		hedgeRead(*op);
+	if(op->acks < op->required)
+		return;
+	if(op->dataVersion < op->version)		// only digests of the newest value so far
+	{
+		bool dataAnswered = false;
+		for(unsigned int i = 0; i < op->responses.size(); i++)
+			if(op->responses[i].first == op->dataReplica)
+				dataAnswered = true;
+		if(dataAnswered)
+			fallbackRead(*op);
+		return;
+	}
+
+	opLog.logReadSuccess(&memberNode->addr, true, transID, op->key, op->value);
+	recordReadLatency(par->getcurrtime() - op->startTime);
+	recordOutcome(*op, METRIC_SUCCEEDED);
+	op->done = true;
+	bool current = true;
+	for(unsigned int i = 0; i < op->responses.size(); i++)
+		if(op->responses[i].second < op->version)
+		{
+			sendReadRepair(op->responses[i].first, *op);
+			current = false;
+		}
+	// a repair would revoke the lease anyway
+	if(current && op->leases == op->acks)
+		fillReadCache(*op);
+}
+
+/**
+ * FUNCTION NAME: fallbackRead
+ *
+ * DESCRIPTION: Digest READ whose digests disagree with the data replica: asks
+ * 				one replica that reported the newest version for the value.
+ * 				Sent at most once; the read times out if that fails too.
+ */
+void MP2Node::fallbackRead(PendingOp &op) {
+	if(op.fallbackSent)
+		return;
+	for(unsigned int i = 0; i < op.responses.size(); i++)
+	{
+		if(op.responses[i].second == op.version)
+		{
+			Message readMsg(transIDWire(op.transID), memberNode->addr.getAddress(), READ, op.key);
+			sendMessage(&op.responses[i].first, readMsg, op.transID);
+			op.fallbackSent = true;
+			return;
+		}
+	}
+}
+
+/**
+ * FUNCTION NAME: hedgeRead
+ *
+ * DESCRIPTION: Sends a hedged READ to the next replica in latency order
+ */
+void MP2Node::hedgeRead(PendingOp &op) {
+	Message readMsg(transIDWire(op.transID), memberNode->addr.getAddress(), READ, op.key);
+	sendMessage(&op.replicas[op.sent], readMsg, op.transID, NULL, readCache.enabled() ? WIRE_FLAG_LEASE : 0);
+	op.sentAt.push_back(par->getcurrtime());
+	op.sent++;
+}
+
+/**
+ * FUNCTION NAME: hedgeDelay
+ *
+ * DESCRIPTION: Ticks a hedged READ waits for replies before asking one more
+ * 				replica: the HEDGE_PERCENTILE reply latency, 2 until known
+ */
+int MP2Node::hedgeDelay() {
+	int ticks = latency.replyPercentile(HEDGE_PERCENTILE);
+	return ticks < 1 ? 2 : ticks;
+}
+
+/**
+ * FUNCTION NAME: recordReplyLatency / recordReadLatency
+ *
+ * DESCRIPTION: Latency samples; deferred to the main thread during a parallel phase
+ */
+void MP2Node::recordReplyLatency(Address &fromAddress, PendingOp &op) {
+	int sentAt = op.startTime;
+	for(size_t i = 0; i < op.sentAt.size(); i++)
+		if(op.replicas[i] == fromAddress)
+			sentAt = op.sentAt[i];
+	int ticks = par->getcurrtime() - sentAt;
+	if(activeContext == NULL)
+		latency.recordReply(fromAddress, ticks);
+	else
+		activeContext->replyLatencies.push_back(make_pair(fromAddress, ticks));
+}
+
+void MP2Node::recordReadLatency(int ticks) {
+	if(activeContext == NULL)
+		latency.recordRead(ticks);
+	else
+		activeContext->readLatencies.push_back(ticks);
+}
+
+/**
+ * FUNCTION NAME: handleWriteReply
+ *
+ * DESCRIPTION: Counts one replica's REPLY towards a CREATE / UPDATE / DELETE's W
+ */
+void MP2Node::handleWriteReply(Address &fromAddress, int transID, bool success) {
+	TransID fullID = transIDFromWire(transIDs.getNodeID(), transID);
+	MessageType opType = transIDOp(fullID);		// op type is encoded in the ID
+	if(opType != CREATE && opType != DELETE && opType != UPDATE)
+		return;
+	PendingOp *op = pendingFor(fullID).find(fullID);
+	if(op == NULL)
+		return;
+
+	recordReplyLatency(fromAddress, *op);
+	// replicas that took the write; the others get a hint at the deadline
+	if(success)
+		op->responses.push_back(make_pair(fromAddress, op->version));
+	if(op->done)
+		return;
+
+	int replyStatus = checkCreateReply(*op, success);
+	if(replyStatus == 0)
+		return;
+
+	bool quorumSuccess = (replyStatus == 1);
+	recordOutcome(*op, quorumSuccess ? METRIC_SUCCEEDED : METRIC_FAILED);
+	switch(opType)
+	{
+		case(CREATE):
+			if(quorumSuccess)
+				opLog.logCreateSuccess(&memberNode->addr, true, transID, op->key, op->value);
+			else
+				opLog.logCreateFail(&memberNode->addr, true, transID, op->key, op->value);
+			break;
+		case(DELETE):
+			if(quorumSuccess)
+				opLog.logDeleteSuccess(&memberNode->addr, true, transID, op->key);
+			else
+				opLog.logDeleteFail(&memberNode->addr, true, transID, op->key);
+			break;
+		case(UPDATE):
+			if(quorumSuccess)
+				opLog.logUpdateSuccess(&memberNode->addr, true, transID, op->key, op->value);
+			else
+				opLog.logUpdateFail(&memberNode->addr, true, transID, op->key, op->value);
+			break;
+		default:
+			break;
+	}
+	if(quorumSuccess && opType != DELETE)		// kept until the deadline to collect hints
+		op->done = true;
+	else
+		pendingFor(fullID).erase(fullID);
+}
+
+/**
+ * FUNCTION NAME: handleMultiRequest
+ *
+ * DESCRIPTION: Server side of a MULTI_REQUEST: runs every item like the
+ * 				single-key request (same store calls and log lines) and
+ * 				answers them in MULTI_REPLY frames to the coordinator; write
+ * 				replies held for a lease revoke go out on their own later
+ */
+void MP2Node::handleMultiRequest(MessageView &msg) {
+	static const string none;
+	vector<MultiItem> items;
+	if(!MultiCodec::unpack(msg.value, items))
+		return;
+
+	string reply;
+	// a write to a key whose leases are being revoked is answered on its own once they are
+	auto writeReply = [&](MultiItem &item, const string &key, bool ok) {
+		if(leases.revoking(hashFunction(key), key, par->getcurrtime()))
+		{
+			Message replyMsg(transIDWire(item.transID), memberNode->addr.getAddress(), REPLY, ok);
+			sendWriteReply(msg.fromAddr, key, replyMsg, item.transID);
+		}
+		else
+			MultiCodec::append(reply, REPLY, item.replica, item.transID, ok, NULL, none, none);
+	};
+	for(unsigned int i = 0; i < items.size(); i++)
+	{
+		MultiItem &item = items[i];
+		int transID = transIDWire(item.transID);
+		string key = item.key.str();
+		switch(item.type)
+		{
+			case(CREATE):
+			{
+				writeReply(item, key, createKeyValue(key, item.value.str(), item.replica, transID, item.version));
+				break;
+			}
+			case(UPDATE):
+			{
+				writeReply(item, key, updateKeyValue(key, item.value.str(), item.replica, transID, item.version));
+				break;
+			}
+			case(DELETE):
+			{
+				writeReply(item, key, deletekey(key, transID));
+				break;
+			}
+			case(READ):
+			{
+				string value;
+				Version version;
+				bool lease = false;
+				if(readVersioned(key, value, version))
+				{
+					opLog.logReadSuccess(&memberNode->addr, coordinator, transID, key, value);
+					if(item.lease && leaseTicks > 0)
+					{
+						int now = par->getcurrtime();
+						leases.grant(hashFunction(key), key, msg.fromAddr, now, now + leaseTicks);
+						lease = true;
+					}
+				}
+				else
+					opLog.logReadFail(&memberNode->addr, coordinator, transID, key);
+				MultiCodec::append(reply, READREPLY, item.replica, item.transID, true, &version, none, value, lease);
+				break;
+			}
+			default:
+				continue;
+		}
+		if(reply.size() >= BATCH_MAX_BYTES)
+		{
+			sendFrame(msg.fromAddr, (MessageType)MULTI_REPLY, msg.transID, reply);
+			reply.clear();
+		}
+	}
+	if(!reply.empty())
+		sendFrame(msg.fromAddr, (MessageType)MULTI_REPLY, msg.transID, reply);
+}
+
+/**
+ * FUNCTION NAME: handleMultiReply
+ *
+ * DESCRIPTION: Counts every item of a MULTI_REPLY towards its own key's quorum
+ */
+void MP2Node::handleMultiReply(MessageView &msg) {
+	vector<MultiItem> items;
+	if(!MultiCodec::unpack(msg.value, items))
+		return;
+	for(unsigned int i = 0; i < items.size(); i++)
+	{
+		if(items[i].type == READREPLY)
+			handleReadReply(msg.fromAddr, transIDWire(items[i].transID), items[i].value, items[i].version, items[i].lease, false);
+		else if(items[i].type == REPLY)
+			handleWriteReply(msg.fromAddr, transIDWire(items[i].transID), items[i].success);
+	}
+}
+
+/**
+ * FUNCTION NAME: encodeMessage
+ *
+ * DESCRIPTION: Serializes a message for EmulNet. Uses the binary wire format
+ * 				(MessageCodec.h) unless text format was requested for debugging,
+ * 				in which case only the low 32 bits of transID are carried and
+ * 				the version and flags are dropped (replicas then stamp writes
+ * 				themselves, and no leases are granted).
+ */
+void MP2Node::encodeMessage(string &out, Message &msg, TransID transID, const Version *version, unsigned char flags) {
+	if ( textWireFormat ) {
+		msg.transID = transIDWire(transID);
+		out = msg.toString();
+		return;
+	}
+	MessageCodec::encode(out, msg, transID, version, flags);
+}
+
+/**
+ * FUNCTION NAME: sendMessage
+ *
+ * DESCRIPTION: Serializes a message into a pooled buffer and sends it to one node
+ */
+void MP2Node::sendMessage(Address *toAddr, Message &msg, TransID transID, const Version *version, unsigned char flags) {
+	if ( activeContext != NULL ) {
+		encodeMessage(activeContext->stage(*toAddr), msg, transID, version, flags);
+		return;
+	}
+	PooledBuffer buf(sendBuffers);
+	encodeMessage(buf.get(), msg, transID, version, flags);
+	transmit(toAddr, buf.data(), buf.size());
+}
+
+/**
+ * FUNCTION NAME: sendToReplicas
+ *
+ * DESCRIPTION: Serializes a message once and sends the same bytes to every replica.
+ * 				EmulNet copies the payload, so the buffer is recycled afterwards.
+ */
+void MP2Node::sendToReplicas(ReplicaView replicas, Message &msg, TransID transID, const Version *version, unsigned char flags) {
+	PooledBuffer buf(sendBuffers);
+	encodeMessage(buf.get(), msg, transID, version, flags);
+	for ( unsigned int i = 0; i < replicas.size(); i++ ) {
+		transmit(replicas[i].getAddress(), buf.data(), buf.size());
+	}
+}
+
+/**
+ * FUNCTION NAME: sendReadRepair
+ *
+ * DESCRIPTION: Pushes the newest value a READ found to a replica that answered
+ * 				with an older version or without the key. Fire and forget;
+ * 				anti-entropy catches anything lost.
+ */
+void MP2Node::sendReadRepair(Address &toAddr, PendingOp &op) {
+	if ( op.version.isNull() ) {
+		return;
+	}
+	if ( activeContext != NULL ) {
+		MessageCodec::encode(activeContext->stage(toAddr), (MessageType)READ_REPAIR, op.transID, memberNode->addr,
+				op.key, op.value, PRIMARY, false, &op.version);
+		return;
+	}
+	PooledBuffer buf(sendBuffers);
+	MessageCodec::encode(buf.get(), (MessageType)READ_REPAIR, op.transID, memberNode->addr,
+			op.key, op.value, PRIMARY, false, &op.version);
+	transmit(&toAddr, buf.data(), buf.size());
+}
+
+/**
+ * FUNCTION NAME: sendFrame
+ *
+ * DESCRIPTION: Sends a keyless extension frame whose value field is payload
+ */
+void MP2Node::sendFrame(Address &toAddr, MessageType type, TransID transID, const string &payload) {
+	static const string noKey;
+	if ( activeContext != NULL ) {
+		MessageCodec::encode(activeContext->stage(toAddr), type, transID, memberNode->addr, noKey, payload, PRIMARY, false);
+		return;
+	}
+	PooledBuffer buf(sendBuffers);
+	MessageCodec::encode(buf.get(), type, transID, memberNode->addr, noKey, payload, PRIMARY, false);
+	transmit(&toAddr, buf.data(), buf.size());
+}
+
+/**
+ * FUNCTION NAME: transmit
+ *
+ * DESCRIPTION: Hands a serialized frame to EmulNet, counting it by message type.
+ * 				With durability on, acknowledgements of writes wait in
+ * 				heldAcks for commitDurable.
+ */
+void MP2Node::transmit(Address *toAddr, char *data, int size) {
+	int type = MessageCodec::peekType(data, size);
+	if ( wal != NULL && (type == REPLY || type == REPLICATE_BATCH_ACK || type == MULTI_REPLY) ) {
+		heldAcks.push_back(make_pair(*toAddr, string(data, size)));
+		return;
+	}
+	metrics.sent(type, size);
+	emulNet->ENsend(&memberNode->addr, toAddr, data, size);
+}
+
+/**
+ * FUNCTION NAME: findNodes
+ *
+ * DESCRIPTION: Find the replicas of the given keyfunction
+ * 				This function is responsible for finding the replicas of a key
+ * 				The returned view stays valid until the ring membership changes
+ */
+ReplicaView MP2Node::findNodes(const string &key) {
+	// binary search over the ring; the replica list is precomputed per ring slot
+	return hashRing.lookup(hashFunction(key));
+}
+
+/**
+ * FUNCTION NAME: recvLoop
+ *
+ * DESCRIPTION: Receive messages from EmulNet and push into the queue (mp2q)
+ */
+bool MP2Node::recvLoop() {
     if ( memberNode->bFailed ) {
     	return false;
     }
     else {
+    	if ( workers != NULL ) {
+    		return emulNet->ENrecv(&(memberNode->addr), this->enqueueRingWrapper, NULL, 1, inbound);
+    	}
     	return emulNet->ENrecv(&(memberNode->addr), this->enqueueWrapper, NULL, 1, &(memberNode->mp2q));
     }
 }
@@ -598,6 +1852,21 @@ int MP2Node::enqueueWrapper(void *env, char *buff, int size) {
 	Queue q;
 	return q.enqueue((queue<q_elt> *)env, (void *)buff, size);
 }
+
+/**
+ * FUNCTION NAME: enqueueRingWrapper
+ *
+ * DESCRIPTION: Threaded mode: pushes the message from EmulNet into the inbound
+ * 				ring. Safe from any thread; a full ring drops the message.
+ */
+int MP2Node::enqueueRingWrapper(void *env, char *buff, int size) {
+	InboundFrame frame = { buff, size };
+	if ( !((MPSCRing<InboundFrame> *)env)->tryPush(frame) ) {
+		free(buff);
+		return 0;
+	}
+	return 1;
+}
 /**
  * FUNCTION NAME: stabilizationProtocol
  *
@@ -606,241 +1875,590 @@ int MP2Node::enqueueWrapper(void *env, char *buff, int size) {
  * 				The function does the following:
  *				1) Ensures that there are three "CORRECT" replicas of all the keys in spite of failures and joins
  *				Note:- "CORRECT" replicas implies that every key is replicated in its two neighboring nodes in the ring
+ *				Replicas are brought up to date with a Merkle exchange, so only
+ *				the ranges they are missing are transferred
  */
 
 void MP2Node::stabilizationProtocol() 
 {
+	ringHasChanged = false;
+	findReplicaPeers();
+	if(ringSize == ring.size())	// same nodes count: nothing to move
+		return;
+
+	if(hashRing.getTokensPerNode() > 1)		// replicas are not ring neighbors with virtual nodes
+	{
+		ringSize = ring.size();
+		replicateMovedKeys();
+		return;
+	}
+
 	ringSize = ring.size();
-	int myRingPosition = getNodeRingPosition();
-	int myAddress = *(int *)(&memberNode->addr.addr);
 
-//	cout << "Engadging stabilizers captain! Time is  " << par->getcurrtime() << " ring size " << ringSize << endl;
-//	cout << "my address " << myAddress << " time " << par->getcurrtime() << endl;
+	// a failed primary's range falls to a node whose own neighbors did not change,
+	// so reconcile with every node this one now shares ranges with
+	for(unsigned int i = 0; i < sharingPeers.size(); i++)
+		startAntiEntropy(sharingPeers[i]);
+}
 
-	Node expectedFirstNeighbor = hasMyReplicas.at(0);
-	Node expectedSecondNeighbor = hasMyReplicas.at(1);
-	int firstExpectedAddress = *(int *)(expectedFirstNeighbor.getAddress());
-	int secondExpectedAddress = *(int *)(expectedSecondNeighbor.getAddress());
+// ******************* MY ADDED FUNCTIONS ******************** //
 
-	Node actualFirstNeighbor = ring.at((myRingPosition+1)%ring.size());
-	Node actualSecondNeighbor = ring.at((myRingPosition+2)%ring.size());
-	int firstActualAddress = *(int *)(actualFirstNeighbor.getAddress());
-	int secondActualAddress = *(int *)(actualSecondNeighbor.getAddress());
+// records a new in-flight operation for quorum tracking
+PendingOp * MP2Node::trackOperation(TransID transID, MessageType op, string key, string value, ReplicaView replicas, ConsistencyLevel level)
+{
+	PendingOp *entry = pendingFor(transID).insert(transID);
+	entry->op = op;
+	entry->required = requiredReplies(level, replicas.size());
+	entry->key = key;
+	entry->value = value;
+	entry->startTime = par->getcurrtime();
+	entry->deadline = entry->startTime + replyTimeout;
+	entry->replicas.clear();
+	for(size_t i = 0; i < replicas.size(); i++)
+		entry->replicas.emplace_back(*replicas[i].getAddress());
+	// fails on the first tick past the deadline
+	timeouts.schedule(transID, entry->deadline + 1);
+	metricsShard().started(op);
+	return entry;
+}
 
-	int firstNeighborPosition = (myRingPosition+1)%ring.size();
-	int secondNeighborPosition = (myRingPosition+2)%ring.size();
+// replies needed for a consistency level when the key has this many replicas
+int MP2Node::requiredReplies(ConsistencyLevel level, size_t replicas)
+{
+	switch(level)
+	{
+		case(CONSISTENCY_ONE):
+			return replicas > 0 ? 1 : 0;
+		case(CONSISTENCY_ALL):
+			return replicas;
+		default:
+			return replicas / 2 + 1;
+	}
+}
 
-	
-	if(firstExpectedAddress != firstActualAddress)				// first neighbor has failed
+// the pending table of the worker that handles replies to transID
+PendingOpTable & MP2Node::pendingFor(TransID transID)
+{
+	return pendingShards[(unsigned int)transIDWire(transID) % pendingShards.size()];
+}
+
+// moves the clock past a version, or notes it for the main thread during a parallel phase
+void MP2Node::observeVersion(const Version &version)
+{
+	if(activeContext == NULL)
+		clock.observe(version);
+	else if(activeContext->observed < version)
+		activeContext->observed = version;
+}
+
+// checks if reply message satisfies the operation's R / W
+int MP2Node::checkCreateReply(PendingOp &op, bool msgSuccessful)
+{
+	if(msgSuccessful)
+	{
+		if(++op.acks == op.required)
+			return QUORUM_OBTAINED_SUCCESS;
+	}
+	else
+	{
+		// enough replicas refused that the rest cannot make up op.required
+		if(++op.nacks == (int)op.replicas.size() - op.required + 1)
+			return QUORUM_OBTAINED_FAILURE;
+	}
+	return 0;
+}
+
+// fails operations that did not reach quorum before their deadline
+void MP2Node::checkForFailedReply()
+{	
+	vector<TransID> expired;
+	timeouts.advance(par->getcurrtime(), expired);
+
+	for(size_t i = 0; i < expired.size(); i++)
 	{
-		if(firstActualAddress == secondExpectedAddress)			// second neighbor shifted into first neighbor
+		PendingOp *op = pendingFor(expired[i]).find(expired[i]);
+		if(op == NULL)		// already completed
+			continue;
+		if(par->getcurrtime() <= op->deadline)		// hedge or digest READ check, not the deadline
 		{
-			cout << "first neighbor failed. second neighbor is now my first " << endl << endl;
-			createOneReplica(secondNeighborPosition);
-			hasMyReplicas.clear();		
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+1)%ring.size()));
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+2)%ring.size()));
+			if(!op->done && op->hedged && op->acks < op->required && op->sent < op->replicas.size())
+			{
+				hedgeRead(*op);
+				int next = par->getcurrtime() + hedgeDelay();
+				if(op->sent < op->replicas.size() && next <= op->deadline)
+					timeouts.schedule(op->transID, next);
+			}
+			else if(!op->done && op->acks >= op->required && op->dataVersion < op->version)
+				fallbackRead(*op);
+			continue;
 		}
-		if(firstActualAddress != secondExpectedAddress)			// both first and second neighbor failed
+		if(op->done)		// finished; read repair / hint window over
 		{
-			cout << "both neighbors have failed " << endl << endl;
-			createTwoReplica(firstNeighborPosition, secondNeighborPosition);
-			hasMyReplicas.clear();		
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+1)%ring.size()));
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+2)%ring.size()));	
+			if(op->op == CREATE || op->op == UPDATE)
+				storeHints(*op);
+			pendingFor(expired[i]).erase(expired[i]);
+			continue;
 		}
-	}
 
-	if(firstExpectedAddress == firstActualAddress)			// first neighbors is unchanged
-	{
-		if(secondExpectedAddress != secondActualAddress)	// second neighbor has failed
+		int transID = transIDWire(op->transID);
+		switch(op->op)
 		{
-			cout << "second neighbor failed " << endl << endl;
-			createOneReplica(secondNeighborPosition);
-			hasMyReplicas.clear();		
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+1)%ring.size()));
-			hasMyReplicas.emplace_back(ring.at((myRingPosition+2)%ring.size()));
+			case(CREATE):
+				opLog.logCreateFail(&memberNode->addr, true, transID, op->key, op->value);
+				break;
+			case(READ):
+				opLog.logReadFail(&memberNode->addr, true, transID, op->key);
+				break;
+			case(UPDATE):
+				opLog.logUpdateFail(&memberNode->addr, true, transID, op->key, op->value);
+				break;
+			case(DELETE):
+				opLog.logDeleteFail(&memberNode->addr, true, transID, op->key);
+				break;
+			default:
+				break;
 		}
+		recordOutcome(*op, METRIC_TIMED_OUT);
+		pendingFor(expired[i]).erase(expired[i]);
 	}
-
-//	if((firstExpectedAddress == firstActualAddress) && secondExpectedAddress == secondActualAddress)
-//	{
-//		cout << "no changes needed " << endl << endl;
-//	}
 }
 
-// ******************* MY ADDED FUNCTIONS ******************** //
 
-// checks if reply message satisfies quorum
-int MP2Node::checkCreateReply(int transID, string qCount, string replyKey, string replyData, bool msgSuccessful, string replyTime)
+int MP2Node::getNodeRingPosition()
 {
-//	if(transID > 4000)
-//	{
-//		cout << "read check with key " << replyKey << " value " << replyData << endl;
+	Node me(memberNode->addr);
 
-//	}
-
-	int iQCount;
-	string sTransID = to_string(transID);
-	string delim = " ";
-	if(msgSuccessful)
+	// ring is sorted by hash code; only nodes sharing my hash code need comparing
+	vector<Node>::iterator it = lower_bound(ring.begin(), ring.end(), me);
+	for( ; it != ring.end() && it->getHashCode() == me.getHashCode(); ++it)
 	{
-		// format: quorumCount key value time
-		iQCount = stoi(qCount);
-		if(iQCount == 0)
-			posQuorum->update(sTransID, "1" + delim + replyKey + delim + replyData + delim + replyTime);
-		if(iQCount == 1)
-			posQuorum->update(sTransID, "2"+ delim + replyKey + delim + replyData + delim + replyTime);
-		if(iQCount == 2)
-			posQuorum->update(sTransID, "3"+ delim + replyKey + delim + replyData + delim + replyTime);
-
-		iQCount = stoi(posQuorum->read(sTransID));
-
-		if(iQCount == 2)
-		{
-			return QUORUM_OBTAINED_SUCCESS;
-		}
+		if(HashRing::sameAddress(*it, me))
+			return it - ring.begin();
 	}
+	return -1;
+}
 
-	if(!msgSuccessful)
+/**
+ * FUNCTION NAME: pumpReplication
+ *
+ * DESCRIPTION: Sends this tick's share of the queued stabilization transfers as
+ * 				REPLICATE_BATCH frames: overdue chunks again, then new chunks
+ * 				up to the per-destination window. A stream the destination
+ * 				stopped acknowledging is logged; if that node is still in the
+ * 				ring, a Merkle exchange with it repairs whatever the lost
+ * 				chunks held.
+ */
+void MP2Node::pumpReplication()
+{
+	if(replicator.idle())
+		return;
+
+	static const string noKey;
+	vector<OutboundChunk> chunks;
+	vector<AbandonedStream> abandoned;
+	replicator.pump(par->getcurrtime(), chunks, abandoned);
+	for(unsigned int i = 0; i < chunks.size(); i++)
 	{
-		iQCount = stoi(negQuorum->read(sTransID));  
-		if(iQCount == 0)
-			negQuorum->update(sTransID, "1");
-		if(iQCount == 1)
-				negQuorum->update(sTransID, "2");
-		if(iQCount == 2)
-				negQuorum->update(sTransID, "3");
+		PooledBuffer buf(sendBuffers);
+		MessageCodec::encode(buf.get(), (MessageType)chunks[i].frameType, chunks[i].chunkID, memberNode->addr,
+				noKey, *chunks[i].payload, SECONDARY, false);
+		transmit(&chunks[i].dest, buf.data(), buf.size());
+	}
 
-		iQCount = stoi(negQuorum->read(sTransID));
+	for(unsigned int i = 0; i < abandoned.size(); i++)
+	{
+		Node dest(abandoned[i].dest);
+		bool inRing = false;
+		for(unsigned int j = 0; j < ring.size() && !inRing; j++)
+			inRing = HashRing::sameAddress(ring[j], dest);
+		opLog.LOG(&memberNode->addr, "replication to %s abandoned after %d attempts: %lu chunks dropped, %s",
+				abandoned[i].dest.getAddress().c_str(), BATCH_MAX_ATTEMPTS, (unsigned long)abandoned[i].chunks,
+				inRing ? "repairing through anti-entropy" : "node left the ring");
+		if(inRing)
+			startAntiEntropy(dest);
+	}
+}
 
-		if(iQCount == 2)
+/**
+ * FUNCTION NAME: handleReplicateBatch
+ *
+ * DESCRIPTION: Stores every pair of a REPLICATE_BATCH chunk as a secondary replica
+ * 				(REPLICATE_REPAIR: only keys missing or older here) and acknowledges the
+ * 				chunk. A retransmitted chunk is acked again but not re-applied.
+ */
+void MP2Node::handleReplicateBatch(MessageView &msg)
+{
+	static const string none;
+	vector<pair<StrRef, StrRef> > pairs;
+	if(!BatchCodec::unpack(msg.value, pairs))		// corrupt; let the sender retry
+		return;
+	if(appliedChunks.firstTime(transIDFromWire(*(int *)msg.fromAddr.addr, transIDWire(msg.transID))))
+	{
+		for(unsigned int i = 0; i < pairs.size(); i++)
 		{
-			return QUORUM_OBTAINED_FAILURE;
+			// pairs carry the stored form: version, then value
+			string value;
+			Version version;
+			if(!VersionedValue::unpack(pairs[i].second.str(), version, value))
+				continue;
+			if((int)msg.type == REPLICATE_REPAIR)
+				repairKeyValue(pairs[i].first.str(), value, version);
+			else
+				createKeyValue(pairs[i].first.str(), value, SECONDARY, transIDWire(msg.transID), version);
 		}
 	}
-	return 0;
-}
 
-void MP2Node::checkForFailedReply()
-{	
-	coordinator = true;
-	string checkTransID;
-	string checkData;
+	PooledBuffer buf(sendBuffers);
+	MessageCodec::encode(buf.get(), (MessageType)REPLICATE_BATCH_ACK, msg.transID, memberNode->addr, none, none, SECONDARY, true);
+	transmit(&msg.fromAddr, buf.data(), buf.size());
+}
 
-	string tempData;
-	string tempID, tempKey, tempValue, msgTime;
-	string delim = " ";
+/**
+ * FUNCTION NAME: replicateMovedKeys
+ *
+ * DESCRIPTION: Stabilization for rings with virtual nodes. For every ring
+ * 				position, compares its replica set before and after the
+ * 				membership change and sends the keys stored there to each node
+ * 				that newly became a replica. Only the first surviving old
+ * 				replica in the new list sends, so each new replica receives a
+ * 				key once. Positions whose replicas did not change are skipped
+ * 				without touching their keys.
+ */
+void MP2Node::replicateMovedKeys()
+{
+	Node me(memberNode->addr);
+	vector<Node *> newcomers;
 
-	for (map<string,string>::iterator it =readQuorum->hashTable.begin(); it!=readQuorum->hashTable.end(); ++it)
+	for (size_t pos = 0; pos < keyIndex.positions(); pos++)
 	{
-		checkTransID = it->first;
-		checkData = it->second;
-		vector <string> tokens;
-		std::stringstream streamData(checkData);
-	
-		while(getline(streamData, tempData, ' '))
-		{
-			tokens.push_back(tempData);
-		}
-		tempKey = tokens[0];
-		tempValue = tokens[1];
-		msgTime = tokens[2];
+		const vector<unsigned long long> &hashes = keyIndex.hashesAt(pos);
+		if(hashes.empty())
+			continue;
+		ReplicaView oldReplicas = previousRing.lookup(pos);
+		ReplicaView newReplicas = hashRing.lookup(pos);
+
+		Node *sender = NULL;
+		for(Node *n = newReplicas.begin(); n != newReplicas.end() && sender == NULL; ++n)
+			for(Node *o = oldReplicas.begin(); o != oldReplicas.end(); ++o)
+				if(HashRing::sameAddress(*n, *o))
+				{
+					sender = n;
+					break;
+				}
+		if(sender == NULL || !HashRing::sameAddress(*sender, me))
+			continue;
 
-		if((stoi(msgTime) + 10) < par->getcurrtime())
+		newcomers.clear();
+		for(Node *n = newReplicas.begin(); n != newReplicas.end(); ++n)
 		{
-			log->logReadFail(&memberNode->addr, coordinator, stoi(checkTransID), tempKey);
-			readQuorum->deleteKey(checkTransID);
-			
+			bool wasReplica = false;
+			for(Node *o = oldReplicas.begin(); o != oldReplicas.end() && !wasReplica; ++o)
+				wasReplica = HashRing::sameAddress(*n, *o);
+			if(!wasReplica)
+				newcomers.push_back(n);
 		}
+		if(newcomers.empty())
+			continue;
+		// straight from the store into the chunks
+		for(size_t k = 0; k < hashes.size(); k++)
+			ht->findByHash(hashes[k], [&](StrRef key, StrRef value) {
+				if(hashFunction(key.str()) != pos)		// another position's key with the same hash
+					return;
+				for(unsigned int i = 0; i < newcomers.size(); i++)
+					replicator.enqueue(*newcomers[i]->getAddress(), key, value);
+			});
 	}
 }
-void MP2Node::checkForFailedUpdateReply()
-{	
-		
-	coordinator = true;
-	string checkTransID;
-	string checkData;
-
-	string tempData;
-	string tempID, tempKey, tempValue, msgTime;
-	string delim = " ";
-
-	for (map<string,string>::iterator it =posQuorum->hashTable.begin(); it!=posQuorum->hashTable.end(); ++it)
-	{
-		checkTransID = it->first;
-		checkData = it->second;
-		vector <string> tokens;
-		std::stringstream streamData(checkData);
-		// format: quorumCount key value time
-		if(stoi(checkTransID) > 6000 && stoi(checkTransID) < 8001)		// update Key
+
+/**
+ * FUNCTION NAME: findReplicaPeers
+ *
+ * DESCRIPTION: Collects the other nodes that share at least one replicated range
+ * 				with this one and, for each, marks the ring positions whose replica
+ * 				list holds both, i.e. the Merkle leaves the two should agree on.
+ * 				One pass over the ring; the anti-entropy paths read the result.
+ */
+void MP2Node::findReplicaPeers()
+{
+	Node me(memberNode->addr);
+	sharingPeers.clear();
+	sharingPositions.clear();
+	noPositions.assign(merkle.leafCount(), 0);
+	for(size_t pos = 0; pos < RING_SIZE; pos++)
+	{
+		ReplicaView replicas = hashRing.lookup(pos);
+		bool haveMe = false;
+		for(Node *n = replicas.begin(); n != replicas.end() && !haveMe; ++n)
+			haveMe = HashRing::sameAddress(*n, me);
+		if(!haveMe)
+			continue;
+		for(Node *n = replicas.begin(); n != replicas.end(); ++n)
 		{
-			while(getline(streamData, tempData, ' '))
-			{
-				tokens.push_back(tempData);
-			}
-			tempKey = tokens[1];
-			tempValue = tokens[2];
-			msgTime = tokens[3];
-			if((stoi(msgTime) + 10) < par->getcurrtime())
+			if(HashRing::sameAddress(*n, me))
+				continue;
+			unsigned int i = 0;
+			while(i < sharingPeers.size() && !HashRing::sameAddress(sharingPeers[i], *n))
+				i++;
+			if(i == sharingPeers.size())
 			{
-				log->logUpdateFail(&memberNode->addr, coordinator, stoi(checkTransID), tempKey, tempValue);
-				posQuorum->deleteKey(checkTransID);
-				
+				sharingPeers.push_back(*n);
+				sharingPositions.push_back(noPositions);
 			}
+			sharingPositions[i][pos] = 1;
 		}
 	}
 }
 
+/**
+ * FUNCTION NAME: sharedPositions
+ *
+ * DESCRIPTION: The ring positions this node and peer both replicate, as of the
+ * 				last ring change; none if peer shares no range with this node
+ */
+const vector<char> & MP2Node::sharedPositions(Node &peer)
+{
+	for(unsigned int i = 0; i < sharingPeers.size(); i++)
+	{
+		if(HashRing::sameAddress(sharingPeers[i], peer))
+			return sharingPositions[i];
+	}
+	return noPositions;
+}
 
-int MP2Node::getNodeRingPosition()
+/**
+ * FUNCTION NAME: startAntiEntropy
+ *
+ * DESCRIPTION: Opens a Merkle exchange with peer by sending the hashes of the
+ * 				MERKLE_START_LEVEL subtrees over the ranges both replicate. The
+ * 				exchange is stateless: each side answers a digest with the
+ * 				children of the subtrees that differ, until the differing
+ * 				leaves are reached and their keys are swapped.
+ */
+void MP2Node::startAntiEntropy(Node &peer)
+{
+	const vector<char> &mask = sharedPositions(peer);
+	int level = min(MERKLE_START_LEVEL, merkle.getDepth());
+	vector<pair<size_t, unsigned long long> > entries;
+	for(size_t i = 0; i < merkle.width(level); i++)
+	{
+		if(merkle.overlaps(level, i, mask))
+			entries.push_back(make_pair(i, merkle.maskedHash(level, i, mask)));
+	}
+	if(!entries.empty())
+		sendDigest(peer.getAddress(), level, entries);
+}
+
+/**
+ * FUNCTION NAME: runAntiEntropy
+ *
+ * DESCRIPTION: Background repair: every antiEntropyPeriod ticks, starts an
+ * 				exchange with the next node (round robin) that shares ranges
+ */
+void MP2Node::runAntiEntropy()
+{
+	if(antiEntropyPeriod <= 0 || par->getcurrtime() - lastAntiEntropy < antiEntropyPeriod)
+		return;
+	lastAntiEntropy = par->getcurrtime();
+
+	if(sharingPeers.empty())
+		return;
+	startAntiEntropy(sharingPeers[antiEntropyRound++ % sharingPeers.size()]);
+}
+
+/**
+ * FUNCTION NAME: sendDigest
+ *
+ * DESCRIPTION: Sends (node index, hash) pairs of one tree level, split into
+ * 				MERKLE_DIGEST frames of at most BATCH_MAX_BYTES payload
+ */
+void MP2Node::sendDigest(Address *toAddr, int level, vector<pair<size_t, unsigned long long> > &entries)
+{
+	static const string noKey;
+	// index varint (<= 5 bytes) plus the 8-byte hash
+	const size_t perFrame = (BATCH_MAX_BYTES - 5) / 13;
+	for(size_t first = 0; first < entries.size(); first += perFrame)
+	{
+		vector<pair<size_t, unsigned long long> > part(entries.begin() + first,
+				entries.begin() + min(entries.size(), first + perFrame));
+		string payload;
+		MerkleDigest::encode(payload, level, part);
+		PooledBuffer buf(sendBuffers);
+		MessageCodec::encode(buf.get(), (MessageType)MERKLE_DIGEST, 0, memberNode->addr, noKey, payload, PRIMARY, false);
+		transmit(toAddr, buf.data(), buf.size());
+	}
+}
+
+/**
+ * FUNCTION NAME: handleMerkleDigest
+ *
+ * DESCRIPTION: Compares the peer's subtree hashes with the local ones over the
+ * 				shared ranges. Differing interior nodes are answered with the
+ * 				hashes of their children; differing leaves are repaired both
+ * 				ways: local keys are pushed and the peer is asked for its own.
+ */
+void MP2Node::handleMerkleDigest(MessageView &msg)
 {
-	int myRingPosition = -1;
-	int nodeID = *(int *)(&memberNode->addr.addr); 
-	Node tempNode;
-	int ringAddress;
-
-	// identify my position in the ring
-	for(int i=1; i<ring.size(); i++)
-	{	
-		tempNode = ring.at(i);
-		ringAddress = *(int *)(tempNode.getAddress());
-		
-		if(nodeID == ringAddress)
+	int level;
+	vector<pair<size_t, unsigned long long> > entries;
+	if(!MerkleDigest::decode(msg.value, level, entries) || level < 0 || level > merkle.getDepth())
+		return;
+
+	Node peer(msg.fromAddr);
+	const vector<char> &mask = sharedPositions(peer);
+	vector<pair<size_t, unsigned long long> > children;
+	vector<size_t> leaves;
+	for(unsigned int i = 0; i < entries.size(); i++)
+	{
+		size_t index = entries[i].first;
+		if(index >= merkle.width(level) || merkle.maskedHash(level, index, mask) == entries[i].second)
+			continue;
+		if(level == merkle.getDepth())
+		{
+			if(mask[index])
+				leaves.push_back(index);
+			continue;
+		}
+		for(size_t c = index * MERKLE_FANOUT; c < (index + 1) * MERKLE_FANOUT; c++)
 		{
-			myRingPosition = i;
+			if(merkle.overlaps(level + 1, c, mask))
+				children.push_back(make_pair(c, merkle.maskedHash(level + 1, c, mask)));
 		}
 	}
-	return myRingPosition;
+
+	if(!children.empty())
+		sendDigest(&msg.fromAddr, level + 1, children);
+	if(!leaves.empty())
+	{
+		pushLeaves(msg.fromAddr, leaves);
+		static const string noKey;
+		string payload;
+		MerkleDigest::encodeLeaves(payload, leaves);
+		PooledBuffer buf(sendBuffers);
+		MessageCodec::encode(buf.get(), (MessageType)MERKLE_PULL, 0, memberNode->addr, noKey, payload, PRIMARY, false);
+		transmit(&msg.fromAddr, buf.data(), buf.size());
+	}
+}
+
+/**
+ * FUNCTION NAME: handleMerklePull
+ *
+ * DESCRIPTION: Pushes the local keys of the requested leaves that the peer replicates
+ */
+void MP2Node::handleMerklePull(MessageView &msg)
+{
+	vector<size_t> requested;
+	if(!MerkleDigest::decodeLeaves(msg.value, requested))
+		return;
+
+	Node peer(msg.fromAddr);
+	const vector<char> &mask = sharedPositions(peer);
+	vector<size_t> leaves;
+	for(unsigned int i = 0; i < requested.size(); i++)
+	{
+		if(requested[i] < mask.size() && mask[requested[i]])
+			leaves.push_back(requested[i]);
+	}
+	if(!leaves.empty())
+		pushLeaves(msg.fromAddr, leaves);
+}
+
+/**
+ * FUNCTION NAME: pushLeaves
+ *
+ * DESCRIPTION: Queues every local key stored under the given leaves for transfer
+ * 				to toAddr as REPLICATE_REPAIR chunks. Stops once
+ * 				ANTI_ENTROPY_MAX_BYTES are waiting for toAddr; the leaves left
+ * 				out still differ at the next exchange. Without the cap,
+ * 				exchanges during heavy writes queue most of the store on the heap.
+ */
+void MP2Node::pushLeaves(Address &toAddr, vector<size_t> &leaves)
+{
+	for(unsigned int i = 0; i < leaves.size(); i++)
+	{
+		if(leaves[i] >= keyIndex.positions())
+			continue;
+		if(replicator.pendingBytes(toAddr, REPLICATE_REPAIR) >= ANTI_ENTROPY_MAX_BYTES)
+			break;
+		size_t pos = leaves[i];
+		const vector<unsigned long long> &hashes = keyIndex.hashesAt(pos);
+		for(size_t k = 0; k < hashes.size(); k++)
+			ht->findByHash(hashes[k], [&](StrRef key, StrRef value) {
+				if(hashFunction(key.str()) == pos)
+					replicator.enqueue(toAddr, key, value, REPLICATE_REPAIR);
+			});
+	}
 }
 
-bool MP2Node::createOneReplica(int pos1)
+/**
+ * FUNCTION NAME: storeHints
+ *
+ * DESCRIPTION: Buffers a successful write for every replica that did not
+ * 				acknowledge it by the deadline
+ */
+void MP2Node::storeHints(PendingOp &op)
 {
-	string key, value;
-	int msgID = rand() % 2000;
-	for (map<string,string>::iterator it = ht->hashTable.begin(); it!=ht->hashTable.end(); ++it)
-	{	
-		key = it->first;
-		value = it->second;
-		Message *newMsgSecondary = new Message(msgID, memberNode->addr.getAddress(), CREATE, key, value, SECONDARY);
-		emulNet->ENsend(&memberNode->addr, ring.at(pos1).getAddress(), newMsgSecondary->toString());
+	string stored = VersionedValue::pack(op.version, op.value);
+	for(unsigned int i = 0; i < op.replicas.size(); i++)
+	{
+		bool acked = memcmp(op.replicas[i].addr, memberNode->addr.addr, sizeof(memberNode->addr.addr)) == 0;
+		for(unsigned int j = 0; j < op.responses.size() && !acked; j++)
+			acked = memcmp(op.replicas[i].addr, op.responses[j].first.addr, sizeof(op.replicas[i].addr)) == 0;
+		if(!acked)
+			hints.add(op.replicas[i], op.key, stored, par->getcurrtime());
 	}
 }
 
-bool MP2Node::createTwoReplica(int pos1, int pos2)
+/**
+ * FUNCTION NAME: replayHints
+ *
+ * DESCRIPTION: Hands buffered hints to the bulk transfer streams as
+ * 				REPLICATE_REPAIR pairs: to the target once it has been heard
+ * 				from after missing the writes, or, once it has left the ring,
+ * 				to the current replicas of each key
+ */
+void MP2Node::replayHints()
 {
-	string key, value;
-	int msgID = rand() % 2000;
+	Node me(memberNode->addr);
+	for(map<unsigned long long, HintStore::Target>::iterator it = hints.begin(); it != hints.end(); )
+	{
+		HintStore::Target &target = it->second;
+		Node targetNode(target.addr);
+		bool inRing = false;
+		for(unsigned int i = 0; i < ring.size() && !inRing; i++)
+			inRing = HashRing::sameAddress(ring[i], targetNode);
+		if(inRing && target.lastHeard <= target.since)		// still silent
+		{
+			++it;
+			continue;
+		}
 
-	for (map<string,string>::iterator it = ht->hashTable.begin(); it!=ht->hashTable.end(); ++it)
-	{	
-		key = it->first;
-		value = it->second;
-		Message *newMsgSecondary = new Message(msgID, memberNode->addr.getAddress(), CREATE, key, value, SECONDARY);
-		emulNet->ENsend(&memberNode->addr, ring.at(pos1).getAddress(), newMsgSecondary->toString());
-		emulNet->ENsend(&memberNode->addr, ring.at(pos2).getAddress(), newMsgSecondary->toString());
+		for(unsigned int h = 0; h < target.hints.size(); h++)
+		{
+			Hint &hint = target.hints[h];
+			if(inRing)
+			{
+				replicator.enqueue(target.addr, hint.key, hint.stored, REPLICATE_REPAIR);
+				continue;
+			}
+			// ownership moved: the key's new replicas take the write
+			ReplicaView owners = findNodes(hint.key);
+			for(Node *n = owners.begin(); n != owners.end(); ++n)
+			{
+				if(HashRing::sameAddress(*n, me))
+				{
+					string value;
+					Version version;
+					if(VersionedValue::unpack(hint.stored, version, value))
+						repairKeyValue(hint.key, value, version);
+				}
+				else
+					replicator.enqueue(*n->getAddress(), hint.key, hint.stored, REPLICATE_REPAIR);
+			}
+		}
+		it = hints.erase(it);
 	}
 }
+
 void MP2Node::checkForQuorum()
 {
 
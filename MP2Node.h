@@ -18,10 +18,123 @@
 #include "Params.h"
 #include "Message.h"
 #include "Queue.h"
+#include "PendingOpTable.h"
+#include "TransID.h"
+#include "TimingWheel.h"
+#include "MessageCodec.h"
+#include "BufferPool.h"
+#include "HashRing.h"
+#include "BulkTransfer.h"
+#include "MerkleTree.h"
+#include "RangeIndex.h"
+#include "StorageEngine.h"
+#include "OpenHashStorage.h"
+#include "Version.h"
+#include "HintedHandoff.h"
+#include "LogBuffer.h"
+#include "MPSCRing.h"
+#include "ShardedStorage.h"
+#include "WorkerPool.h"
+#include "MultiKey.h"
+#include "ReadCache.h"
+#include "LatencyTracker.h"
+#include "WriteAheadLog.h"
+#include "Snapshot.h"
+#include "Metrics.h"
 
 #define QUORUM_NEEDED 		2;
 #define QUORUM_OBTAINED_SUCCESS		1;
 #define QUORUM_OBTAINED_FAILURE		3;
+#define REPLY_TIMEOUT		10
+// repair bytes a Merkle exchange may have queued for one peer; other differing leaves wait a round
+#define ANTI_ENTROPY_MAX_BYTES	(64 * 1024)
+// ticks after which a digest READ that has quorum but no current value reads it in full
+#define DIGEST_CHECK_TICKS	3
+// reply latency percentile a hedged READ waits before asking another replica
+#define HEDGE_PERCENTILE	0.9
+// ticks between snapshots of a durable store (0: only when recovering)
+#define SNAPSHOT_PERIOD		100
+// receive buffers the inbound ring holds between ticks in threaded mode
+#define INBOUND_RING_CAPACITY	65536
+
+/**
+ * Coordinator-to-replica write of the newest version seen by a READ.
+ * Binary wire format only; applied silently if newer than the local copy.
+ */
+enum RepairMessageType {
+	READ_REPAIR = REPLICATE_REPAIR + 1
+};
+
+/**
+ * Many keys' requests, or replies, for one node in a single frame (MultiKey.h).
+ * Binary wire format only.
+ */
+enum MultiMessageType {
+	MULTI_REQUEST = READ_REPAIR + 1,
+	MULTI_REPLY
+};
+
+/**
+ * Replica-to-coordinator notice that a key it holds a read lease on was
+ * written, and the coordinator's answer once its cached copy is gone; the
+ * value field carries the key. Binary wire format only.
+ */
+enum LeaseMessageType {
+	LEASE_REVOKE = MULTI_REPLY + 1,
+	LEASE_REVOKE_ACK
+};
+
+/**
+ * Replies a client operation waits for: R for reads, W for writes
+ */
+enum ConsistencyLevel {
+	CONSISTENCY_ONE,
+	CONSISTENCY_QUORUM,
+	CONSISTENCY_ALL
+};
+
+/**
+ * STRUCT NAME: InboundFrame
+ *
+ * DESCRIPTION: A receive buffer handed over by EmulNet, owned by the ring until popped
+ */
+struct InboundFrame {
+	char *data;
+	int size;
+};
+
+/**
+ * STRUCT NAME: WorkerContext
+ *
+ * DESCRIPTION: What one worker's share of a tick does outside its own shard:
+ * 				messages to send, log lines, the newest version seen, read
+ * 				results to cache and latency samples. The
+ * 				main thread applies them once every worker has finished.
+ * 				Operation metrics go straight into the worker's own shard.
+ */
+struct WorkerContext {
+	struct CacheFill {
+		string key;
+		string value;
+		Version version;
+		int expires;
+	};
+
+	vector<pair<Address, string> > outbound;
+	vector<LogEvent> logs;
+	Version observed;
+	vector<CacheFill> cacheFills;
+	vector<pair<Address, int> > replyLatencies;
+	vector<int> readLatencies;
+	MetricsShard *metrics;
+
+	// the buffer to serialize a message to toAddr into
+	string & stage(Address &toAddr) {
+		outbound.push_back(make_pair(toAddr, string()));
+		return outbound.back().second;
+	}
+};
+
 //#define MESSAGE_SUCESSFULL 	1;
 //#define MESSAGE_FAILED 		2;
 //#define MESSAGE_STATUS_PENDING 3;
@@ -38,14 +151,35 @@
  */
 class MP2Node {
 private:
-	// Vector holding the next two neighbors in the ring who have my replicas
-	vector<Node> hasMyReplicas;
 	// Vector holding the previous two neighbors in the ring whose replicas I have
 	vector<Node> haveReplicasOf;
 	// Ring
 	vector<Node> ring;
-	// Hash Table
-	HashTable * ht;
+	// (id, port) of MP1's membership list as the ring was last checked against it
+	vector<pair<int, short> > ringSource;
+	// Replica lookup table built from ring, and the one it replaced
+	HashRing hashRing;
+	HashRing previousRing;
+	// Outgoing stabilization transfers, and chunks already applied here
+	ReplicationSender replicator;
+	ChunkDeduplicator appliedChunks;
+	// Hash tree of the local keys by ring position, and the background repair schedule
+	MerkleTree merkle;
+	int antiEntropyPeriod;
+	int lastAntiEntropy;
+	unsigned int antiEntropyRound;
+	// Nodes sharing a replicated range with this one, and per peer the ring positions
+	// both replicate; rebuilt by stabilizationProtocol when the ring changes
+	vector<Node> sharingPeers;
+	vector<vector<char> > sharingPositions;
+	vector<char> noPositions;
+	// Local key-value store, and what builds it (empty: OpenHashStorage)
+	StorageEngine * ht;
+	StorageFactory storageFactory;
+	// ht was handed over with setStorageEngine and cannot be rebuilt
+	bool customEngine;
+	// Hashes of the keys of ht, bucketed by ring position
+	RangeIndex keyIndex;
 	// Member representing this member
 	Member *memberNode;
 	// Params object
@@ -54,13 +188,58 @@ private:
 	EmulNet * emulNet;
 	// Object of Log
 	Log * log;
+	// CRUD log calls go through this so worker threads can defer them
+	LogBuffer opLog;
 
+	// isCoordinator of the server-side log lines; always false, so worker threads may read it
 	bool coordinator;
 	MessageType myLastMsg;
-	HashTable * posQuorum;
-	HashTable * negQuorum;
-	HashTable * readQuorum;
-	HashTable * updateQuorum;
+	// Operations this node coordinates that have not reached quorum yet, one table per worker
+	vector<PendingOpTable> pendingShards;
+	// Source of collision-free transaction IDs for this node
+	TransIDAllocator transIDs;
+	// Deadlines of the pending operations
+	TimingWheel timeouts;
+	// Ticks an operation may wait for quorum before it fails
+	int replyTimeout;
+	// Replicas per key (N)
+	size_t replicationFactor;
+	// Send Message::toString() text instead of the binary wire format (debugging)
+	bool textWireFormat;
+	// Reusable buffers for serialized outbound messages
+	BufferPool sendBuffers;
+	// Versions for writes this node coordinates or stores
+	HybridClock clock;
+	// Writes replicas missed, waiting to be handed off
+	HintStore hints;
+	// Leased read results this node coordinated, and the leases it granted as a replica
+	ReadCache readCache;
+	LeaseTable leases;
+	int leaseTicks;
+	// READs fetch the value from one replica and digests from the others
+	bool digestReads;
+	// Reply latencies per replica; READs go to the R fastest and hedge to the rest
+	LatencyTracker latency;
+	bool hedgedReads;
+	// Durability: log of local changes (NULL when off), committed once per tick, and snapshots
+	WriteAheadLog *wal;
+	// acknowledgements of writes, sent only once the commit covering them succeeds
+	vector<pair<Address, string> > heldAcks;
+	string snapshotPath;
+	int snapshotPeriod;
+	int lastSnapshot;
+	// loaded from disk; the first ring with replica peers starts a Merkle exchange with each
+	bool recovered;
+	// Operation, traffic and queue metrics, appended as JSON lines to metricsOut (NULL: not dumped)
+	MetricsRegistry metrics;
+	FILE *metricsOut;
+	int metricsPeriod;
+	int lastMetricsDump;
+
+	// Threaded mode: message handlers, the ring recvLoop fills, and each worker's deferred effects
+	WorkerPool *workers;
+	MPSCRing<InboundFrame> *inbound;
+	vector<WorkerContext> workerContexts;
 
 	string replyRead;
 	bool initialRingSetup;
@@ -72,49 +251,193 @@ public:
 	Member * getMemberNode() {
 		return this->memberNode;
 	}
+	void setReplyTimeout(int ticks) {
+		this->replyTimeout = ticks;
+	}
+	// N; must be the same on every node of the cluster
+	void setReplicationFactor(int n) {
+		this->replicationFactor = n < 1 ? 1 : n;
+	}
+	void setTextWireFormat(bool text) {
+		this->textWireFormat = text;
+	}
+	void setVirtualNodes(int tokensPerNode) {
+		hashRing.setTokensPerNode(tokensPerNode);
+	}
+	void setNodeWeight(Address addr, double weight) {
+		hashRing.setWeight(addr, weight);
+	}
+	// replaces the local store, moving its contents, and takes ownership of engine; in
+	// threaded mode only a ShardedStorage with one shard per worker is accepted
+	bool setStorageEngine(StorageEngine *engine);
+	// builds the local store, or each worker's shard of it, with factory from now on
+	void setStorageFactory(const StorageFactory &factory);
+	// handle messages on this many threads (1: on the caller only); call before traffic starts.
+	// Fails if a single engine set with setStorageEngine would have to be sharded
+	bool setWorkerThreads(int threads);
+	// coordinator read cache of this many entries (0 disables it); leaseTicks must match on every node
+	void setReadCache(size_t entries, int leaseTicks = READ_LEASE_TICKS) {
+		readCache.setCapacity(entries);
+		this->leaseTicks = leaseTicks;
+	}
+	// binary wire format only; N-1 replicas answer READs with an 8-byte digest
+	void setDigestReads(bool digests) {
+		this->digestReads = digests;
+	}
+	// READs go to the R replicas with the lowest latency estimate first
+	void setHedgedReads(bool hedged) {
+		this->hedgedReads = hedged;
+	}
+	const LatencyTracker & getLatencyTracker() const {
+		return latency;
+	}
+	const ReadCache & getReadCache() const {
+		return readCache;
+	}
+	// keep the local store in pathPrefix.wal / pathPrefix.snap, loading what is there first;
+	// sync=false skips fdatasync (tests, benchmarks)
+	bool setDurability(const string &pathPrefix, int snapshotTicks = SNAPSHOT_PERIOD, bool sync = true);
+	const WriteAheadLog * getWriteAheadLog() const {
+		return wal;
+	}
+	// whether log lines go to the background log thread; they do exactly when the Log passed in
+	// is AsyncLog's (nothing else may log through it then), false if async asks otherwise
+	bool setAsyncLogging(bool async) {
+		return opLog.setAsync(async);
+	}
+	// binary trace of every CRUD log event at path; textLog=false keeps them out of dbg.log
+	bool setLogTrace(const string &path, bool textLog = true) {
+		return opLog.setTrace(path, textLog);
+	}
+	// append the metrics to path as a JSON line every periodTicks and at shutdown
+	bool setMetricsOutput(const string &path, int periodTicks = METRICS_DUMP_PERIOD);
+	const MetricsRegistry & getMetrics() const {
+		return metrics;
+	}
+	void resetMetrics() {
+		metrics.reset();
+	}
+	// ticks between background anti-entropy rounds, 0 to disable
+	void setAntiEntropyPeriod(int ticks) {
+		this->antiEntropyPeriod = ticks;
+	}
 
 	// ring functionalities
 	void updateRing();
+	bool membershipChanged();
 	vector<Node> getMembershipList();
 	size_t hashFunction(string key);
 	void findNeighbors();
+	void logRingOwnership();
 
 	// client side CRUD APIs
 	void clientCreate(string key, string value);
 	void clientRead(string key);
 	void clientUpdate(string key, string value);
 	void clientDelete(string key);
-	bool createOneReplica(int pos1);
-	bool createTwoReplica(int pos1, int pos2);
+	void clientCreate(string key, string value, ConsistencyLevel w);
+	void clientRead(string key, ConsistencyLevel r);
+	void clientUpdate(string key, string value, ConsistencyLevel w);
+	void clientDelete(string key, ConsistencyLevel w);
+	// one frame per replica node instead of one message per key and replica
+	void multiGet(const vector<string> &keys, ConsistencyLevel r = CONSISTENCY_QUORUM);
+	void multiPut(const vector<pair<string, string> > &pairs, ConsistencyLevel w = CONSISTENCY_QUORUM);
+	void multiDelete(const vector<string> &keys, ConsistencyLevel w = CONSISTENCY_QUORUM);
+	void sendMulti(MessageType op, const vector<string> &keys, const vector<string> &values, ConsistencyLevel level);
+	void handleMultiRequest(MessageView &msg);
+	void handleMultiReply(MessageView &msg);
+	void replicateMovedKeys();
+	void pumpReplication();
+	void handleReplicateBatch(MessageView &msg);
+
+	// anti-entropy
+	void findReplicaPeers();
+	const vector<char> & sharedPositions(Node &peer);
+	void startAntiEntropy(Node &peer);
+	void runAntiEntropy();
+	void sendDigest(Address *toAddr, int level, vector<pair<size_t, unsigned long long> > &entries);
+	void handleMerkleDigest(MessageView &msg);
+	void handleMerklePull(MessageView &msg);
+	void pushLeaves(Address &toAddr, vector<size_t> &leaves);
 
 	// receive messages from Emulnet
 	bool recvLoop();
 	static int enqueueWrapper(void *env, char *buff, int size);
+	static int enqueueRingWrapper(void *env, char *buff, int size);
 
 	// handle messages from receiving queue
 	void checkMessages();
+	void checkMessagesParallel();
+	void handleMessage(MessageView &msg);
+	void handleReadReply(Address &fromAddress, int transID, StrRef value, const Version &receivedVersion, bool lease, bool digest);
+	void fallbackRead(PendingOp &op);
+	void hedgeRead(PendingOp &op);
+	int hedgeDelay();
+	void recordReplyLatency(Address &fromAddress, PendingOp &op);
+	void recordReadLatency(int ticks);
+	void handleWriteReply(Address &fromAddress, int transID, bool success);
 
 	// coordinator dispatches messages to corresponding nodes
 	void dispatchMessages(Message message);
+	// serialize a message in the configured wire format
+	void encodeMessage(string &out, Message &msg, TransID transID, const Version *version = NULL, unsigned char flags = 0);
+	// serialize once and send to one node / every node in the list
+	void sendMessage(Address *toAddr, Message &msg, TransID transID, const Version *version = NULL, unsigned char flags = 0);
+	void sendToReplicas(ReplicaView replicas, Message &msg, TransID transID, const Version *version = NULL, unsigned char flags = 0);
+	void sendReadRepair(Address &toAddr, PendingOp &op);
+	void sendFrame(Address &toAddr, MessageType type, TransID transID, const string &payload);
+	// every frame leaves through here, on the main thread
+	void transmit(Address *toAddr, char *data, int size);
+
+	// swaps the local store for engine, moving its contents
+	void replaceStorage(StorageEngine *engine);
 
 	// find the addresses of nodes that are responsible for a key
-	vector<Node> findNodes(string key);
+	ReplicaView findNodes(const string &key);
 
 	// server
-	bool createKeyValue(string key, string value, ReplicaType replica, int transID);
+	bool createKeyValue(string key, string value, ReplicaType replica, int transID, Version version = Version());
 	string readKey(string key, int transID);
-	bool updateKeyValue(string key, string value, ReplicaType replica, int transID);
+	bool readVersioned(const string &key, string &value, Version &version);
+	bool updateKeyValue(string key, string value, ReplicaType replica, int transID, Version version = Version());
 	bool deletekey(string key, int transID);
+	bool repairKeyValue(const string &key, const string &value, Version version);
+
+	// durability
+	size_t recoverLocal(const string &pathPrefix);
+	void restoreKeyValue(const string &key, const string &stored);
+	void persist(size_t pos, WalRecordType type, const string &key, const string &stored = string());
+	void commitDurable();
+	bool takeSnapshot();
+
+	// read leases
+	bool readCached(const string &key);
+	void fillReadCache(PendingOp &op);
+	void revokeLeases(const string &key);
+	void sendWriteReply(Address &toAddr, const string &key, Message &reply, TransID transID);
+	void acknowledgeRevoke(Address &holder, const string &key);
+	void expireLeaseHolds();
+
+	// metrics
+	MetricsShard & metricsShard();
+	void recordOutcome(PendingOp &op, MetricOutcome outcome);
+	void sampleMetrics();
+	void dumpMetrics(bool final);
 
 	// stabilization protocol - handle multiple failures
 	void stabilizationProtocol();
 
 	~MP2Node();
 	// MY ADDED FUCTION //
-	int checkCreateReply(int transID, string qCount, string replyKey, string replyData, bool msgSuccessful, string replyTime);
+	PendingOp * trackOperation(TransID transID, MessageType op, string key, string value, ReplicaView replicas, ConsistencyLevel level);
+	int requiredReplies(ConsistencyLevel level, size_t replicas);
+	PendingOpTable & pendingFor(TransID transID);
+	void observeVersion(const Version &version);
+	void storeHints(PendingOp &op);
+	void replayHints();
+	int checkCreateReply(PendingOp &op, bool msgSuccessful);
 	int checkDeleteReply(int transID, bool msgSuccessful);
 	void checkForFailedReply();
-	void checkForFailedUpdateReply();
 	int getNodeRingPosition();
 	void checkForQuorum();
 
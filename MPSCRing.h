@@ -0,0 +1,113 @@
+/**********************************
+ * FILE NAME: MPSCRing.h
+ *
+ * DESCRIPTION: Bounded lock-free multi-producer single-consumer ring buffer
+ **********************************/
+
+#ifndef MPSCRING_H_
+#define MPSCRING_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <atomic>
+
+#define CACHE_LINE_SIZE		64
+
+/**
+ * CLASS NAME: MPSCRing
+ *
+ * DESCRIPTION: Array of cells, each with a sequence number that says whether
+ * 				it is free for the producer at that position or holds a value
+ * 				for the consumer. Producers claim a position with one CAS on
+ * 				the head; the consumer owns the tail outright. Neither side
+ * 				ever blocks: a full ring makes tryPush fail, an empty one
+ * 				makes tryPop fail. Values are copied in and out by
+ * 				assignment, so T must be cheap to copy, or (like a struct of
+ * 				strings) reuse what the cell already holds.
+ */
+template <typename T>
+class MPSCRing {
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	Cell *cells;
+	size_t mask;
+	// producers' next position and the consumer's, padded onto separate cache lines
+	char padHead[CACHE_LINE_SIZE];
+	std::atomic<size_t> head;
+	char padTail[CACHE_LINE_SIZE];
+	size_t tail;
+	char padEnd[CACHE_LINE_SIZE];
+
+	MPSCRing(const MPSCRing &);
+	MPSCRing & operator=(const MPSCRing &);
+
+public:
+	MPSCRing(size_t capacity) : head(0), tail(0) {
+		size_t size = 2;
+		while ( size < capacity ) {
+			size <<= 1;
+		}
+		cells = new Cell[size];
+		mask = size - 1;
+		for ( size_t i = 0; i < size; i++ ) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	~MPSCRing() {
+		delete[] cells;
+	}
+
+	/**
+	 * Any thread. Returns false if the ring is full.
+	 */
+	bool tryPush(const T &value) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		Cell *cell;
+		for ( ;; ) {
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			long diff = (long)sequence - (long)pos;
+			if ( diff == 0 ) {
+				if ( head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ) {
+					break;
+				}
+			}
+			else if ( diff < 0 ) {
+				return false;
+			}
+			else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Consumer thread only. Returns false if the ring is empty.
+	 */
+	bool tryPop(T &value) {
+		Cell *cell = &cells[tail & mask];
+		if ( cell->sequence.load(std::memory_order_acquire) != tail + 1 ) {
+			return false;
+		}
+		value = cell->value;
+		cell->sequence.store(tail + mask + 1, std::memory_order_release);
+		tail++;
+		return true;
+	}
+
+	size_t capacity() const {
+		return mask + 1;
+	}
+};
+
+#endif /* MPSCRING_H_ */
@@ -0,0 +1,266 @@
+/**********************************
+ * FILE NAME: MerkleTree.h
+ *
+ * DESCRIPTION: Incrementally maintained hash tree over the ring positions of
+ * 				the local keys, used for anti-entropy between replicas
+ **********************************/
+
+#ifndef MERKLETREE_H_
+#define MERKLETREE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "MessageCodec.h"
+#include "BulkTransfer.h"
+
+/**
+ * Anti-entropy message types, continuing BulkMessageType. Binary wire format only.
+ *
+ * MERKLE_DIGEST		value: tree level, then (node index, 8-byte hash) pairs
+ * MERKLE_PULL			value: leaf indexes whose pairs the receiver should push back
+ * REPLICATE_REPAIR		a REPLICATE_BATCH chunk whose pairs are inserted only if absent
+ */
+enum MerkleMessageType {
+	MERKLE_DIGEST = REPLICATE_BATCH_ACK + 1,
+	MERKLE_PULL,
+	REPLICATE_REPAIR
+};
+
+#define MERKLE_FANOUT			8
+// level whose hashes open an exchange (64 nodes, one frame)
+#define MERKLE_START_LEVEL		2
+// ticks between background repair rounds
+#define ANTI_ENTROPY_PERIOD		25
+
+/**
+ * CLASS NAME: MerkleTree
+ *
+ * DESCRIPTION: One leaf per ring position; a leaf's hash is the XOR of the
+ * 				hashes of the (key, value) pairs stored at that position, so
+ * 				adding or removing a pair is O(1) at the leaf plus one
+ * 				recomputation per ancestor. Interior nodes hash their
+ * 				MERKLE_FANOUT children in order.
+ *
+ * 				Two replicas only share some positions, so comparisons use a
+ * 				mask of the positions both hold; subtrees fully inside the
+ * 				mask use the stored hash, others are recomputed.
+ *
+ * 				While deferred, add/remove only touch their leaf and mark it,
+ * 				so threads owning disjoint positions can update the tree at
+ * 				once; setDeferred(false) then recomputes the marked paths.
+ */
+class MerkleTree {
+private:
+	int depth;
+	// levels[d] holds MERKLE_FANOUT^d hashes; levels[depth] are the leaves
+	vector<vector<unsigned long long> > levels;
+	// leaves changed while deferred
+	vector<char> dirty;
+	bool deferred;
+
+	static unsigned long long mix(unsigned long long x) {
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	unsigned long long combine(int level, size_t index) const {
+		unsigned long long h = 0x84222325cbf29ce4ULL;
+		for ( size_t c = index * MERKLE_FANOUT; c < (index + 1) * MERKLE_FANOUT; c++ ) {
+			h = mix(h ^ levels[level + 1][c]);
+		}
+		return h;
+	}
+
+	void toggle(size_t pos, unsigned long long h) {
+		levels[depth][pos] ^= h;
+		if ( deferred ) {
+			dirty[pos] = 1;
+			return;
+		}
+		for ( int level = depth - 1; level >= 0; level-- ) {
+			pos /= MERKLE_FANOUT;
+			levels[level][pos] = combine(level, pos);
+		}
+	}
+
+	// number of leaves below one node of level
+	size_t span(int level) const {
+		return levels[depth].size() / levels[level].size();
+	}
+
+public:
+	MerkleTree(size_t positions = RING_SIZE) {
+		depth = 0;
+		deferred = false;
+		size_t leaves = 1;
+		while ( leaves < positions ) {
+			leaves *= MERKLE_FANOUT;
+			depth++;
+		}
+		levels.resize(depth + 1);
+		for ( int d = 0, width = 1; d <= depth; d++, width *= MERKLE_FANOUT ) {
+			levels[d].assign(width, 0);
+		}
+		dirty.assign(levels[depth].size(), 0);
+		clear();
+	}
+
+	void clear() {
+		levels[depth].assign(levels[depth].size(), 0);
+		for ( int level = depth - 1; level >= 0; level-- ) {
+			for ( size_t i = 0; i < levels[level].size(); i++ ) {
+				levels[level][i] = combine(level, i);
+			}
+		}
+	}
+
+	void setDeferred(bool on) {
+		deferred = on;
+		if ( on ) {
+			return;
+		}
+		// one pass per level, each parent recomputed once
+		for ( int level = depth - 1; level >= 0; level-- ) {
+			vector<char> parents(levels[level].size(), 0);
+			for ( size_t i = 0; i < dirty.size(); i++ ) {
+				if ( dirty[i] && !parents[i / MERKLE_FANOUT] ) {
+					parents[i / MERKLE_FANOUT] = 1;
+					levels[level][i / MERKLE_FANOUT] = combine(level, i / MERKLE_FANOUT);
+				}
+			}
+			dirty.swap(parents);
+		}
+		dirty.assign(levels[depth].size(), 0);
+	}
+
+	static unsigned long long entryHash(const string &key, const string &value) {
+		std::hash<string> hashFunc;
+		return mix(hashFunc(key) * 0x9e3779b97f4a7c15ULL + hashFunc(value));
+	}
+
+	void add(size_t pos, const string &key, const string &value) {
+		toggle(pos, entryHash(key, value));
+	}
+
+	void remove(size_t pos, const string &key, const string &value) {
+		toggle(pos, entryHash(key, value));
+	}
+
+	int getDepth() const {
+		return depth;
+	}
+
+	size_t width(int level) const {
+		return levels[level].size();
+	}
+
+	size_t leafCount() const {
+		return levels[depth].size();
+	}
+
+	unsigned long long hash(int level, size_t index) const {
+		return levels[level][index];
+	}
+
+	/**
+	 * Hash of a node counting only leaves with mask[leaf] set (0 if none are)
+	 */
+	unsigned long long maskedHash(int level, size_t index, const vector<char> &mask) const {
+		size_t first = index * span(level);
+		size_t last = first + span(level);
+		size_t covered = 0;
+		for ( size_t leaf = first; leaf < last; leaf++ ) {
+			covered += mask[leaf] ? 1 : 0;
+		}
+		if ( covered == 0 ) {
+			return 0;
+		}
+		if ( covered == last - first ) {
+			return levels[level][index];
+		}
+		unsigned long long h = 0x84222325cbf29ce4ULL;
+		for ( size_t c = index * MERKLE_FANOUT; c < (index + 1) * MERKLE_FANOUT; c++ ) {
+			h = mix(h ^ maskedHash(level + 1, c, mask));
+		}
+		return h;
+	}
+
+	/**
+	 * True if any leaf below the node is in the mask
+	 */
+	bool overlaps(int level, size_t index, const vector<char> &mask) const {
+		for ( size_t leaf = index * span(level); leaf < (index + 1) * span(level); leaf++ ) {
+			if ( mask[leaf] ) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+/**
+ * CLASS NAME: MerkleDigest
+ *
+ * DESCRIPTION: Payload codec for MERKLE_DIGEST and MERKLE_PULL frames
+ */
+class MerkleDigest {
+public:
+	static void encode(string &out, int level, const vector<pair<size_t, unsigned long long> > &entries) {
+		MessageCodec::putVarint(out, level);
+		for ( size_t i = 0; i < entries.size(); i++ ) {
+			MessageCodec::putVarint(out, entries[i].first);
+			for ( int b = 0; b < 8; b++ ) {
+				out.push_back((char)(entries[i].second >> (8 * b)));
+			}
+		}
+	}
+
+	static bool decode(StrRef payload, int &level, vector<pair<size_t, unsigned long long> > &entries) {
+		const unsigned char *p = (const unsigned char *)payload.data;
+		const unsigned char *end = p + payload.len;
+		unsigned long long v;
+		if ( !MessageCodec::getVarint(p, end, v) ) {
+			return false;
+		}
+		level = (int)v;
+		while ( p < end ) {
+			unsigned long long index, h = 0;
+			if ( !MessageCodec::getVarint(p, end, index) || end - p < 8 ) {
+				return false;
+			}
+			for ( int b = 0; b < 8; b++ ) {
+				h |= (unsigned long long)p[b] << (8 * b);
+			}
+			p += 8;
+			entries.push_back(make_pair((size_t)index, h));
+		}
+		return true;
+	}
+
+	static void encodeLeaves(string &out, const vector<size_t> &leaves) {
+		for ( size_t i = 0; i < leaves.size(); i++ ) {
+			MessageCodec::putVarint(out, leaves[i]);
+		}
+	}
+
+	static bool decodeLeaves(StrRef payload, vector<size_t> &leaves) {
+		const unsigned char *p = (const unsigned char *)payload.data;
+		const unsigned char *end = p + payload.len;
+		while ( p < end ) {
+			unsigned long long v;
+			if ( !MessageCodec::getVarint(p, end, v) ) {
+				return false;
+			}
+			leaves.push_back((size_t)v);
+		}
+		return true;
+	}
+};
+
+#endif /* MERKLETREE_H_ */
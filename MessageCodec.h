@@ -0,0 +1,300 @@
+/**********************************
+ * FILE NAME: MessageCodec.h
+ *
+ * DESCRIPTION: Binary wire format for Message and a zero-copy decoder
+ **********************************/
+
+#ifndef MESSAGECODEC_H_
+#define MESSAGECODEC_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Member.h"
+#include "Message.h"
+#include "TransID.h"
+#include "Version.h"
+
+/**
+ * Binary layout, fixed-size integers little-endian:
+ *
+ * 		offset	size	field
+ * 		0		1		magic (WIRE_MAGIC, high nibble) and version (WIRE_VERSION)
+ * 		1		1		MessageType (low 6 bits) and ReplicaType (high 2 bits)
+ * 		2		1		flags (bit 0: success, bit 1: version present, bit 2: lease,
+ * 						bit 3: digest)
+ * 		3		4		transID (the 32-bit wire ID, as in Message::transID)
+ * 		7		var		from address: node ID, port (LEB128)
+ * 		..		var		value version: stamp tick, stamp logical counter, node (LEB128),
+ * 						only if flag bit 1 is set
+ * 		..		var		key length (LEB128)
+ * 		..		var		value length (LEB128)
+ * 		..		..		key bytes, value bytes
+ *
+ * Only the wire ID travels, as in the text format. The receiver of a request
+ * rebuilds the full ID from the sender's node ID (transIDFromWire), and the
+ * coordinator rebuilds a reply's from its own.
+ *
+ * The text format produced by Message::toString() always starts with a
+ * decimal transID, so the magic nibble tells the two apart on receive.
+ */
+#define WIRE_MAGIC			0xB0
+#define WIRE_VERSION		2
+#define WIRE_HEADER_SIZE	7
+// smallest frame: header, one-byte node ID and port, empty key and value
+#define WIRE_MIN_SIZE		(WIRE_HEADER_SIZE + 4)
+#define WIRE_FLAG_SUCCESS	0x01
+#define WIRE_FLAG_VERSION	0x02
+// READ: the coordinator asks for a read lease; READREPLY: the replica granted one
+#define WIRE_FLAG_LEASE		0x04
+// READ: answer with a digest instead of the value; READREPLY: value is that digest
+#define WIRE_FLAG_DIGEST	0x08
+
+/**
+ * STRUCT NAME: StrRef
+ *
+ * DESCRIPTION: Non-owning view of a byte range (string_view for C++11)
+ */
+struct StrRef {
+	const char *data;
+	size_t len;
+
+	StrRef() : data(NULL), len(0) {}
+	StrRef(const char *data, size_t len) : data(data), len(len) {}
+	StrRef(const string &s) : data(s.data()), len(s.size()) {}
+
+	size_t size() const {
+		return len;
+	}
+
+	bool empty() const {
+		return len == 0;
+	}
+
+	string str() const {
+		return string(data, len);
+	}
+
+	bool operator==(const string &s) const {
+		return s.size() == len && (len == 0 || memcmp(s.data(), data, len) == 0);
+	}
+
+	bool operator!=(const string &s) const {
+		return !(*this == s);
+	}
+};
+
+/**
+ * STRUCT NAME: MessageView
+ *
+ * DESCRIPTION: Decoded message whose key and value point into the receive buffer.
+ * 				Only valid while that buffer is alive. Not copyable, since
+ * 				text-decoded views point into their own storage.
+ */
+struct MessageView {
+	MessageType type;
+	ReplicaType replica;
+	bool success;
+	bool lease;
+	bool digest;
+	// the 32-bit wire ID; see transIDFromWire
+	TransID transID;
+	Address fromAddr;
+	StrRef key;
+	StrRef value;
+	// null unless the sender attached one
+	Version version;
+	// backing storage for the text decode path only
+	string keyStore;
+	string valueStore;
+
+	MessageView() : type(CREATE), replica(PRIMARY), success(false), lease(false), digest(false), transID(0) {}
+
+private:
+	MessageView(const MessageView &);
+	MessageView & operator=(const MessageView &);
+};
+
+/**
+ * CLASS NAME: MessageCodec
+ *
+ * DESCRIPTION: Encodes messages in the binary wire format and decodes either format
+ */
+class MessageCodec {
+public:
+	static void putVarint(string &out, unsigned long long v) {
+		while ( v >= 0x80 ) {
+			out.push_back((char)(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back((char)v);
+	}
+
+	static bool getVarint(const unsigned char *&p, const unsigned char *end, unsigned long long &v) {
+		v = 0;
+		for ( int shift = 0; shift < 64 && p < end; shift += 7 ) {
+			unsigned char b = *p++;
+			v |= (unsigned long long)(b & 0x7f) << shift;
+			if ( !(b & 0x80) ) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static bool isBinary(const char *data, int size) {
+		return size >= WIRE_MIN_SIZE && ((unsigned char)data[0] & 0xf0) == WIRE_MAGIC;
+	}
+
+	/**
+	 * Message type of an encoded message in either format without decoding
+	 * the rest (Message::toString() puts it in the third "::" field); -1 if
+	 * there is none
+	 */
+	static int peekType(const char *data, int size) {
+		if ( isBinary(data, size) ) {
+			return (unsigned char)data[1] & 0x3f;
+		}
+		int fields = 0;
+		for ( int i = 0; i + 1 < size; i++ ) {
+			if ( data[i] == ':' && data[i + 1] == ':' && ++fields == 2 ) {
+				int type = 0;
+				for ( i += 2; i < size && data[i] >= '0' && data[i] <= '9'; i++ ) {
+					type = type * 10 + (data[i] - '0');
+				}
+				return type;
+			}
+		}
+		return -1;
+	}
+
+	/**
+	 * Appends the binary encoding of one message to out
+	 */
+	static void encode(string &out, MessageType type, TransID transID, Address &fromAddr,
+			const string &key, const string &value, ReplicaType replica, bool success, const Version *version = NULL,
+			unsigned char flags = 0) {
+		size_t base = out.size();
+		out.resize(base + WIRE_HEADER_SIZE);
+		char *h = &out[base];
+		h[0] = (char)(WIRE_MAGIC | WIRE_VERSION);
+		h[1] = (char)((type & 0x3f) | (replica << 6));
+		h[2] = (char)((success ? WIRE_FLAG_SUCCESS : 0) | (version ? WIRE_FLAG_VERSION : 0) | flags);
+		unsigned int wire = (unsigned int)transIDWire(transID);
+		for ( int i = 0; i < 4; i++ ) {
+			h[3 + i] = (char)(wire >> (8 * i));
+		}
+		putVarint(out, *(unsigned int *)fromAddr.addr);
+		putVarint(out, *(unsigned short *)&fromAddr.addr[4]);
+		if ( version ) {
+			putVarint(out, version->stamp >> HLC_LOGICAL_BITS);
+			putVarint(out, version->stamp & ((1ULL << HLC_LOGICAL_BITS) - 1));
+			putVarint(out, version->node);
+		}
+		putVarint(out, key.size());
+		putVarint(out, value.size());
+		out.append(key);
+		out.append(value);
+	}
+
+	/**
+	 * Binary encoding of msg, carrying transIDWire(transID) instead of msg.transID.
+	 * Like Message::toString(), only the fields used by msg.type are written.
+	 * flags adds WIRE_FLAG_* bits not derived from msg.
+	 */
+	static void encode(string &out, Message &msg, TransID transID, const Version *version = NULL, unsigned char flags = 0) {
+		static const string none;
+		bool hasKey = (msg.type != REPLY && msg.type != READREPLY);
+		bool hasValue = (msg.type == CREATE || msg.type == UPDATE || msg.type == READREPLY);
+		const string &key = hasKey ? msg.key : none;
+		const string &value = hasValue ? msg.value : none;
+		out.reserve(out.size() + WIRE_HEADER_SIZE + 4 * 10 + 5 + key.size() + value.size());
+		encode(out, msg.type, transID, msg.fromAddr, key, value, msg.replica, msg.success, version, flags);
+	}
+
+	static string encode(Message &msg, TransID transID, const Version *version = NULL) {
+		string out;
+		encode(out, msg, transID, version);
+		return out;
+	}
+
+	/**
+	 * Decodes a binary message in place. Returns false if the buffer is not a
+	 * well-formed message of a supported version.
+	 */
+	static bool decode(const char *data, int size, MessageView &view) {
+		if ( !isBinary(data, size) || ((unsigned char)data[0] & 0x0f) != WIRE_VERSION ) {
+			return false;
+		}
+		const unsigned char *p = (const unsigned char *)data;
+		const unsigned char *end = p + size;
+		view.type = (MessageType)(p[1] & 0x3f);
+		view.replica = (ReplicaType)(p[1] >> 6);
+		view.success = (p[2] & WIRE_FLAG_SUCCESS) != 0;
+		view.lease = (p[2] & WIRE_FLAG_LEASE) != 0;
+		view.digest = (p[2] & WIRE_FLAG_DIGEST) != 0;
+		unsigned int wire = 0;
+		for ( int i = 0; i < 4; i++ ) {
+			wire |= (unsigned int)p[3 + i] << (8 * i);
+		}
+		view.transID = wire;
+		bool versioned = (p[2] & WIRE_FLAG_VERSION) != 0;
+		p += WIRE_HEADER_SIZE;
+		unsigned long long nodeID, port;
+		if ( !getVarint(p, end, nodeID) || !getVarint(p, end, port) || nodeID > 0xffffffffULL || port > 0xffff ) {
+			return false;
+		}
+		unsigned int id = (unsigned int)nodeID;
+		unsigned short shortPort = (unsigned short)port;
+		memcpy(view.fromAddr.addr, &id, 4);
+		memcpy(&view.fromAddr.addr[4], &shortPort, 2);
+		view.version = Version();
+		if ( versioned ) {
+			unsigned long long tick, logical, node;
+			if ( !getVarint(p, end, tick) || !getVarint(p, end, logical) || !getVarint(p, end, node)
+					|| tick >> (64 - HLC_LOGICAL_BITS) != 0 || logical >> HLC_LOGICAL_BITS != 0 || node > 0xffffffffULL ) {
+				return false;
+			}
+			view.version = Version(tick << HLC_LOGICAL_BITS | logical, (unsigned int)node);
+		}
+		unsigned long long keyLen, valueLen;
+		if ( !getVarint(p, end, keyLen) || !getVarint(p, end, valueLen) ) {
+			return false;
+		}
+		if ( keyLen > (unsigned long long)(end - p) || valueLen > (unsigned long long)(end - p) - keyLen ) {
+			return false;
+		}
+		view.key = StrRef((const char *)p, keyLen);
+		view.value = StrRef((const char *)p + keyLen, valueLen);
+		return true;
+	}
+
+	/**
+	 * Decodes a Message::toString() buffer. Copies key and value into the view.
+	 */
+	static bool decodeText(const char *data, int size, MessageView &view) {
+		Message msg(string(data, data + size));
+		view.type = msg.type;
+		view.replica = msg.replica;
+		view.success = msg.success;
+		view.lease = false;
+		view.digest = false;
+		view.transID = (TransID)(unsigned int)msg.transID;
+		view.fromAddr = msg.fromAddr;
+		view.keyStore = msg.key;
+		view.valueStore = msg.value;
+		view.key = StrRef(view.keyStore);
+		view.value = StrRef(view.valueStore);
+		return true;
+	}
+
+	static bool decodeAny(const char *data, int size, MessageView &view) {
+		if ( isBinary(data, size) ) {
+			return decode(data, size, view);
+		}
+		return decodeText(data, size, view);
+	}
+};
+
+#endif /* MESSAGECODEC_H_ */
@@ -0,0 +1,325 @@
+/**********************************
+ * FILE NAME: Metrics.h
+ *
+ * DESCRIPTION: Operation counters, latency histograms and traffic volumes of
+ * 				one node, dumped as JSON lines for capacity planning
+ **********************************/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Message.h"
+
+// linear sub-buckets per power of two (2^5: values within ~3% of a bucket's bounds)
+#define METRICS_SUB_BITS		5
+#define METRICS_BUCKETS			((32 - METRICS_SUB_BITS + 1) << (METRICS_SUB_BITS - 1))
+// message types counted separately; anything above lands in the last slot
+#define METRICS_MESSAGE_TYPES	32
+// ticks between periodic dumps
+#define METRICS_DUMP_PERIOD		100
+
+/**
+ * Client operations with their own counters: CREATE, READ, UPDATE and DELETE,
+ * indexed by their MessageType
+ */
+#define METRICS_OPS				4
+
+enum MetricOutcome {
+	METRIC_SUCCEEDED,
+	METRIC_FAILED,
+	METRIC_TIMED_OUT
+};
+
+/**
+ * CLASS NAME: HdrHistogram
+ *
+ * DESCRIPTION: Log-linear histogram of non-negative integers in the manner of
+ * 				HdrHistogram: every power of two is split into the same number
+ * 				of linear sub-buckets, so the relative error of a percentile is
+ * 				bounded whatever the magnitude, values below 2^METRICS_SUB_BITS
+ * 				are exact and recording is a shift and an increment.
+ */
+class HdrHistogram {
+private:
+	unsigned long buckets[METRICS_BUCKETS];
+	unsigned long total;
+	unsigned long long sum;
+	int maxValue;
+
+	static int indexOf(int v) {
+		if ( v < (1 << METRICS_SUB_BITS) ) {
+			return v < 0 ? 0 : v;
+		}
+		int shift = (31 - __builtin_clz((unsigned int)v)) - (METRICS_SUB_BITS - 1);
+		return (shift << (METRICS_SUB_BITS - 1)) + (v >> shift);
+	}
+
+	// largest value that falls into bucket i
+	static long long highestIn(int i) {
+		if ( i < (1 << METRICS_SUB_BITS) ) {
+			return i;
+		}
+		int shift = (i >> (METRICS_SUB_BITS - 1)) - 1;
+		long long lowest = (long long)(i - (shift << (METRICS_SUB_BITS - 1))) << shift;
+		return lowest + (1LL << shift) - 1;
+	}
+
+public:
+	HdrHistogram() {
+		reset();
+	}
+
+	void reset() {
+		memset(buckets, 0, sizeof(buckets));
+		total = 0;
+		sum = 0;
+		maxValue = 0;
+	}
+
+	void record(int v) {
+		buckets[indexOf(v)]++;
+		total++;
+		sum += v < 0 ? 0 : v;
+		maxValue = max(maxValue, v);
+	}
+
+	void add(const HdrHistogram &other) {
+		for ( int i = 0; i < METRICS_BUCKETS; i++ ) {
+			buckets[i] += other.buckets[i];
+		}
+		total += other.total;
+		sum += other.sum;
+		maxValue = max(maxValue, other.maxValue);
+	}
+
+	/**
+	 * Value at or below which a fraction p of the samples fall (the top of
+	 * its bucket, capped at the largest sample); -1 if empty
+	 */
+	long long percentile(double p) const {
+		if ( total == 0 ) {
+			return -1;
+		}
+		unsigned long rank = (unsigned long)(p * total);
+		unsigned long seen = 0;
+		for ( int i = 0; i < METRICS_BUCKETS; i++ ) {
+			seen += buckets[i];
+			if ( seen > rank || seen == total ) {
+				return min(highestIn(i), (long long)maxValue);
+			}
+		}
+		return maxValue;
+	}
+
+	unsigned long count() const {
+		return total;
+	}
+
+	double mean() const {
+		return total == 0 ? 0 : (double)sum / total;
+	}
+
+	int getMax() const {
+		return maxValue;
+	}
+};
+
+/**
+ * STRUCT NAME: OpMetrics
+ *
+ * DESCRIPTION: One client operation type: how many were started and how they
+ * 				ended, and the ticks from the client call to the quorum decision
+ */
+struct OpMetrics {
+	unsigned long started;
+	unsigned long outcomes[3];
+	HdrHistogram latency;
+
+	OpMetrics() : started(0) {
+		outcomes[0] = outcomes[1] = outcomes[2] = 0;
+	}
+
+	void add(const OpMetrics &other) {
+		started += other.started;
+		for ( int i = 0; i < 3; i++ ) {
+			outcomes[i] += other.outcomes[i];
+		}
+		latency.add(other.latency);
+	}
+};
+
+/**
+ * STRUCT NAME: MetricsShard
+ *
+ * DESCRIPTION: The operation metrics one thread writes; no other thread
+ * 				writes them, so recording takes no lock or atomic. Padded so
+ * 				neighbouring shards never share a cache line.
+ */
+struct MetricsShard {
+	OpMetrics ops[METRICS_OPS];
+	char pad[64];
+
+	void started(MessageType op) {
+		if ( (int)op < METRICS_OPS ) {
+			ops[op].started++;
+		}
+	}
+
+	void finished(MessageType op, MetricOutcome outcome, int ticks) {
+		if ( (int)op < METRICS_OPS ) {
+			ops[op].outcomes[outcome]++;
+			ops[op].latency.record(ticks);
+		}
+	}
+};
+
+/**
+ * CLASS NAME: MetricsRegistry
+ *
+ * DESCRIPTION: A node's metrics. Operation metrics live in one shard per
+ * 				thread (0: the main thread, w + 1: worker w) and are summed
+ * 				when dumped. Traffic is counted by message type where frames
+ * 				reach EmulNet, which is always the main thread. Gauges are
+ * 				sampled by the node and keep their last and highest value.
+ * 				Counters are totals since start; a consumer takes differences
+ * 				between dumps for rates.
+ */
+class MetricsRegistry {
+private:
+	vector<MetricsShard> shards;
+	unsigned long sentMessages[METRICS_MESSAGE_TYPES];
+	unsigned long long sentBytes[METRICS_MESSAGE_TYPES];
+	size_t queueDepth;
+	size_t queueDepthMax;
+	size_t inFlight;
+	size_t inFlightMax;
+
+	static void writeHistogram(FILE *out, const HdrHistogram &h) {
+		fprintf(out, "{\"count\":%lu,\"mean\":%.3f,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%d}",
+				h.count(), h.mean(), h.percentile(0.5), h.percentile(0.9), h.percentile(0.99), h.percentile(0.999), h.getMax());
+	}
+
+public:
+	MetricsRegistry() : shards(1), queueDepth(0), queueDepthMax(0), inFlight(0), inFlightMax(0) {
+		memset(sentMessages, 0, sizeof(sentMessages));
+		memset(sentBytes, 0, sizeof(sentBytes));
+	}
+
+	// one shard for the main thread and one per worker; keeps what was recorded
+	void setThreads(int workers) {
+		MetricsShard total = merged();
+		shards.assign(workers + 1, MetricsShard());
+		shards[0] = total;
+	}
+
+	MetricsShard & shard(size_t i) {
+		return shards[i];
+	}
+
+	MetricsShard merged() const {
+		MetricsShard total;
+		for ( size_t s = 0; s < shards.size(); s++ ) {
+			for ( int op = 0; op < METRICS_OPS; op++ ) {
+				total.ops[op].add(shards[s].ops[op]);
+			}
+		}
+		return total;
+	}
+
+	void sent(int type, size_t bytes, unsigned long copies = 1) {
+		int slot = (type < 0 || type >= METRICS_MESSAGE_TYPES) ? METRICS_MESSAGE_TYPES - 1 : type;
+		sentMessages[slot] += copies;
+		sentBytes[slot] += bytes * copies;
+	}
+
+	// starts every counter, histogram and high-water mark again from zero
+	void reset() {
+		for ( size_t s = 0; s < shards.size(); s++ ) {
+			shards[s] = MetricsShard();		// in place: workers hold pointers to their shard
+		}
+		memset(sentMessages, 0, sizeof(sentMessages));
+		memset(sentBytes, 0, sizeof(sentBytes));
+		queueDepthMax = queueDepth;
+		inFlightMax = inFlight;
+	}
+
+	unsigned long getSentMessages(int type) const {
+		return (type < 0 || type >= METRICS_MESSAGE_TYPES) ? 0 : sentMessages[type];
+	}
+
+	unsigned long long getSentBytes(int type) const {
+		return (type < 0 || type >= METRICS_MESSAGE_TYPES) ? 0 : sentBytes[type];
+	}
+
+	size_t getInFlight() const {
+		return inFlight;
+	}
+
+	size_t getQueueDepthMax() const {
+		return queueDepthMax;
+	}
+
+	void sampleQueue(size_t depth) {
+		queueDepth = depth;
+		queueDepthMax = max(queueDepthMax, depth);
+	}
+
+	void sampleInFlight(size_t ops) {
+		inFlight = ops;
+		inFlightMax = max(inFlightMax, ops);
+	}
+
+	/**
+	 * Writes one JSON object on a line of its own: the operation metrics by
+	 * type, traffic by message type (named by typeName; types it returns
+	 * NULL for are summed as "other"), the sampled gauges and extra, which
+	 * the caller fills with figures its components keep themselves
+	 */
+	void writeJson(FILE *out, const string &node, int time, bool final, const char *(*typeName)(int),
+			const vector<pair<const char *, double> > &extra) const {
+		static const char *opNames[METRICS_OPS] = { "create", "read", "update", "delete" };
+		static const char *outcomeNames[3] = { "succeeded", "failed", "timedOut" };
+		MetricsShard total = merged();
+
+		fprintf(out, "{\"node\":\"%s\",\"time\":%d,\"final\":%s,\"ops\":{", node.c_str(), time, final ? "true" : "false");
+		for ( int op = 0; op < METRICS_OPS; op++ ) {
+			const OpMetrics &m = total.ops[op];
+			fprintf(out, "%s\"%s\":{\"started\":%lu", op == 0 ? "" : ",", opNames[op], m.started);
+			for ( int o = 0; o < 3; o++ ) {
+				fprintf(out, ",\"%s\":%lu", outcomeNames[o], m.outcomes[o]);
+			}
+			fprintf(out, ",\"latencyTicks\":");
+			writeHistogram(out, m.latency);
+			fprintf(out, "}");
+		}
+
+		fprintf(out, "},\"sent\":{");
+		unsigned long otherMessages = 0;
+		unsigned long long otherBytes = 0;
+		bool first = true;
+		for ( int t = 0; t < METRICS_MESSAGE_TYPES; t++ ) {
+			const char *name = typeName(t);
+			if ( name == NULL ) {
+				otherMessages += sentMessages[t];
+				otherBytes += sentBytes[t];
+				continue;
+			}
+			fprintf(out, "%s\"%s\":{\"messages\":%lu,\"bytes\":%llu}", first ? "" : ",", name, sentMessages[t], sentBytes[t]);
+			first = false;
+		}
+		fprintf(out, "%s\"other\":{\"messages\":%lu,\"bytes\":%llu}}", first ? "" : ",", otherMessages, otherBytes);
+
+		fprintf(out, ",\"gauges\":{\"queueDepth\":%zu,\"queueDepthMax\":%zu,\"inFlight\":%zu,\"inFlightMax\":%zu",
+				queueDepth, queueDepthMax, inFlight, inFlightMax);
+		for ( size_t i = 0; i < extra.size(); i++ ) {
+			fprintf(out, ",\"%s\":%.17g", extra[i].first, extra[i].second);
+		}
+		fprintf(out, "}}\n");
+	}
+};
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,124 @@
+/**********************************
+ * FILE NAME: MultiKey.h
+ *
+ * DESCRIPTION: Payload of the multi-key request and reply frames
+ **********************************/
+
+#ifndef MULTIKEY_H_
+#define MULTIKEY_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Message.h"
+#include "MessageCodec.h"
+#include "TransID.h"
+#include "Version.h"
+
+#define MULTI_FLAG_VERSION	0x01
+#define MULTI_FLAG_SUCCESS	0x02
+// as WIRE_FLAG_LEASE: READ asks for a read lease, READREPLY grants one
+#define MULTI_FLAG_LEASE	0x04
+// fixed bytes of an item before its version, lengths, key and value
+#define MULTI_ITEM_HEADER	11
+
+/**
+ * STRUCT NAME: MultiItem
+ *
+ * DESCRIPTION: One key's operation inside a multi-key frame. Requests carry
+ * 				CREATE / READ / UPDATE / DELETE items; replies carry the
+ * 				matching REPLY / READREPLY items under the same transID, so
+ * 				every key keeps its own quorum tracking at the coordinator.
+ */
+struct MultiItem {
+	MessageType type;
+	ReplicaType replica;
+	TransID transID;
+	bool success;
+	bool lease;
+	Version version;
+	StrRef key;
+	StrRef value;
+};
+
+/**
+ * CLASS NAME: MultiCodec
+ *
+ * DESCRIPTION: Item: type (1), replica (1), transID (8, little-endian),
+ * 				flags (1), version (VERSION_BYTES, if flagged), then key
+ * 				length, value length (LEB128), key and value
+ */
+class MultiCodec {
+public:
+	static void append(string &payload, MessageType type, ReplicaType replica, TransID transID, bool success,
+			const Version *version, const string &key, const string &value, bool lease = false) {
+		char header[MULTI_ITEM_HEADER];
+		header[0] = (char)type;
+		header[1] = (char)replica;
+		for ( int i = 0; i < 8; i++ ) {
+			header[2 + i] = (char)(transID >> (8 * i));
+		}
+		bool versioned = version != NULL && !version->isNull();
+		header[10] = (char)((versioned ? MULTI_FLAG_VERSION : 0) | (success ? MULTI_FLAG_SUCCESS : 0) | (lease ? MULTI_FLAG_LEASE : 0));
+		payload.append(header, MULTI_ITEM_HEADER);
+		if ( versioned ) {
+			char v[VERSION_BYTES];
+			version->write(v);
+			payload.append(v, VERSION_BYTES);
+		}
+		MessageCodec::putVarint(payload, key.size());
+		MessageCodec::putVarint(payload, value.size());
+		payload.append(key);
+		payload.append(value);
+	}
+
+	static size_t itemSize(const string &key, const string &value) {
+		return MULTI_ITEM_HEADER + VERSION_BYTES + 2 * 5 + key.size() + value.size();
+	}
+
+	/**
+	 * Splits a payload into items pointing into it; returns false if it is malformed
+	 */
+	static bool unpack(StrRef payload, vector<MultiItem> &items) {
+		const unsigned char *p = (const unsigned char *)payload.data;
+		const unsigned char *end = p + payload.len;
+		while ( p < end ) {
+			if ( end - p < MULTI_ITEM_HEADER ) {
+				return false;
+			}
+			MultiItem item;
+			item.type = (MessageType)p[0];
+			item.replica = (ReplicaType)p[1];
+			item.transID = 0;
+			for ( int i = 0; i < 8; i++ ) {
+				item.transID |= (TransID)p[2 + i] << (8 * i);
+			}
+			unsigned char flags = p[10];
+			item.success = (flags & MULTI_FLAG_SUCCESS) != 0;
+			item.lease = (flags & MULTI_FLAG_LEASE) != 0;
+			p += MULTI_ITEM_HEADER;
+			if ( flags & MULTI_FLAG_VERSION ) {
+				if ( end - p < VERSION_BYTES ) {
+					return false;
+				}
+				item.version = Version::read((const char *)p);
+				p += VERSION_BYTES;
+			}
+			unsigned long long keyLen, valueLen;
+			if ( !MessageCodec::getVarint(p, end, keyLen) || !MessageCodec::getVarint(p, end, valueLen) ) {
+				return false;
+			}
+			if ( keyLen > (unsigned long long)(end - p) || valueLen > (unsigned long long)(end - p) - keyLen ) {
+				return false;
+			}
+			item.key = StrRef((const char *)p, keyLen);
+			item.value = StrRef((const char *)p + keyLen, valueLen);
+			p += keyLen + valueLen;
+			items.push_back(item);
+		}
+		return true;
+	}
+};
+
+#endif /* MULTIKEY_H_ */
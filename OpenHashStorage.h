@@ -0,0 +1,296 @@
+/**********************************
+ * FILE NAME: OpenHashStorage.h
+ *
+ * DESCRIPTION: Open-addressing storage engine with inline small keys and
+ * 				arena-allocated values
+ **********************************/
+
+#ifndef OPENHASHSTORAGE_H_
+#define OPENHASHSTORAGE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "StorageEngine.h"
+
+// keys up to this many bytes live in the slot itself
+#define STORAGE_INLINE_KEY		19
+#define STORAGE_MIN_CAPACITY	16
+// slots in use per 8 slots before the table doubles
+#define STORAGE_MAX_LOAD_8THS	6
+// arena bytes below which dead space is never compacted
+#define STORAGE_COMPACT_MIN		(1 << 20)
+
+/**
+ * CLASS NAME: OpenHashStorage
+ *
+ * DESCRIPTION: One flat array of 40-byte slots probed linearly, so a lookup
+ * 				usually touches a single cache line. Each slot holds the full
+ * 				64-bit hash (compared before any key bytes), the key inline
+ * 				when it is short, and the offset of the value in a single
+ * 				append-only arena. Long keys go to the arena too.
+ *
+ * 				Deletion shifts the following entries back (no tombstones).
+ * 				Overwritten and deleted arena bytes are reclaimed by
+ * 				compacting the arena once they exceed the live bytes.
+ */
+class OpenHashStorage : public StorageEngine {
+private:
+	struct Slot {
+		// 0 marks an empty slot
+		unsigned long long hash;
+		unsigned long long valueOff;
+		unsigned int valueLen;
+		// <= STORAGE_INLINE_KEY: key bytes are inline; LONG_KEY: key is in the arena
+		unsigned char keyLen;
+		char key[STORAGE_INLINE_KEY];
+	};
+
+	struct LongKey {
+		unsigned long long off;
+		unsigned int len;
+	};
+
+	static const unsigned char LONG_KEY = 0xff;
+
+	vector<Slot> slots;
+	size_t mask;
+	size_t count_;
+	vector<char> arena;
+	// arena bytes no longer referenced by any slot
+	size_t garbage;
+
+	OpenHashStorage(const OpenHashStorage &);
+	OpenHashStorage & operator=(const OpenHashStorage &);
+
+	static unsigned long long hashOf(const string &key) {
+		return keyHash(key);
+	}
+
+	static LongKey longKey(const Slot &s) {
+		LongKey k;
+		memcpy(&k, s.key, sizeof(k));
+		return k;
+	}
+
+	StrRef keyOf(const Slot &s) const {
+		if ( s.keyLen != LONG_KEY ) {
+			return StrRef(s.key, s.keyLen);
+		}
+		LongKey k = longKey(s);
+		return StrRef(&arena[k.off], k.len);
+	}
+
+	StrRef valueOf(const Slot &s) const {
+		return StrRef(s.valueLen ? &arena[s.valueOff] : NULL, s.valueLen);
+	}
+
+	unsigned long long append(const string &bytes) {
+		unsigned long long off = arena.size();
+		arena.insert(arena.end(), bytes.begin(), bytes.end());
+		return off;
+	}
+
+	size_t keyArenaBytes(const Slot &s) const {
+		return s.keyLen == LONG_KEY ? longKey(s).len : 0;
+	}
+
+	/**
+	 * Index of the slot holding key, or of the empty slot where it would go
+	 */
+	size_t probe(const string &key, unsigned long long h, bool &found) const {
+		size_t i = h & mask;
+		while ( slots[i].hash != 0 ) {
+			if ( slots[i].hash == h && keyOf(slots[i]) == key ) {
+				found = true;
+				return i;
+			}
+			i = (i + 1) & mask;
+		}
+		found = false;
+		return i;
+	}
+
+	void rehash(size_t capacity) {
+		vector<Slot> old;
+		old.swap(slots);
+		Slot empty;
+		memset(&empty, 0, sizeof(empty));
+		slots.assign(capacity, empty);
+		mask = capacity - 1;
+		for ( size_t i = 0; i < old.size(); i++ ) {
+			if ( old[i].hash == 0 ) {
+				continue;
+			}
+			size_t j = old[i].hash & mask;
+			while ( slots[j].hash != 0 ) {
+				j = (j + 1) & mask;
+			}
+			slots[j] = old[i];
+		}
+	}
+
+	/**
+	 * Copies the live keys and values into a fresh arena
+	 */
+	void compact() {
+		vector<char> fresh;
+		fresh.reserve(arena.size() - garbage);
+		for ( size_t i = 0; i < slots.size(); i++ ) {
+			Slot &s = slots[i];
+			if ( s.hash == 0 ) {
+				continue;
+			}
+			if ( s.keyLen == LONG_KEY ) {
+				LongKey k = longKey(s);
+				unsigned long long off = fresh.size();
+				fresh.insert(fresh.end(), arena.begin() + k.off, arena.begin() + k.off + k.len);
+				k.off = off;
+				memcpy(s.key, &k, sizeof(k));
+			}
+			unsigned long long off = fresh.size();
+			fresh.insert(fresh.end(), arena.begin() + s.valueOff, arena.begin() + s.valueOff + s.valueLen);
+			s.valueOff = off;
+		}
+		arena.swap(fresh);
+		garbage = 0;
+	}
+
+	void maybeCompact() {
+		if ( arena.size() >= STORAGE_COMPACT_MIN && garbage * 2 > arena.size() ) {
+			compact();
+		}
+	}
+
+public:
+	OpenHashStorage() : mask(0), count_(0), garbage(0) {
+		rehash(STORAGE_MIN_CAPACITY);
+	}
+
+	bool create(const string &key, const string &value) {
+		if ( (count_ + 1) * 8 > slots.size() * STORAGE_MAX_LOAD_8THS ) {
+			rehash(slots.size() * 2);
+		}
+		unsigned long long h = hashOf(key);
+		bool found;
+		size_t i = probe(key, h, found);
+		if ( found ) {
+			return update(key, value);
+		}
+		Slot &s = slots[i];
+		s.hash = h;
+		if ( key.size() <= STORAGE_INLINE_KEY ) {
+			s.keyLen = (unsigned char)key.size();
+			memcpy(s.key, key.data(), key.size());
+		}
+		else {
+			LongKey k = { append(key), (unsigned int)key.size() };
+			s.keyLen = LONG_KEY;
+			memcpy(s.key, &k, sizeof(k));
+		}
+		s.valueOff = append(value);
+		s.valueLen = (unsigned int)value.size();
+		count_++;
+		return true;
+	}
+
+	string read(const string &key) {
+		bool found;
+		size_t i = probe(key, hashOf(key), found);
+		return found ? valueOf(slots[i]).str() : string();
+	}
+
+	bool update(const string &key, const string &newValue) {
+		bool found;
+		size_t i = probe(key, hashOf(key), found);
+		if ( !found ) {
+			return false;
+		}
+		Slot &s = slots[i];
+		if ( newValue.size() <= s.valueLen ) {
+			// overwrite in place; the tail becomes garbage
+			if ( !newValue.empty() ) {
+				memcpy(&arena[s.valueOff], newValue.data(), newValue.size());
+			}
+			garbage += s.valueLen - newValue.size();
+		}
+		else {
+			garbage += s.valueLen;
+			s.valueOff = append(newValue);
+		}
+		s.valueLen = (unsigned int)newValue.size();
+		maybeCompact();
+		return true;
+	}
+
+	bool deleteKey(const string &key) {
+		bool found;
+		size_t i = probe(key, hashOf(key), found);
+		if ( !found ) {
+			return false;
+		}
+		garbage += slots[i].valueLen + keyArenaBytes(slots[i]);
+		// backward-shift the rest of the probe run into the hole
+		size_t hole = i;
+		for ( size_t j = (i + 1) & mask; slots[j].hash != 0; j = (j + 1) & mask ) {
+			size_t home = slots[j].hash & mask;
+			if ( ((j - home) & mask) >= ((j - hole) & mask) ) {
+				slots[hole] = slots[j];
+				hole = j;
+			}
+		}
+		slots[hole].hash = 0;
+		count_--;
+		maybeCompact();
+		return true;
+	}
+
+	unsigned long count(const string &key) {
+		bool found;
+		probe(key, hashOf(key), found);
+		return found ? 1 : 0;
+	}
+
+	unsigned long currentSize() {
+		return count_;
+	}
+
+	// drops every entry and gives the slots and arena memory back
+	void clear() {
+		count_ = 0;
+		garbage = 0;
+		vector<char>().swap(arena);
+		Slot empty;
+		memset(&empty, 0, sizeof(empty));
+		vector<Slot>(STORAGE_MIN_CAPACITY, empty).swap(slots);
+		mask = STORAGE_MIN_CAPACITY - 1;
+	}
+
+	void forEach(const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = 0; i < slots.size(); i++ ) {
+			if ( slots[i].hash != 0 ) {
+				fn(keyOf(slots[i]), valueOf(slots[i]));
+			}
+		}
+	}
+
+	void findByHash(unsigned long long hash, const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = hash & mask; slots[i].hash != 0; i = (i + 1) & mask ) {
+			if ( slots[i].hash == hash ) {
+				fn(keyOf(slots[i]), valueOf(slots[i]));
+			}
+		}
+	}
+
+	const char * name() const {
+		return "open-hash";
+	}
+
+	// slots and arena bytes currently allocated
+	size_t memoryUsage() const {
+		return slots.capacity() * sizeof(Slot) + arena.capacity();
+	}
+};
+
+#endif /* OPENHASHSTORAGE_H_ */
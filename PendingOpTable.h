@@ -0,0 +1,200 @@
+/**********************************
+ * FILE NAME: PendingOpTable.h
+ *
+ * DESCRIPTION: In-flight operation table used by the coordinator
+ * 				to track quorum state for every outstanding transaction
+ **********************************/
+
+#ifndef PENDINGOPTABLE_H_
+#define PENDINGOPTABLE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Member.h"
+#include "Message.h"
+#include "TransID.h"
+#include "Version.h"
+
+/**
+ * STRUCT NAME: PendingOp
+ *
+ * DESCRIPTION: Coordinator-side state of one outstanding client operation
+ */
+struct PendingOp {
+	TransID transID;
+	MessageType op;
+	string key;
+	// value written by CREATE/UPDATE, or newest value seen by a READ
+	string value;
+	// version of value; READ: newest version any replica reported
+	Version version;
+	// positive and negative replies received so far
+	int acks;
+	int nacks;
+	// positive replies the client asked for (R or W)
+	int required;
+	int startTime;
+	// operation fails if no quorum is reached before this time
+	int deadline;
+	// replicas the request was sent to
+	vector<Address> replicas;
+	// READ: version each replica answered with (null if it lacked the key)
+	vector<pair<Address, Version> > responses;
+	// READ: result already logged; kept until the deadline to repair late repliers
+	bool done;
+	// READ: positive replies that came with a read lease
+	int leases;
+	// READ: version of value (older than version while only digests of the newest arrived)
+	Version dataVersion;
+	// digest READ: the replica asked for the value, and whether a full read was sent after it
+	bool digestRead;
+	Address dataReplica;
+	bool fallbackSent;
+	// hedged READ: replicas is in latency order and the first sent of them were asked, at sentAt
+	bool hedged;
+	size_t sent;
+	vector<int> sentAt;
+
+	PendingOp() : transID(0), op(CREATE), acks(0), nacks(0), required(0), startTime(0), deadline(0), done(false), leases(0),
+			digestRead(false), fallbackSent(false), hedged(false), sent(0) {}
+};
+
+/**
+ * CLASS NAME: PendingOpTable
+ *
+ * DESCRIPTION: Flat open-addressing hash map from transID to PendingOp.
+ * 				Linear probing with backward-shift deletion, so there are no
+ * 				tombstones and lookups stay short under constant churn.
+ */
+class PendingOpTable {
+private:
+	vector<PendingOp> slots;
+	vector<char> used;
+	size_t count;
+	size_t mask;
+
+	static size_t mix(TransID transID) {
+		unsigned long long x = transID;
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return (size_t)x;
+	}
+
+	size_t home(TransID transID) const {
+		return mix(transID) & mask;
+	}
+
+	void grow() {
+		vector<PendingOp> oldSlots;
+		vector<char> oldUsed;
+		oldSlots.swap(slots);
+		oldUsed.swap(used);
+		slots.resize(oldSlots.size() * 2);
+		used.assign(oldUsed.size() * 2, 0);
+		mask = slots.size() - 1;
+		count = 0;
+		for ( size_t i = 0; i < oldSlots.size(); i++ ) {
+			if ( oldUsed[i] ) {
+				*insert(oldSlots[i].transID) = std::move(oldSlots[i]);
+			}
+		}
+	}
+
+public:
+	PendingOpTable(size_t initialCapacity = 64) : count(0) {
+		size_t cap = 8;
+		while ( cap < initialCapacity ) {
+			cap <<= 1;
+		}
+		slots.resize(cap);
+		used.assign(cap, 0);
+		mask = cap - 1;
+	}
+
+	/**
+	 * Returns the entry for transID, creating an empty one if needed
+	 */
+	PendingOp * insert(TransID transID) {
+		if ( (count + 1) * 2 > slots.size() ) {
+			grow();
+		}
+		size_t i = home(transID);
+		while ( used[i] ) {
+			if ( slots[i].transID == transID ) {
+				return &slots[i];
+			}
+			i = (i + 1) & mask;
+		}
+		used[i] = 1;
+		slots[i] = PendingOp();
+		slots[i].transID = transID;
+		count++;
+		return &slots[i];
+	}
+
+	/**
+	 * Returns the entry for transID or NULL if it is not in flight
+	 */
+	PendingOp * find(TransID transID) {
+		size_t i = home(transID);
+		while ( used[i] ) {
+			if ( slots[i].transID == transID ) {
+				return &slots[i];
+			}
+			i = (i + 1) & mask;
+		}
+		return NULL;
+	}
+
+	bool erase(TransID transID) {
+		size_t i = home(transID);
+		while ( used[i] && slots[i].transID != transID ) {
+			i = (i + 1) & mask;
+		}
+		if ( !used[i] ) {
+			return false;
+		}
+		// shift back every following entry whose probe chain crosses the hole
+		size_t j = i;
+		while ( true ) {
+			j = (j + 1) & mask;
+			if ( !used[j] ) {
+				break;
+			}
+			size_t k = home(slots[j].transID);
+			bool movable = (j > i) ? (k <= i || k > j) : (k <= i && k > j);
+			if ( movable ) {
+				slots[i] = std::move(slots[j]);
+				i = j;
+			}
+		}
+		used[i] = 0;
+		slots[i] = PendingOp();
+		count--;
+		return true;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	// raw slot access for scans; returns NULL for empty slots
+	size_t capacity() const {
+		return slots.size();
+	}
+
+	PendingOp * slot(size_t i) {
+		return used[i] ? &slots[i] : NULL;
+	}
+};
+
+#endif /* PENDINGOPTABLE_H_ */
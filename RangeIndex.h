@@ -0,0 +1,156 @@
+/**********************************
+ * FILE NAME: RangeIndex.h
+ *
+ * DESCRIPTION: Secondary index of the local keys by ring position
+ **********************************/
+
+#ifndef RANGEINDEX_H_
+#define RANGEINDEX_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+
+/**
+ * CLASS NAME: RangeIndex
+ *
+ * DESCRIPTION: One bucket per ring position (hashFunction(key)), so
+ * 				stabilization and anti-entropy can walk the keys of the ranges
+ * 				they care about instead of the whole table. Buckets hold the
+ * 				keys' StorageEngine::keyHash values, not the keys, and the
+ * 				walk finds the pairs with StorageEngine::findByHash; a key
+ * 				costs at most 28 bytes here whatever its length. Hashes
+ * 				that collide share an entry with a count.
+ *
+ * 				Each bucket keeps its hashes in a dense array for walking and a
+ * 				small open-addressing table of indexes into it, so add and
+ * 				remove are O(1): removal moves the last hash into the hole and
+ * 				repoints its slot. Buckets share no state, so different
+ * 				positions may be updated concurrently.
+ */
+class RangeIndex {
+private:
+	struct Bucket {
+		vector<unsigned long long> hashes;
+		vector<unsigned int> counts;	// keys with hashes[i]
+		vector<unsigned int> slots;		// index + 1 into hashes, 0 when empty; linear probing
+		size_t keys;					// sum of counts
+
+		Bucket() : keys(0) {}
+	};
+
+	vector<Bucket> buckets;
+
+	static size_t home(const Bucket &bucket, unsigned long long hash) {
+		// the low bits pick the engines' slots; mix in the high ones
+		return (size_t)(hash ^ (hash >> 32)) & (bucket.slots.size() - 1);
+	}
+
+	// slot holding hash, or the empty slot where it would go
+	static size_t find(const Bucket &bucket, unsigned long long hash) {
+		size_t mask = bucket.slots.size() - 1;
+		size_t s = home(bucket, hash);
+		while ( bucket.slots[s] != 0 && bucket.hashes[bucket.slots[s] - 1] != hash ) {
+			s = (s + 1) & mask;
+		}
+		return s;
+	}
+
+	static void grow(Bucket &bucket) {
+		size_t capacity = bucket.slots.empty() ? 8 : bucket.slots.size() * 2;
+		vector<unsigned int>(capacity, 0).swap(bucket.slots);
+		for ( size_t i = 0; i < bucket.hashes.size(); i++ ) {
+			bucket.slots[find(bucket, bucket.hashes[i])] = i + 1;
+		}
+	}
+
+	// empties slot s, shifting back the entries of its probe run behind it
+	static void erase(Bucket &bucket, size_t s) {
+		size_t mask = bucket.slots.size() - 1;
+		size_t next = (s + 1) & mask;
+		while ( bucket.slots[next] != 0 ) {
+			size_t want = home(bucket, bucket.hashes[bucket.slots[next] - 1]);
+			if ( ((next - want) & mask) >= ((next - s) & mask) ) {
+				bucket.slots[s] = bucket.slots[next];
+				s = next;
+			}
+			next = (next + 1) & mask;
+		}
+		bucket.slots[s] = 0;
+	}
+
+public:
+	RangeIndex(size_t positions = RING_SIZE) : buckets(positions) {}
+
+	void add(size_t pos, unsigned long long hash) {
+		Bucket &bucket = buckets[pos];
+		if ( (bucket.hashes.size() + 1) * 2 > bucket.slots.size() ) {
+			grow(bucket);
+		}
+		bucket.keys++;
+		size_t s = find(bucket, hash);
+		if ( bucket.slots[s] != 0 ) {
+			bucket.counts[bucket.slots[s] - 1]++;
+			return;
+		}
+		bucket.hashes.push_back(hash);
+		bucket.counts.push_back(1);
+		bucket.slots[s] = bucket.hashes.size();
+	}
+
+	bool remove(size_t pos, unsigned long long hash) {
+		Bucket &bucket = buckets[pos];
+		if ( bucket.hashes.empty() ) {
+			return false;
+		}
+		size_t s = find(bucket, hash);
+		if ( bucket.slots[s] == 0 ) {
+			return false;
+		}
+		bucket.keys--;
+		size_t index = bucket.slots[s] - 1;
+		if ( --bucket.counts[index] > 0 ) {
+			return true;
+		}
+		erase(bucket, s);
+		size_t last = bucket.hashes.size() - 1;
+		if ( index != last ) {
+			bucket.slots[find(bucket, bucket.hashes[last])] = index + 1;
+			bucket.hashes[index] = bucket.hashes[last];
+			bucket.counts[index] = bucket.counts[last];
+		}
+		bucket.hashes.pop_back();
+		bucket.counts.pop_back();
+		return true;
+	}
+
+	// key hashes stored at one ring position, each once, in no particular order
+	const vector<unsigned long long> & hashesAt(size_t pos) const {
+		return buckets[pos].hashes;
+	}
+
+	size_t positions() const {
+		return buckets.size();
+	}
+
+	size_t size() const {
+		size_t total = 0;
+		for ( size_t i = 0; i < buckets.size(); i++ ) {
+			total += buckets[i].keys;
+		}
+		return total;
+	}
+
+	// heap bytes the buckets hold
+	size_t memoryUsage() const {
+		size_t total = buckets.capacity() * sizeof(Bucket);
+		for ( size_t i = 0; i < buckets.size(); i++ ) {
+			const Bucket &b = buckets[i];
+			total += b.hashes.capacity() * sizeof(unsigned long long) + (b.counts.capacity() + b.slots.capacity()) * sizeof(unsigned int);
+		}
+		return total;
+	}
+};
+
+#endif /* RANGEINDEX_H_ */
@@ -0,0 +1,353 @@
+/**********************************
+ * FILE NAME: ReadCache.h
+ *
+ * DESCRIPTION: Coordinator-side LRU cache of read results, and the replica-side
+ * 				record of the read leases that keep it coherent
+ **********************************/
+
+#ifndef READCACHE_H_
+#define READCACHE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <list>
+#include <unordered_map>
+#include "Member.h"
+#include "Version.h"
+
+// ticks a replica-granted read lease lasts; must match on every node
+#define READ_LEASE_TICKS	5
+
+/**
+ * CLASS NAME: ReadCache
+ *
+ * DESCRIPTION: Values this node read at quorum while every answering replica
+ * 				granted it a lease, in least-recently-used order. An entry is
+ * 				served until its lease expires or a replica revokes it (the
+ * 				key was written there); disabled while the capacity is 0.
+ */
+class ReadCache {
+private:
+	struct Entry {
+		string key;
+		string value;
+		Version version;
+		// first tick the entry may no longer be served
+		int expires;
+	};
+
+	list<Entry> lru;
+	unordered_map<string, list<Entry>::iterator> index;
+	size_t capacity;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;
+	unsigned long evictions;
+
+public:
+	ReadCache() : capacity(0), hits(0), misses(0), invalidations(0), evictions(0) {}
+
+	void setCapacity(size_t entries) {
+		capacity = entries;
+		while ( lru.size() > capacity ) {
+			index.erase(lru.back().key);
+			lru.pop_back();
+			evictions++;
+		}
+	}
+
+	bool enabled() const {
+		return capacity > 0;
+	}
+
+	/**
+	 * Returns true and the value if key is cached under an unexpired lease
+	 */
+	bool lookup(const string &key, int now, string &value) {
+		unordered_map<string, list<Entry>::iterator>::iterator it = index.find(key);
+		if ( it == index.end() ) {
+			misses++;
+			return false;
+		}
+		if ( it->second->expires <= now ) {
+			lru.erase(it->second);
+			index.erase(it);
+			misses++;
+			return false;
+		}
+		lru.splice(lru.begin(), lru, it->second);
+		value = it->second->value;
+		hits++;
+		return true;
+	}
+
+	/**
+	 * Caches a read result; never replaces an entry with an older version
+	 */
+	void fill(const string &key, const string &value, const Version &version, int expires) {
+		if ( capacity == 0 ) {
+			return;
+		}
+		unordered_map<string, list<Entry>::iterator>::iterator it = index.find(key);
+		if ( it != index.end() ) {
+			Entry &e = *it->second;
+			if ( version < e.version ) {
+				return;
+			}
+			e.value = value;
+			e.version = version;
+			e.expires = expires;
+			lru.splice(lru.begin(), lru, it->second);
+			return;
+		}
+		if ( lru.size() >= capacity ) {
+			index.erase(lru.back().key);
+			lru.pop_back();
+			evictions++;
+		}
+		Entry e = { key, value, version, expires };
+		lru.push_front(e);
+		index[key] = lru.begin();
+	}
+
+	void invalidate(const string &key) {
+		unordered_map<string, list<Entry>::iterator>::iterator it = index.find(key);
+		if ( it != index.end() ) {
+			lru.erase(it->second);
+			index.erase(it);
+			invalidations++;
+		}
+	}
+
+	size_t size() const {
+		return lru.size();
+	}
+
+	unsigned long getHits() const {
+		return hits;
+	}
+
+	unsigned long getMisses() const {
+		return misses;
+	}
+
+	unsigned long getInvalidations() const {
+		return invalidations;
+	}
+
+	unsigned long getEvictions() const {
+		return evictions;
+	}
+};
+
+/**
+ * CLASS NAME: LeaseTable
+ *
+ * DESCRIPTION: Replica side: which coordinators hold a lease on which keys,
+ * 				bucketed by ring position like RangeIndex so threads owning
+ * 				different positions can use it at once. A write to a key
+ * 				marks its unexpired leases revoked so the holders can be told
+ * 				to drop their cached copy. A revoked lease stays until its
+ * 				holder acknowledges or it expires, and acknowledgements of
+ * 				writes to the key are held here until then, so no coordinator
+ * 				serves the old value from its cache after a write completed.
+ */
+class LeaseTable {
+private:
+	struct Lease {
+		Address holder;
+		int expires;
+		// LEASE_REVOKE sent, waiting for the holder to acknowledge it
+		bool revoked;
+	};
+
+	struct Entry {
+		vector<Lease> leases;
+		// encoded write replies waiting for the revoked leases
+		vector<pair<Address, string> > held;
+	};
+
+	struct Bucket {
+		map<string, Entry> keys;
+		// replies held in keys, so a sweep skips buckets without any
+		size_t held;
+
+		Bucket() : held(0) {}
+	};
+
+	vector<Bucket> buckets;
+
+	static void dropExpired(vector<Lease> &leases, int now) {
+		for ( size_t i = 0; i < leases.size(); ) {
+			if ( leases[i].expires <= now ) {
+				leases[i] = leases.back();
+				leases.pop_back();
+			}
+			else {
+				i++;
+			}
+		}
+	}
+
+	static bool revoking(const Entry &e, int now) {
+		for ( size_t i = 0; i < e.leases.size(); i++ ) {
+			if ( e.leases[i].revoked && e.leases[i].expires > now ) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void prune(Bucket &bucket, int now) {
+		for ( map<string, Entry>::iterator it = bucket.keys.begin(); it != bucket.keys.end(); ) {
+			dropExpired(it->second.leases, now);
+			if ( it->second.leases.empty() && it->second.held.empty() ) {
+				bucket.keys.erase(it++);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	/**
+	 * Moves the entry's held replies to released once no revoked lease on
+	 * the key is left, and erases the entry if nothing else is in it
+	 */
+	static void settle(Bucket &bucket, map<string, Entry>::iterator it, int now, vector<pair<Address, string> > &released) {
+		Entry &e = it->second;
+		dropExpired(e.leases, now);
+		if ( revoking(e, now) ) {
+			return;
+		}
+		bucket.held -= e.held.size();
+		for ( size_t i = 0; i < e.held.size(); i++ ) {
+			released.push_back(pair<Address, string>());
+			released.back().first = e.held[i].first;
+			released.back().second.swap(e.held[i].second);
+		}
+		e.held.clear();
+		if ( e.leases.empty() ) {
+			bucket.keys.erase(it);
+		}
+	}
+
+public:
+	LeaseTable(size_t positions = RING_SIZE) : buckets(positions) {}
+
+	/**
+	 * Records a lease until expires; a key's first lease also drops the
+	 * bucket's expired ones, so keys that are never written do not pile up
+	 */
+	void grant(size_t pos, const string &key, Address &holder, int now, int expires) {
+		Bucket &bucket = buckets[pos];
+		map<string, Entry>::iterator found = bucket.keys.find(key);
+		if ( found == bucket.keys.end() ) {
+			prune(bucket, now);
+			found = bucket.keys.insert(make_pair(key, Entry())).first;
+		}
+		vector<Lease> &leases = found->second.leases;
+		for ( size_t i = 0; i < leases.size(); i++ ) {
+			if ( leases[i].holder == holder && !leases[i].revoked ) {
+				leases[i].expires = max(leases[i].expires, expires);
+				return;
+			}
+		}
+		Lease l = { holder, expires, false };
+		leases.push_back(l);
+	}
+
+	/**
+	 * Revokes every unexpired lease on key not revoked yet; appends their holders
+	 */
+	void revoke(size_t pos, const string &key, int now, vector<Address> &holders) {
+		Bucket &bucket = buckets[pos];
+		if ( bucket.keys.empty() ) {
+			return;
+		}
+		map<string, Entry>::iterator it = bucket.keys.find(key);
+		if ( it == bucket.keys.end() ) {
+			return;
+		}
+		Entry &e = it->second;
+		dropExpired(e.leases, now);
+		for ( size_t i = 0; i < e.leases.size(); i++ ) {
+			if ( !e.leases[i].revoked ) {
+				e.leases[i].revoked = true;
+				holders.push_back(e.leases[i].holder);
+			}
+		}
+		if ( e.leases.empty() && e.held.empty() ) {
+			bucket.keys.erase(it);
+		}
+	}
+
+	/**
+	 * True while a revoked lease on key is neither acknowledged nor expired
+	 */
+	bool revoking(size_t pos, const string &key, int now) const {
+		const Bucket &bucket = buckets[pos];
+		if ( bucket.keys.empty() ) {
+			return false;
+		}
+		map<string, Entry>::const_iterator it = bucket.keys.find(key);
+		return it != bucket.keys.end() && revoking(it->second, now);
+	}
+
+	/**
+	 * Keeps an encoded write reply to `to` until revoking(pos, key) is false
+	 */
+	void hold(size_t pos, const string &key, Address &to, const string &frame) {
+		Bucket &bucket = buckets[pos];
+		Entry &e = bucket.keys[key];
+		e.held.push_back(make_pair(to, frame));
+		bucket.held++;
+	}
+
+	/**
+	 * holder dropped its cached copy of key; appends the replies that no
+	 * longer wait for anything
+	 */
+	void acknowledge(size_t pos, const string &key, Address &holder, int now, vector<pair<Address, string> > &released) {
+		Bucket &bucket = buckets[pos];
+		map<string, Entry>::iterator it = bucket.keys.find(key);
+		if ( it == bucket.keys.end() ) {
+			return;
+		}
+		vector<Lease> &leases = it->second.leases;
+		for ( size_t i = 0; i < leases.size(); ) {
+			if ( leases[i].holder == holder && leases[i].revoked ) {
+				leases[i] = leases.back();
+				leases.pop_back();
+			}
+			else {
+				i++;
+			}
+		}
+		settle(bucket, it, now, released);
+	}
+
+	/**
+	 * Appends the held replies whose revoked leases have all expired by now
+	 */
+	void expire(int now, vector<pair<Address, string> > &released) {
+		for ( size_t pos = 0; pos < buckets.size(); pos++ ) {
+			Bucket &bucket = buckets[pos];
+			if ( bucket.held == 0 ) {
+				continue;
+			}
+			for ( map<string, Entry>::iterator it = bucket.keys.begin(); it != bucket.keys.end(); ) {
+				map<string, Entry>::iterator next = it;
+				++next;
+				if ( !it->second.held.empty() ) {
+					settle(bucket, it, now, released);
+				}
+				it = next;
+			}
+		}
+	}
+};
+
+#endif /* READCACHE_H_ */
@@ -0,0 +1,591 @@
+/**********************************
+ * FILE NAME: SegmentStorage.h
+ *
+ * DESCRIPTION: Storage engine of append-only memory-mapped segment files
+ * 				with an in-memory hash index, for stores larger than memory
+ **********************************/
+
+#ifndef SEGMENTSTORAGE_H_
+#define SEGMENTSTORAGE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "StorageEngine.h"
+#include "OpenHashStorage.h"
+
+#define SEGMENT_DEFAULT_BYTES	(64 << 20)
+// record header: flag byte, key length, value length
+#define SEGMENT_RECORD_HEADER	9
+// a sealed segment is compacted once less than this share of it is live
+#define SEGMENT_COMPACT_LIVE	0.5
+// record bytes compactStep copies per call
+#define SEGMENT_COMPACT_STEP	(1 << 20)
+
+/**
+ * CLASS NAME: SegmentStorage
+ *
+ * DESCRIPTION: Every create, update and delete appends a record
+ * 				[flag][key length][value length][key][value] to the active
+ * 				segment, a fixed-size file mapped shared into memory; a full
+ * 				segment is sealed and a new one started. The flag is PUT or
+ * 				TOMBSTONE, and a zero flag marks the unused end of a segment.
+ *
+ * 				The index is one flat array of 16-byte slots (full key hash,
+ * 				segment, offset) probed linearly, as in OpenHashStorage. Keys
+ * 				are compared against the record in the mapping, so neither
+ * 				keys nor values are kept on the heap and memory use is the
+ * 				index alone. forEach hands out views straight into the
+ * 				mappings; the kernel pages segments in and out as needed.
+ *
+ * 				Overwritten and deleted records become garbage. maintain()
+ * 				compacts a bounded number of bytes per call: it copies the
+ * 				live records of the sealed segment with the least live data
+ * 				to the active segment and removes the file once it is empty.
+ * 				Opening a directory that holds segments rebuilds the index by
+ * 				scanning them in order. Segments are limited to 4 GB.
+ */
+class SegmentStorage : public StorageEngine {
+private:
+	struct Slot {
+		// 0 marks an empty slot
+		unsigned long long hash;
+		unsigned int segment;
+		unsigned int offset;
+	};
+
+	struct Segment {
+		char *base;
+		size_t capacity;
+		size_t used;
+		// bytes of records the index still points to
+		size_t live;
+	};
+
+	enum RecordFlag {
+		RECORD_END = 0,
+		RECORD_PUT = 1,
+		RECORD_TOMBSTONE = 2
+	};
+
+	string dir;
+	size_t segmentBytes;
+	// by segment number; NULL once compacted away
+	vector<Segment *> segments;
+	unsigned int active;
+	vector<Slot> slots;
+	size_t mask;
+	size_t count_;
+	// segment being compacted and the next offset to copy, if any
+	unsigned int compacting;
+	size_t compactOffset;
+	size_t compactedSegments;
+	bool ok;
+
+	SegmentStorage(const SegmentStorage &);
+	SegmentStorage & operator=(const SegmentStorage &);
+
+	static unsigned long long hashOf(const char *key, size_t len) {
+		return keyHash(key, len);
+	}
+
+	static unsigned int get32(const char *in) {
+		const unsigned char *p = (const unsigned char *)in;
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+	}
+
+	static void put32(char *out, unsigned int v) {
+		for ( int i = 0; i < 4; i++ ) {
+			out[i] = (char)(v >> (8 * i));
+		}
+	}
+
+	string pathOf(unsigned int segment) const {
+		char name[32];
+		snprintf(name, sizeof(name), "/seg-%08u.dat", segment);
+		return dir + name;
+	}
+
+	const char * recordAt(const Slot &s) const {
+		return segments[s.segment]->base + s.offset;
+	}
+
+	static size_t recordSize(const char *rec) {
+		return SEGMENT_RECORD_HEADER + get32(rec + 1) + get32(rec + 5);
+	}
+
+	static StrRef keyOf(const char *rec) {
+		return StrRef(rec + SEGMENT_RECORD_HEADER, get32(rec + 1));
+	}
+
+	static StrRef valueOf(const char *rec) {
+		return StrRef(rec + SEGMENT_RECORD_HEADER + get32(rec + 1), get32(rec + 5));
+	}
+
+	static bool sameKey(StrRef a, const char *key, size_t len) {
+		return a.size() == len && memcmp(a.data, key, len) == 0;
+	}
+
+	/**
+	 * Maps segment number n, creating the file with capacity bytes if it does not exist
+	 */
+	Segment * mapSegment(unsigned int n, size_t capacity) {
+		int fd = ::open(pathOf(n).c_str(), O_RDWR | O_CREAT, 0644);
+		if ( fd < 0 ) {
+			return NULL;
+		}
+		struct stat st;
+		if ( ::fstat(fd, &st) != 0 || ((size_t)st.st_size < capacity && ::ftruncate(fd, capacity) != 0) ) {
+			::close(fd);
+			return NULL;
+		}
+		capacity = max(capacity, (size_t)st.st_size);
+		void *base = ::mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if ( base == MAP_FAILED ) {
+			return NULL;
+		}
+		Segment *seg = new Segment();
+		seg->base = (char *)base;
+		seg->capacity = capacity;
+		seg->used = 0;
+		seg->live = 0;
+		if ( segments.size() <= n ) {
+			segments.resize(n + 1, NULL);
+		}
+		segments[n] = seg;
+		return seg;
+	}
+
+	void unmapSegment(unsigned int n, bool removeFile) {
+		Segment *seg = segments[n];
+		::munmap(seg->base, seg->capacity);
+		delete seg;
+		segments[n] = NULL;
+		if ( removeFile ) {
+			::unlink(pathOf(n).c_str());
+		}
+	}
+
+	/**
+	 * Appends a record, starting a new segment if it does not fit; returns false on I/O failure
+	 */
+	bool append(RecordFlag flag, const char *key, size_t keyLen, const char *value, size_t valueLen,
+			unsigned int &segment, unsigned int &offset) {
+		size_t size = SEGMENT_RECORD_HEADER + keyLen + valueLen;
+		Segment *seg = segments[active];
+		// one spare byte keeps a RECORD_END after the last record
+		if ( seg->used + size + 1 > seg->capacity ) {
+			Segment *next = mapSegment(segments.size(), max(segmentBytes, size + 1));
+			if ( next == NULL ) {
+				return false;
+			}
+			active = segments.size() - 1;
+			seg = next;
+		}
+		char *rec = seg->base + seg->used;
+		put32(rec + 1, (unsigned int)keyLen);
+		put32(rec + 5, (unsigned int)valueLen);
+		memcpy(rec + SEGMENT_RECORD_HEADER, key, keyLen);
+		if ( valueLen > 0 ) {
+			memcpy(rec + SEGMENT_RECORD_HEADER + keyLen, value, valueLen);
+		}
+		// the flag goes last so a scan never sees a half-written record
+		rec[0] = (char)flag;
+		segment = active;
+		offset = (unsigned int)seg->used;
+		seg->used += size;
+		if ( flag == RECORD_PUT ) {
+			seg->live += size;
+		}
+		return true;
+	}
+
+	size_t probe(const char *key, size_t len, unsigned long long h, bool &found) const {
+		size_t i = h & mask;
+		while ( slots[i].hash != 0 ) {
+			if ( slots[i].hash == h && sameKey(keyOf(recordAt(slots[i])), key, len) ) {
+				found = true;
+				return i;
+			}
+			i = (i + 1) & mask;
+		}
+		found = false;
+		return i;
+	}
+
+	void rehash(size_t capacity) {
+		vector<Slot> old;
+		old.swap(slots);
+		Slot empty = { 0, 0, 0 };
+		slots.assign(capacity, empty);
+		mask = capacity - 1;
+		for ( size_t i = 0; i < old.size(); i++ ) {
+			if ( old[i].hash == 0 ) {
+				continue;
+			}
+			size_t j = old[i].hash & mask;
+			while ( slots[j].hash != 0 ) {
+				j = (j + 1) & mask;
+			}
+			slots[j] = old[i];
+		}
+	}
+
+	void growIfNeeded() {
+		if ( (count_ + 1) * 8 > slots.size() * STORAGE_MAX_LOAD_8THS ) {
+			rehash(slots.size() * 2);
+		}
+	}
+
+	void removeSlot(size_t i) {
+		size_t hole = i;
+		for ( size_t j = (i + 1) & mask; slots[j].hash != 0; j = (j + 1) & mask ) {
+			size_t home = slots[j].hash & mask;
+			if ( ((j - home) & mask) >= ((j - hole) & mask) ) {
+				slots[hole] = slots[j];
+				hole = j;
+			}
+		}
+		slots[hole].hash = 0;
+		count_--;
+	}
+
+	void release(const Slot &s) {
+		segments[s.segment]->live -= recordSize(recordAt(s));
+	}
+
+	/**
+	 * Points key at a newly appended PUT, or drops it for a TOMBSTONE
+	 */
+	void applyRecord(RecordFlag flag, const char *key, size_t len, unsigned int segment, unsigned int offset) {
+		unsigned long long h = hashOf(key, len);
+		growIfNeeded();
+		bool found;
+		size_t i = probe(key, len, h, found);
+		if ( found ) {
+			release(slots[i]);
+		}
+		if ( flag == RECORD_TOMBSTONE ) {
+			if ( found ) {
+				removeSlot(i);
+			}
+			return;
+		}
+		if ( !found ) {
+			count_++;
+		}
+		Slot s = { h, segment, offset };
+		slots[i] = s;
+	}
+
+	bool write(RecordFlag flag, const string &key, const string &value) {
+		unsigned int segment, offset;
+		if ( !append(flag, key.data(), key.size(), value.data(), value.size(), segment, offset) ) {
+			return false;
+		}
+		applyRecord(flag, key.data(), key.size(), segment, offset);
+		return true;
+	}
+
+	/**
+	 * Maps the segments already in dir and indexes their records in order
+	 */
+	void recover() {
+		vector<unsigned int> found;
+		DIR *d = ::opendir(dir.c_str());
+		if ( d != NULL ) {
+			struct dirent *e;
+			unsigned int n;
+			while ( (e = ::readdir(d)) != NULL ) {
+				if ( sscanf(e->d_name, "seg-%08u.dat", &n) == 1 ) {
+					found.push_back(n);
+				}
+			}
+			::closedir(d);
+		}
+		sort(found.begin(), found.end());
+		for ( size_t f = 0; f < found.size(); f++ ) {
+			Segment *seg = mapSegment(found[f], 0);
+			if ( seg == NULL ) {
+				continue;
+			}
+			active = found[f];
+			while ( seg->used + SEGMENT_RECORD_HEADER <= seg->capacity ) {
+				const char *rec = seg->base + seg->used;
+				RecordFlag flag = (RecordFlag)rec[0];
+				if ( (flag != RECORD_PUT && flag != RECORD_TOMBSTONE) || recordSize(rec) > seg->capacity - seg->used ) {
+					break;
+				}
+				size_t size = recordSize(rec);
+				if ( flag == RECORD_PUT ) {
+					seg->live += size;
+				}
+				StrRef key = keyOf(rec);
+				applyRecord(flag, key.data, key.size(), found[f], (unsigned int)seg->used);
+				seg->used += size;
+			}
+		}
+	}
+
+	/**
+	 * Sealed segment with the smallest live share below SEGMENT_COMPACT_LIVE, or active if none
+	 */
+	unsigned int pickVictim() const {
+		unsigned int victim = active;
+		double best = SEGMENT_COMPACT_LIVE;
+		for ( unsigned int n = 0; n < segments.size(); n++ ) {
+			Segment *seg = segments[n];
+			if ( seg == NULL || n == active || seg->used == 0 ) {
+				continue;
+			}
+			double share = (double)seg->live / seg->used;
+			if ( share < best ) {
+				best = share;
+				victim = n;
+			}
+		}
+		return victim;
+	}
+
+	bool isOldest(unsigned int n) const {
+		for ( unsigned int i = 0; i < n; i++ ) {
+			if ( segments[i] != NULL ) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+public:
+	/**
+	 * Opens (or creates) the store in directory dir, which must exist
+	 */
+	SegmentStorage(const string &dir, size_t segmentBytes = SEGMENT_DEFAULT_BYTES) :
+			dir(dir), segmentBytes(segmentBytes), active(0), mask(0), count_(0),
+			compacting(0), compactOffset(0), compactedSegments(0) {
+		rehash(STORAGE_MIN_CAPACITY);
+		recover();
+		ok = (!segments.empty() && segments[active] != NULL) || mapSegment(segments.size(), segmentBytes) != NULL;
+		if ( ok && segments[active] == NULL ) {
+			active = segments.size() - 1;
+		}
+		compacting = active;
+	}
+
+	~SegmentStorage() {
+		for ( unsigned int n = 0; n < segments.size(); n++ ) {
+			if ( segments[n] != NULL ) {
+				unmapSegment(n, false);
+			}
+		}
+	}
+
+	// false if the directory could not be used
+	bool isOpen() const {
+		return ok;
+	}
+
+	bool create(const string &key, const string &value) {
+		return write(RECORD_PUT, key, value);
+	}
+
+	string read(const string &key) {
+		StrRef value;
+		return readRef(key, value) ? value.str() : string();
+	}
+
+	/**
+	 * Points value into the mapping instead of copying it; valid until the next change
+	 */
+	bool readRef(const string &key, StrRef &value) const {
+		bool found;
+		size_t i = probe(key.data(), key.size(), hashOf(key.data(), key.size()), found);
+		if ( found ) {
+			value = valueOf(recordAt(slots[i]));
+		}
+		return found;
+	}
+
+	bool update(const string &key, const string &newValue) {
+		bool found;
+		probe(key.data(), key.size(), hashOf(key.data(), key.size()), found);
+		if ( !found ) {
+			return false;
+		}
+		return write(RECORD_PUT, key, newValue);
+	}
+
+	bool deleteKey(const string &key) {
+		bool found;
+		probe(key.data(), key.size(), hashOf(key.data(), key.size()), found);
+		if ( !found ) {
+			return false;
+		}
+		return write(RECORD_TOMBSTONE, key, string());
+	}
+
+	unsigned long count(const string &key) {
+		bool found;
+		probe(key.data(), key.size(), hashOf(key.data(), key.size()), found);
+		return found ? 1 : 0;
+	}
+
+	unsigned long currentSize() {
+		return count_;
+	}
+
+	/**
+	 * Empties the store and removes every segment file
+	 */
+	void clear() {
+		for ( unsigned int n = 0; n < segments.size(); n++ ) {
+			if ( segments[n] != NULL ) {
+				unmapSegment(n, true);
+			}
+		}
+		segments.clear();
+		count_ = 0;
+		slots.clear();
+		rehash(STORAGE_MIN_CAPACITY);
+		ok = mapSegment(0, segmentBytes) != NULL;
+		active = 0;
+		compacting = active;
+		compactOffset = 0;
+	}
+
+	void forEach(const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = 0; i < slots.size(); i++ ) {
+			if ( slots[i].hash != 0 ) {
+				const char *rec = recordAt(slots[i]);
+				fn(keyOf(rec), valueOf(rec));
+			}
+		}
+	}
+
+	/**
+	 * Copies up to budget bytes of live records out of the most wasteful
+	 * sealed segment; returns the bytes examined (0: nothing to compact)
+	 */
+	size_t compactStep(size_t budget = SEGMENT_COMPACT_STEP) {
+		if ( compacting == active || segments[compacting] == NULL ) {
+			compacting = pickVictim();
+			compactOffset = 0;
+			if ( compacting == active ) {
+				return 0;
+			}
+		}
+		Segment *seg = segments[compacting];
+		bool dropTombstones = isOldest(compacting);
+		size_t examined = 0;
+		while ( compactOffset < seg->used && examined < budget ) {
+			const char *rec = seg->base + compactOffset;
+			size_t size = recordSize(rec);
+			StrRef key = keyOf(rec);
+			unsigned int segment, offset;
+			if ( rec[0] == RECORD_PUT ) {
+				bool found;
+				size_t i = probe(key.data, key.size(), hashOf(key.data, key.size()), found);
+				if ( found && slots[i].segment == compacting && slots[i].offset == compactOffset ) {
+					StrRef value = valueOf(rec);
+					if ( !append(RECORD_PUT, key.data, key.size(), value.data, value.size(), segment, offset) ) {
+						return examined;
+					}
+					seg->live -= size;
+					slots[i].segment = segment;
+					slots[i].offset = offset;
+				}
+			}
+			else if ( !dropTombstones ) {
+				// an older segment may still hold a PUT this tombstone cancels
+				bool found;
+				probe(key.data, key.size(), hashOf(key.data, key.size()), found);
+				if ( !found && !append(RECORD_TOMBSTONE, key.data, key.size(), NULL, 0, segment, offset) ) {
+					return examined;
+				}
+			}
+			compactOffset += size;
+			examined += size;
+		}
+		if ( compactOffset >= seg->used ) {
+			unmapSegment(compacting, true);
+			compactedSegments++;
+			compacting = active;
+		}
+		return examined;
+	}
+
+	void maintain() {
+		compactStep();
+	}
+
+	/**
+	 * Writes the mapped segments back to their files
+	 */
+	void flush() {
+		for ( unsigned int n = 0; n < segments.size(); n++ ) {
+			if ( segments[n] != NULL ) {
+				::msync(segments[n]->base, segments[n]->used + 1, MS_SYNC);
+			}
+		}
+	}
+
+	void findByHash(unsigned long long hash, const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = hash & mask; slots[i].hash != 0; i = (i + 1) & mask ) {
+			if ( slots[i].hash == hash ) {
+				const char *rec = recordAt(slots[i]);
+				fn(keyOf(rec), valueOf(rec));
+			}
+		}
+	}
+
+	const char * name() const {
+		return "segment";
+	}
+
+	// heap bytes: the index only
+	size_t memoryUsage() const {
+		return slots.capacity() * sizeof(Slot) + segments.capacity() * sizeof(Segment *);
+	}
+
+	size_t segmentCount() const {
+		size_t n = 0;
+		for ( size_t i = 0; i < segments.size(); i++ ) {
+			n += segments[i] != NULL;
+		}
+		return n;
+	}
+
+	// bytes of records in the segment files, live or not
+	size_t diskUsage() const {
+		size_t bytes = 0;
+		for ( size_t i = 0; i < segments.size(); i++ ) {
+			if ( segments[i] != NULL ) {
+				bytes += segments[i]->used;
+			}
+		}
+		return bytes;
+	}
+
+	size_t liveBytes() const {
+		size_t bytes = 0;
+		for ( size_t i = 0; i < segments.size(); i++ ) {
+			if ( segments[i] != NULL ) {
+				bytes += segments[i]->live;
+			}
+		}
+		return bytes;
+	}
+
+	size_t getCompactedSegments() const {
+		return compactedSegments;
+	}
+};
+
+#endif /* SEGMENTSTORAGE_H_ */
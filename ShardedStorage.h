@@ -0,0 +1,119 @@
+/**********************************
+ * FILE NAME: ShardedStorage.h
+ *
+ * DESCRIPTION: Storage engine split into independent shards by ring position
+ **********************************/
+
+#ifndef SHARDEDSTORAGE_H_
+#define SHARDEDSTORAGE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "StorageEngine.h"
+#include "OpenHashStorage.h"
+
+/**
+ * CLASS NAME: ShardedStorage
+ *
+ * DESCRIPTION: One engine per shard, built by a StorageFactory (by default
+ * 				an OpenHashStorage); a key lives in shard (ring position % shards). Whole ring positions map to one
+ * 				shard, so a thread that owns a shard also owns the Merkle
+ * 				leaves and key index buckets of its keys. The shards share
+ * 				nothing, and different shards may be used from different
+ * 				threads at the same time. maintain() is passed on to every shard.
+ */
+class ShardedStorage : public StorageEngine {
+private:
+	vector<StorageEngine *> shards;
+
+	ShardedStorage(const ShardedStorage &);
+	ShardedStorage & operator=(const ShardedStorage &);
+
+public:
+	ShardedStorage(int count, const StorageFactory &factory = StorageFactory()) {
+		count = count < 1 ? 1 : count;
+		for ( int i = 0; i < count; i++ ) {
+			shards.push_back(factory ? factory(i, count) : new OpenHashStorage());
+		}
+	}
+
+	~ShardedStorage() {
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			delete shards[i];
+		}
+	}
+
+	static size_t shardOf(size_t ringPosition, size_t shardCount) {
+		return ringPosition % shardCount;
+	}
+
+	StorageEngine & shardFor(const string &key) {
+		std::hash<string> hashFunc;
+		return *shards[shardOf(hashFunc(key) % RING_SIZE, shards.size())];
+	}
+
+	size_t shardCount() const {
+		return shards.size();
+	}
+
+	bool create(const string &key, const string &value) {
+		return shardFor(key).create(key, value);
+	}
+
+	string read(const string &key) {
+		return shardFor(key).read(key);
+	}
+
+	bool update(const string &key, const string &newValue) {
+		return shardFor(key).update(key, newValue);
+	}
+
+	bool deleteKey(const string &key) {
+		return shardFor(key).deleteKey(key);
+	}
+
+	unsigned long count(const string &key) {
+		return shardFor(key).count(key);
+	}
+
+	unsigned long currentSize() {
+		unsigned long total = 0;
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			total += shards[i]->currentSize();
+		}
+		return total;
+	}
+
+	void clear() {
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			shards[i]->clear();
+		}
+	}
+
+	void forEach(const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			shards[i]->forEach(fn);
+		}
+	}
+
+	// the hash does not give the ring position, so every shard is asked
+	void findByHash(unsigned long long hash, const function<void(StrRef, StrRef)> &fn) {
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			shards[i]->findByHash(hash, fn);
+		}
+	}
+
+	const char * name() const {
+		return "sharded";
+	}
+
+	void maintain() {
+		for ( size_t i = 0; i < shards.size(); i++ ) {
+			shards[i]->maintain();
+		}
+	}
+};
+
+#endif /* SHARDEDSTORAGE_H_ */
@@ -0,0 +1,223 @@
+/**********************************
+ * FILE NAME: Snapshot.h
+ *
+ * DESCRIPTION: Compacted image of the local store, loaded through mmap
+ **********************************/
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <functional>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "StorageEngine.h"
+
+#define SNAPSHOT_MAGIC			"MP2SNAP1"
+#define SNAPSHOT_HEADER_BYTES	24
+// bytes written to the file at a time
+#define SNAPSHOT_WRITE_BUFFER	65536
+
+/**
+ * CLASS NAME: Snapshot
+ *
+ * DESCRIPTION: File layout, all integers little-endian:
+ * 				  header: magic (8), entry count (8), data offset (8)
+ * 				  index:  per entry key offset (8), key length (4), value length (4)
+ * 				  data:   each key followed by its stored value
+ * 				The index is a fixed-stride array, so a loader walks it in the
+ * 				mapped file and hands out views of the data without decoding
+ * 				anything record by record. A snapshot is written under a
+ * 				temporary name, synced, renamed into place and the directory
+ * 				synced, so a crash leaves either the old file or the new one.
+ */
+class Snapshot {
+private:
+	/**
+	 * Sequential writes through a fixed buffer; remembers the first error
+	 */
+	struct BufferedFile {
+		int fd;
+		bool ok;
+		size_t used;
+		char buf[SNAPSHOT_WRITE_BUFFER];
+
+		BufferedFile(int fd) : fd(fd), ok(true), used(0) {}
+
+		void put(const char *data, size_t size) {
+			if ( used + size > sizeof(buf) ) {
+				flush();
+				if ( size > sizeof(buf) ) {
+					ok = ok && writeAll(fd, data, size);
+					return;
+				}
+			}
+			memcpy(buf + used, data, size);
+			used += size;
+		}
+
+		bool flush() {
+			ok = ok && writeAll(fd, buf, used);
+			used = 0;
+			return ok;
+		}
+	};
+
+	static bool writeAll(int fd, const char *data, size_t size) {
+		while ( size > 0 ) {
+			ssize_t n = ::write(fd, data, size);
+			if ( n < 0 ) {
+				if ( errno == EINTR ) {
+					continue;
+				}
+				return false;
+			}
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	// makes a rename in the directory holding path durable
+	static bool syncDirectory(const string &path) {
+		size_t slash = path.rfind('/');
+		string dir = slash == string::npos ? string(".") : slash == 0 ? string("/") : path.substr(0, slash);
+		int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if ( fd < 0 ) {
+			return false;
+		}
+		bool ok = ::fsync(fd) == 0;
+		::close(fd);
+		return ok;
+	}
+
+	static void put64(char *out, unsigned long long v) {
+		for ( int i = 0; i < 8; i++ ) {
+			out[i] = (char)(v >> (8 * i));
+		}
+	}
+
+	static unsigned long long get64(const unsigned char *in) {
+		unsigned long long v = 0;
+		for ( int i = 0; i < 8; i++ ) {
+			v |= (unsigned long long)in[i] << (8 * i);
+		}
+		return v;
+	}
+
+	/**
+	 * Writes the index and then the data section of store to fd, one pass of
+	 * forEach each, and the header last; false on an I/O error or if the
+	 * store changed between the passes
+	 */
+	static bool writeTo(int fd, StorageEngine &store) {
+		BufferedFile out(fd);
+		if ( ::lseek(fd, SNAPSHOT_HEADER_BYTES, SEEK_SET) != SNAPSHOT_HEADER_BYTES ) {
+			return false;
+		}
+		unsigned long long count = 0, dataBytes = 0;
+		store.forEach([&](StrRef key, StrRef value) {
+			char entry[16];
+			put64(entry, dataBytes);
+			for ( int b = 0; b < 4; b++ ) {
+				entry[8 + b] = (char)(key.size() >> (8 * b));
+				entry[12 + b] = (char)(value.size() >> (8 * b));
+			}
+			out.put(entry, sizeof(entry));
+			count++;
+			dataBytes += key.size() + value.size();
+		});
+
+		unsigned long long written = 0, entries = 0;
+		store.forEach([&](StrRef key, StrRef value) {
+			out.put(key.data, key.size());
+			out.put(value.data, value.size());
+			entries++;
+			written += key.size() + value.size();
+		});
+		if ( !out.flush() || entries != count || written != dataBytes ) {
+			return false;
+		}
+
+		char head[SNAPSHOT_HEADER_BYTES];
+		memcpy(head, SNAPSHOT_MAGIC, 8);
+		put64(head + 8, count);
+		put64(head + 16, SNAPSHOT_HEADER_BYTES + count * 16);
+		return ::pwrite(fd, head, sizeof(head), 0) == (ssize_t)sizeof(head);
+	}
+
+public:
+	/**
+	 * Writes every pair of store to path, streaming it to the file rather than
+	 * building the image in memory; returns false (leaving any older snapshot
+	 * in place) on an I/O error. When it returns true the new file and its
+	 * name are both on disk.
+	 */
+	static bool write(const string &path, StorageEngine &store) {
+		string tmp = path + ".tmp";
+		int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if ( fd < 0 ) {
+			return false;
+		}
+		bool ok = writeTo(fd, store) && ::fsync(fd) == 0;
+		::close(fd);
+		if ( !ok || ::rename(tmp.c_str(), path.c_str()) != 0 ) {
+			::unlink(tmp.c_str());
+			return false;
+		}
+		return syncDirectory(path);
+	}
+
+	/**
+	 * Maps the snapshot at path and calls fn for each pair; the views point
+	 * into the mapping and are only valid during the call. Returns the number
+	 * of pairs, or 0 if there is no valid snapshot.
+	 */
+	static unsigned long load(const string &path, const function<void(StrRef, StrRef)> &fn) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if ( fd < 0 ) {
+			return 0;
+		}
+		struct stat st;
+		if ( ::fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEADER_BYTES ) {
+			::close(fd);
+			return 0;
+		}
+		size_t size = st.st_size;
+		void *map = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if ( map == MAP_FAILED ) {
+			return 0;
+		}
+		::madvise(map, size, MADV_SEQUENTIAL);
+
+		const unsigned char *base = (const unsigned char *)map;
+		unsigned long long count = get64(base + 8);
+		unsigned long long dataOff = get64(base + 16);
+		unsigned long loaded = 0;
+		if ( memcmp(base, SNAPSHOT_MAGIC, 8) == 0 && count <= size / 16 && dataOff == SNAPSHOT_HEADER_BYTES + count * 16 && dataOff <= size ) {
+			const unsigned char *entry = base + SNAPSHOT_HEADER_BYTES;
+			const char *data = (const char *)base + dataOff;
+			size_t dataLen = size - dataOff;
+			for ( ; loaded < count; loaded++, entry += 16 ) {
+				unsigned long long off = get64(entry);
+				unsigned int keyLen = entry[8] | (entry[9] << 8) | (entry[10] << 16) | ((unsigned int)entry[11] << 24);
+				unsigned int valueLen = entry[12] | (entry[13] << 8) | (entry[14] << 16) | ((unsigned int)entry[15] << 24);
+				if ( off > dataLen || dataLen - off < (unsigned long long)keyLen + valueLen ) {
+					break;
+				}
+				fn(StrRef(data + off, keyLen), StrRef(data + off + keyLen, valueLen));
+			}
+		}
+		::munmap(map, size);
+		return loaded;
+	}
+};
+
+#endif /* SNAPSHOT_H_ */
@@ -0,0 +1,145 @@
+/**********************************
+ * FILE NAME: StorageEngine.h
+ *
+ * DESCRIPTION: Interface of the local key-value store behind MP2Node, and an
+ * 				adapter for the framework's map-based HashTable
+ **********************************/
+
+#ifndef STORAGEENGINE_H_
+#define STORAGEENGINE_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <functional>
+#include "HashTable.h"
+#include "MessageCodec.h"
+
+/**
+ * CLASS NAME: StorageEngine
+ *
+ * DESCRIPTION: Point operations follow HashTable's conventions: read() returns
+ * 				the empty string for a missing key. create() of an existing
+ * 				key overwrites it and succeeds, since replication chunks and
+ * 				hint replays create keys a replica may already hold.
+ */
+class StorageEngine {
+public:
+	virtual ~StorageEngine() {}
+
+	virtual bool create(const string &key, const string &value) = 0;
+	virtual string read(const string &key) = 0;
+	virtual bool update(const string &key, const string &newValue) = 0;
+	virtual bool deleteKey(const string &key) = 0;
+	virtual unsigned long count(const string &key) = 0;
+	virtual unsigned long currentSize() = 0;
+	virtual void clear() = 0;
+
+	/**
+	 * Calls fn for every pair, in no particular order. The views are only
+	 * valid during the call and the store must not be modified from fn.
+	 */
+	virtual void forEach(const function<void(StrRef, StrRef)> &fn) = 0;
+
+	virtual const char * name() const = 0;
+
+	/**
+	 * Called once per tick for bounded background work (e.g. compaction)
+	 */
+	virtual void maintain() {}
+
+	/**
+	 * Calls fn for the pair whose key has keyHash() hash (for every such pair
+	 * if hashes collide), so callers may keep hashes instead of keys. Same
+	 * rules for the views as forEach. Engines indexed by keyHash() find it
+	 * directly; this fallback walks the whole store.
+	 */
+	virtual void findByHash(unsigned long long hash, const function<void(StrRef, StrRef)> &fn) {
+		forEach([&](StrRef key, StrRef value) {
+			if ( keyHash(key.data, key.size()) == hash ) {
+				fn(key, value);
+			}
+		});
+	}
+
+	/**
+	 * Hash engines index keys by: FNV-1a, so a key in a mapping hashes
+	 * without being copied. Never 0, which engines use for an empty slot.
+	 */
+	static unsigned long long keyHash(const char *key, size_t len) {
+		unsigned long long h = 14695981039346656037ULL;
+		for ( size_t i = 0; i < len; i++ ) {
+			h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+		}
+		return h == 0 ? 1 : h;
+	}
+
+	static unsigned long long keyHash(const string &key) {
+		return keyHash(key.data(), key.size());
+	}
+
+	bool isEmpty() {
+		return currentSize() == 0;
+	}
+};
+
+/**
+ * Builds the engine of one shard of a store split into shards (shards == 1:
+ * the whole store). Engines backed by files must give each shard its own.
+ */
+typedef function<StorageEngine *(int shard, int shards)> StorageFactory;
+
+/**
+ * CLASS NAME: MapStorage
+ *
+ * DESCRIPTION: The framework's HashTable (a std::map) behind the StorageEngine interface
+ */
+class MapStorage : public StorageEngine {
+private:
+	HashTable table;
+
+public:
+	bool create(const string &key, const string &value) {
+		if ( table.count(key) > 0 ) {
+			return table.update(key, value);
+		}
+		return table.create(key, value);
+	}
+
+	string read(const string &key) {
+		return table.read(key);
+	}
+
+	bool update(const string &key, const string &newValue) {
+		return table.update(key, newValue);
+	}
+
+	bool deleteKey(const string &key) {
+		return table.deleteKey(key);
+	}
+
+	unsigned long count(const string &key) {
+		return table.count(key);
+	}
+
+	unsigned long currentSize() {
+		return table.currentSize();
+	}
+
+	void clear() {
+		table.clear();
+	}
+
+	void forEach(const function<void(StrRef, StrRef)> &fn) {
+		for ( map<string, string>::iterator it = table.hashTable.begin(); it != table.hashTable.end(); ++it ) {
+			fn(StrRef(it->first), StrRef(it->second));
+		}
+	}
+
+	const char * name() const {
+		return "map";
+	}
+};
+
+#endif /* STORAGEENGINE_H_ */
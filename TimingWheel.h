@@ -0,0 +1,124 @@
+/**********************************
+ * FILE NAME: TimingWheel.h
+ *
+ * DESCRIPTION: Hierarchical timing wheel for transaction deadlines
+ **********************************/
+
+#ifndef TIMINGWHEEL_H_
+#define TIMINGWHEEL_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "TransID.h"
+
+#define WHEEL_LEVELS		4
+#define WHEEL_SLOT_BITS		6
+#define WHEEL_SLOTS			(1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK		(WHEEL_SLOTS - 1)
+
+/**
+ * CLASS NAME: TimingWheel
+ *
+ * DESCRIPTION: Four levels of 64 slots each, covering 64^4 ticks. Level 0
+ * 				holds timers due in the next 64 ticks at one-tick resolution,
+ * 				higher levels hold coarser ranges and cascade down as time
+ * 				advances. Advancing one tick touches only the timers that
+ * 				expire (or cascade) on that tick.
+ *
+ * 				Timers are never cancelled. The owner checks a fired ID
+ * 				against its own state and ignores IDs that have completed.
+ */
+class TimingWheel {
+private:
+	struct Timer {
+		TransID id;
+		long when;
+		Timer(TransID id, long when) : id(id), when(when) {}
+	};
+
+	vector<Timer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	// timers beyond the range of the top level
+	vector<Timer> overflow;
+	// timers scheduled at or before the current tick
+	vector<Timer> due;
+	// last tick processed
+	long now;
+	size_t count;
+
+	void place(const Timer &t) {
+		long delta = t.when - now;
+		if ( delta <= 0 ) {
+			due.push_back(t);
+			return;
+		}
+		for ( int level = 0; level < WHEEL_LEVELS; level++ ) {
+			if ( delta < (1L << (WHEEL_SLOT_BITS * (level + 1))) ) {
+				slots[level][(t.when >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK].push_back(t);
+				return;
+			}
+		}
+		overflow.push_back(t);
+	}
+
+	void cascade(vector<Timer> &bucket) {
+		vector<Timer> moving;
+		moving.swap(bucket);
+		for ( size_t i = 0; i < moving.size(); i++ ) {
+			place(moving[i]);
+		}
+	}
+
+	void drain(vector<Timer> &bucket, vector<TransID> &expired) {
+		for ( size_t i = 0; i < bucket.size(); i++ ) {
+			expired.push_back(bucket[i].id);
+		}
+		count -= bucket.size();
+		bucket.clear();
+	}
+
+public:
+	TimingWheel(long start = 0) : now(start), count(0) {}
+
+	/**
+	 * Fire id once the clock reaches tick when
+	 */
+	void schedule(TransID id, long when) {
+		count++;
+		place(Timer(id, when));
+	}
+
+	/**
+	 * Moves the clock forward to tick to and appends every timer that
+	 * became due to expired
+	 */
+	void advance(long to, vector<TransID> &expired) {
+		drain(due, expired);
+		while ( now < to ) {
+			now++;
+			// pull the next chunk of each coarser level down before firing level 0
+			for ( int level = 1; level < WHEEL_LEVELS; level++ ) {
+				if ( (now & ((1L << (WHEEL_SLOT_BITS * level)) - 1)) != 0 ) {
+					break;
+				}
+				cascade(slots[level][(now >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK]);
+				if ( level == WHEEL_LEVELS - 1 ) {
+					cascade(overflow);
+				}
+			}
+			drain(slots[0][now & WHEEL_SLOT_MASK], expired);
+			drain(due, expired);
+		}
+	}
+
+	long getTime() const {
+		return now;
+	}
+
+	size_t size() const {
+		return count;
+	}
+};
+
+#endif /* TIMINGWHEEL_H_ */
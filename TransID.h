@@ -0,0 +1,104 @@
+/**********************************
+ * FILE NAME: TransID.h
+ *
+ * DESCRIPTION: Transaction ID layout and per-node ID allocator
+ **********************************/
+
+#ifndef TRANSID_H_
+#define TRANSID_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include "Message.h"
+
+/**
+ * A transaction ID is 64 bits:
+ *
+ * 		| node ID (32) | 0 (1) | node tag (10) | op type (3) | sequence (18) |
+ *
+ * The low 32 bits are what travels in Message::transID and what is written
+ * to the log. They are never negative, and they carry a 10-bit tag of the
+ * coordinator's node ID (the ID itself for IDs below 1024, as the framework
+ * hands out), so two coordinators log different IDs for their operations.
+ * Replies always come back to the coordinator that issued the ID, so it
+ * rebuilds the full ID from its own node ID and the wire value.
+ *
+ * The sequence of each op type wraps after 2^18 IDs. An ID is only reused
+ * once its operation has long been decided: a coordinator would need 262144
+ * operations of one type in flight at once, for up to REPLY_TIMEOUT ticks.
+ */
+typedef unsigned long long TransID;
+
+#define TRANSID_SEQ_BITS	18
+#define TRANSID_OP_BITS		3
+#define TRANSID_NODE_BITS	10
+#define TRANSID_SEQ_MASK	((1ULL << TRANSID_SEQ_BITS) - 1)
+#define TRANSID_OP_MASK		((1ULL << TRANSID_OP_BITS) - 1)
+#define TRANSID_NODE_MASK	((1ULL << TRANSID_NODE_BITS) - 1)
+// op type of stabilization chunk IDs; above every MessageType a client operation has
+#define TRANSID_OP_REPLICATION	7
+
+// the node ID folded into TRANSID_NODE_BITS
+inline unsigned int transIDNodeTag(int nodeID) {
+	unsigned int id = (unsigned int)nodeID;
+	return (id ^ (id >> TRANSID_NODE_BITS) ^ (id >> (2 * TRANSID_NODE_BITS)) ^ (id >> (3 * TRANSID_NODE_BITS))) & TRANSID_NODE_MASK;
+}
+
+inline TransID makeTransID(int nodeID, MessageType op, unsigned long long seq) {
+	return ((TransID)(unsigned int)nodeID << 32)
+		| ((TransID)transIDNodeTag(nodeID) << (TRANSID_OP_BITS + TRANSID_SEQ_BITS))
+		| (((TransID)op & TRANSID_OP_MASK) << TRANSID_SEQ_BITS)
+		| (seq & TRANSID_SEQ_MASK);
+}
+
+inline MessageType transIDOp(TransID id) {
+	return (MessageType)((id >> TRANSID_SEQ_BITS) & TRANSID_OP_MASK);
+}
+
+inline int transIDNode(TransID id) {
+	return (int)(id >> 32);
+}
+
+// value carried in Message::transID and passed to Log
+inline int transIDWire(TransID id) {
+	return (int)(unsigned int)(id & 0xffffffffULL);
+}
+
+inline TransID transIDFromWire(int nodeID, int wire) {
+	return ((TransID)(unsigned int)nodeID << 32) | (TransID)(unsigned int)wire;
+}
+
+/**
+ * CLASS NAME: TransIDAllocator
+ *
+ * DESCRIPTION: Hands out monotonic, collision-free transaction IDs for one node.
+ * 				Every op type has its own sequence, which only wraps after
+ * 				2^18 IDs of that type, far beyond anything a coordinator
+ * 				keeps in flight.
+ */
+class TransIDAllocator {
+private:
+	int nodeID;
+	unsigned long long seq[1 << TRANSID_OP_BITS];
+
+public:
+	TransIDAllocator(int nodeID = 0) : nodeID(nodeID) {
+		memset(seq, 0, sizeof(seq));
+	}
+
+	void setNodeID(int id) {
+		nodeID = id;
+	}
+
+	int getNodeID() const {
+		return nodeID;
+	}
+
+	TransID next(MessageType op) {
+		return makeTransID(nodeID, op, seq[op & TRANSID_OP_MASK]++);
+	}
+};
+
+#endif /* TRANSID_H_ */
@@ -0,0 +1,125 @@
+/**********************************
+ * FILE NAME: Version.h
+ *
+ * DESCRIPTION: Value versions from a hybrid logical clock, and the stored
+ * 				form of a versioned value
+ **********************************/
+
+#ifndef VERSION_H_
+#define VERSION_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+
+// low bits of a stamp count events within one tick
+#define HLC_LOGICAL_BITS	20
+// bytes of a Version in front of a stored value and in multi-key items
+#define VERSION_BYTES		12
+
+/**
+ * STRUCT NAME: Version
+ *
+ * DESCRIPTION: Hybrid logical clock stamp of the write that produced a value,
+ * 				ordered by stamp and then by the writing node. A zero stamp
+ * 				means "no version".
+ */
+struct Version {
+	unsigned long long stamp;
+	unsigned int node;
+
+	Version() : stamp(0), node(0) {}
+	Version(unsigned long long stamp, unsigned int node) : stamp(stamp), node(node) {}
+
+	bool isNull() const {
+		return stamp == 0;
+	}
+
+	bool operator<(const Version &another) const {
+		return stamp < another.stamp || (stamp == another.stamp && node < another.node);
+	}
+
+	bool operator==(const Version &another) const {
+		return stamp == another.stamp && node == another.node;
+	}
+
+	void write(char *out) const {
+		for ( int i = 0; i < 8; i++ ) {
+			out[i] = (char)(stamp >> (8 * i));
+		}
+		for ( int i = 0; i < 4; i++ ) {
+			out[8 + i] = (char)(node >> (8 * i));
+		}
+	}
+
+	static Version read(const char *in) {
+		const unsigned char *p = (const unsigned char *)in;
+		Version v;
+		for ( int i = 0; i < 8; i++ ) {
+			v.stamp |= (unsigned long long)p[i] << (8 * i);
+		}
+		for ( int i = 0; i < 4; i++ ) {
+			v.node |= (unsigned int)p[8 + i] << (8 * i);
+		}
+		return v;
+	}
+};
+
+/**
+ * CLASS NAME: HybridClock
+ *
+ * DESCRIPTION: Stamps are (tick << HLC_LOGICAL_BITS) plus a logical counter.
+ * 				They never go backwards and move past any stamp observed from
+ * 				another node, so a write issued after seeing a version always
+ * 				gets a larger one, whatever the tick.
+ */
+class HybridClock {
+private:
+	unsigned long long last;
+
+public:
+	HybridClock() : last(0) {}
+
+	Version next(int tick, unsigned int node) {
+		unsigned long long physical = (unsigned long long)tick << HLC_LOGICAL_BITS;
+		last = max(last + 1, physical);
+		return Version(last, node);
+	}
+
+	void observe(const Version &v) {
+		last = max(last, v.stamp);
+	}
+};
+
+/**
+ * CLASS NAME: VersionedValue
+ *
+ * DESCRIPTION: A value as kept in the local store and in bulk transfers:
+ * 				VERSION_BYTES of version followed by the value bytes
+ */
+class VersionedValue {
+public:
+	static string pack(const Version &version, const string &value) {
+		string out(VERSION_BYTES, '\0');
+		version.write(&out[0]);
+		out.append(value);
+		return out;
+	}
+
+	/**
+	 * Splits a stored value; returns false (and a null version) if it is too short
+	 */
+	static bool unpack(const string &stored, Version &version, string &value) {
+		if ( stored.size() < VERSION_BYTES ) {
+			version = Version();
+			value.clear();
+			return false;
+		}
+		version = Version::read(stored.data());
+		value.assign(stored, VERSION_BYTES, string::npos);
+		return true;
+	}
+};
+
+#endif /* VERSION_H_ */
@@ -0,0 +1,95 @@
+/**********************************
+ * FILE NAME: WorkerPool.h
+ *
+ * DESCRIPTION: Fixed set of threads that run one function per tick in parallel
+ **********************************/
+
+#ifndef WORKERPOOL_H_
+#define WORKERPOOL_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * CLASS NAME: WorkerPool
+ *
+ * DESCRIPTION: run(fn) calls fn(0) .. fn(size() - 1) concurrently, worker 0
+ * 				being the calling thread, and returns when all have finished.
+ * 				The threads persist between calls. The lock only guards the
+ * 				start and end of a round, never the work itself.
+ */
+class WorkerPool {
+private:
+	vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable started;
+	std::condition_variable finished;
+	function<void(int)> task;
+	unsigned long round;
+	int remaining;
+	bool stopping;
+
+	WorkerPool(const WorkerPool &);
+	WorkerPool & operator=(const WorkerPool &);
+
+	void loop(int index) {
+		unsigned long seen = 0;
+		for ( ;; ) {
+			std::unique_lock<std::mutex> guard(lock);
+			started.wait(guard, [&] { return stopping || round != seen; });
+			if ( stopping ) {
+				return;
+			}
+			seen = round;
+			guard.unlock();
+			task(index);
+			guard.lock();
+			if ( --remaining == 0 ) {
+				finished.notify_one();
+			}
+		}
+	}
+
+public:
+	WorkerPool(int size) : round(0), remaining(0), stopping(false) {
+		for ( int i = 1; i < size; i++ ) {
+			threads.push_back(std::thread(&WorkerPool::loop, this, i));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		started.notify_all();
+		for ( size_t i = 0; i < threads.size(); i++ ) {
+			threads[i].join();
+		}
+	}
+
+	void run(const function<void(int)> &fn) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			task = fn;
+			remaining = (int)threads.size();
+			round++;
+		}
+		started.notify_all();
+		fn(0);
+		std::unique_lock<std::mutex> guard(lock);
+		finished.wait(guard, [&] { return remaining == 0; });
+	}
+
+	int size() const {
+		return (int)threads.size() + 1;
+	}
+};
+
+#endif /* WORKERPOOL_H_ */
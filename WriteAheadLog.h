@@ -0,0 +1,258 @@
+/**********************************
+ * FILE NAME: WriteAheadLog.h
+ *
+ * DESCRIPTION: Append-only log of local store changes, committed in groups
+ **********************************/
+
+#ifndef WRITEAHEADLOG_H_
+#define WRITEAHEADLOG_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+#include <functional>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "MessageCodec.h"
+
+// bytes in front of every record: payload length and checksum
+#define WAL_RECORD_HEADER	8
+
+/**
+ * Kind of a logged change
+ */
+enum WalRecordType {
+	WAL_PUT = 1,
+	WAL_DELETE = 2
+};
+
+/**
+ * CLASS NAME: WriteAheadLog
+ *
+ * DESCRIPTION: Records are [payload length][FNV-1a of payload][payload], the
+ * 				payload being the type byte, a varint key length, the key and
+ * 				(for WAL_PUT) the stored, versioned value. Appends only fill
+ * 				memory; commit() writes everything appended since the last
+ * 				commit with one write() and one fdatasync(), so a tick's
+ * 				writes share a single sync.
+ *
+ * 				Bytes a failed write() did not get into the file stay queued
+ * 				and go first on the next commit. A failed fdatasync() leaves
+ * 				the file's contents unknown, so it fails the log for good:
+ * 				every later commit returns false.
+ *
+ * 				Appends go to one buffer per shard of ring positions, so
+ * 				workers owning different shards may append concurrently.
+ * 				Records of one key always land in the same buffer and keep
+ * 				their order. A torn or corrupt tail (a crash mid-write) ends
+ * 				replay at the last whole record.
+ */
+class WriteAheadLog {
+private:
+	string path;
+	int fd;
+	bool sync;
+	vector<string> pending;
+	// appended bytes taken off pending but not in the file yet
+	string unwritten;
+	// an fdatasync failed; nothing may be trusted to be durable any more
+	bool failed;
+	unsigned long commits;
+	unsigned long long bytes;
+	// bytes in the file, i.e. written since the last reset
+	unsigned long long fileBytes;
+
+	WriteAheadLog(const WriteAheadLog &);
+	WriteAheadLog & operator=(const WriteAheadLog &);
+
+	static unsigned int checksum(const char *data, size_t size) {
+		unsigned int h = 2166136261u;
+		for ( size_t i = 0; i < size; i++ ) {
+			h = (h ^ (unsigned char)data[i]) * 16777619u;
+		}
+		return h;
+	}
+
+	static void put32(char *out, unsigned int v) {
+		for ( int i = 0; i < 4; i++ ) {
+			out[i] = (char)(v >> (8 * i));
+		}
+	}
+
+	static unsigned int get32(const unsigned char *in) {
+		return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+	}
+
+public:
+	WriteAheadLog(const string &path, bool sync = true) : path(path), sync(sync), pending(1), failed(false), commits(0), bytes(0), fileBytes(0) {
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if ( fd >= 0 ) {
+			off_t end = ::lseek(fd, 0, SEEK_END);
+			fileBytes = end > 0 ? end : 0;
+		}
+	}
+
+	~WriteAheadLog() {
+		commit();
+		if ( fd >= 0 ) {
+			::close(fd);
+		}
+	}
+
+	bool isOpen() const {
+		return fd >= 0;
+	}
+
+	/**
+	 * Number of append buffers; commits what is pending first
+	 */
+	void setShards(size_t shards) {
+		commit();
+		pending.assign(shards < 1 ? 1 : shards, string());
+	}
+
+	size_t shards() const {
+		return pending.size();
+	}
+
+	void append(size_t shard, WalRecordType type, const string &key, const string &stored = string()) {
+		string &out = pending[shard];
+		size_t base = out.size();
+		out.append(WAL_RECORD_HEADER, '\0');
+		out.push_back((char)type);
+		MessageCodec::putVarint(out, key.size());
+		out.append(key);
+		if ( type == WAL_PUT ) {
+			out.append(stored);
+		}
+		size_t payload = out.size() - base - WAL_RECORD_HEADER;
+		put32(&out[base], (unsigned int)payload);
+		put32(&out[base + 4], checksum(&out[base + WAL_RECORD_HEADER], payload));
+	}
+
+	/**
+	 * Makes every appended record durable; returns false if that failed, in
+	 * which case nothing appended since the last successful commit may be
+	 * taken as durable
+	 */
+	bool commit() {
+		for ( size_t i = 0; i < pending.size(); i++ ) {
+			if ( unwritten.empty() ) {
+				unwritten.swap(pending[i]);
+			}
+			else {
+				unwritten.append(pending[i]);
+				pending[i].clear();
+			}
+		}
+		if ( failed || fd < 0 ) {
+			return false;
+		}
+		if ( unwritten.empty() ) {
+			return true;
+		}
+		size_t done = 0;
+		while ( done < unwritten.size() ) {
+			ssize_t n = ::write(fd, unwritten.data() + done, unwritten.size() - done);
+			if ( n < 0 ) {
+				if ( errno == EINTR ) {
+					continue;
+				}
+				// O_APPEND: the rest follows what did get written
+				unwritten.erase(0, done);
+				return false;
+			}
+			done += n;
+			bytes += n;
+			fileBytes += n;
+		}
+		unwritten.clear();
+		if ( sync && ::fdatasync(fd) != 0 ) {
+			failed = true;
+			return false;
+		}
+		commits++;
+		return true;
+	}
+
+	/**
+	 * Empties the log once a snapshot covers everything in it; returns false,
+	 * leaving the log as it is, if the commit before or the truncation failed
+	 */
+	bool reset() {
+		if ( !commit() || ::ftruncate(fd, 0) != 0 ) {
+			return false;
+		}
+		fileBytes = 0;
+		if ( sync && ::fdatasync(fd) != 0 ) {
+			failed = true;
+			return false;
+		}
+		return true;
+	}
+
+	// an fdatasync failed and the log accepts no more commits
+	bool hasFailed() const {
+		return failed;
+	}
+
+	/**
+	 * Calls fn for every whole record of the log at path, in order; returns the
+	 * number of records read
+	 */
+	static unsigned long replay(const string &path, const function<void(WalRecordType, StrRef, StrRef)> &fn) {
+		int in = ::open(path.c_str(), O_RDONLY);
+		if ( in < 0 ) {
+			return 0;
+		}
+		string data;
+		char chunk[65536];
+		ssize_t n;
+		while ( (n = ::read(in, chunk, sizeof(chunk))) > 0 ) {
+			data.append(chunk, n);
+		}
+		::close(in);
+
+		unsigned long count = 0;
+		const unsigned char *p = (const unsigned char *)data.data();
+		const unsigned char *end = p + data.size();
+		while ( end - p >= WAL_RECORD_HEADER ) {
+			unsigned int payload = get32(p);
+			const unsigned char *body = p + WAL_RECORD_HEADER;
+			if ( payload < 2 || (size_t)(end - body) < payload || checksum((const char *)body, payload) != get32(p + 4) ) {
+				break;
+			}
+			const unsigned char *q = body + 1;
+			const unsigned char *stop = body + payload;
+			unsigned long long keyLen;
+			if ( !MessageCodec::getVarint(q, stop, keyLen) || (unsigned long long)(stop - q) < keyLen ) {
+				break;
+			}
+			WalRecordType type = (WalRecordType)body[0];
+			fn(type, StrRef((const char *)q, keyLen), StrRef((const char *)q + keyLen, stop - q - keyLen));
+			count++;
+			p = stop;
+		}
+		return count;
+	}
+
+	const string & getPath() const {
+		return path;
+	}
+
+	unsigned long getCommits() const {
+		return commits;
+	}
+
+	unsigned long long getBytes() const {
+		return bytes;
+	}
+
+	unsigned long long getFileBytes() const {
+		return fileBytes;
+	}
+};
+
+#endif /* WRITEAHEADLOG_H_ */
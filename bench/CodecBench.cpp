@@ -0,0 +1,103 @@
+/**********************************
+ * FILE NAME: CodecBench.cpp
+ *
+ * DESCRIPTION: Wire format benchmark: bytes on the wire and encode / decode
+ * 				cost per message type, Message::toString() text against the
+ * 				MessageCodec binary format
+ *
+ * BUILD (from the project root, with the framework sources):
+ * 		g++ -std=c++11 -O2 -I. bench/CodecBench.cpp Message.cpp Member.cpp -o codecbench
+ * RUN:
+ * 		./codecbench [key bytes] [value bytes] [iterations]
+ **********************************/
+
+#include "MessageCodec.h"
+#include <chrono>
+
+static double nsSince(chrono::steady_clock::time_point start, size_t ops) {
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / ops;
+}
+
+// Message::transID of an operation a coordinator started
+static int wireID(MessageType op) {
+	return transIDWire(makeTransID(0x0a000001, op, 12345));
+}
+
+/**
+ * Encodes msg both ways, checks that both decode to the same fields and
+ * prints sizes and per-message cost
+ */
+static void run(const char *name, Message &msg, const Version *version, size_t n) {
+	// the coordinator's full ID; both formats carry only its wire ID
+	TransID transID = transIDFromWire(0x0a000001, msg.transID);
+	size_t sink = 0;
+
+	string text;
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		text = msg.toString();
+		sink += text.size();
+	}
+	double textEncodeNs = nsSince(t, n);
+
+	string binary;
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		binary.clear();
+		MessageCodec::encode(binary, msg, transID, version);
+		sink += binary.size();
+	}
+	double binaryEncodeNs = nsSince(t, n);
+
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		Message decoded(text);
+		sink += decoded.key.size() + decoded.value.size();
+	}
+	double textDecodeNs = nsSince(t, n);
+
+	MessageView view;
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		MessageCodec::decode(binary.data(), (int)binary.size(), view);
+		sink += view.key.size() + view.value.size();
+	}
+	double binaryDecodeNs = nsSince(t, n);
+
+	MessageView fromText;
+	MessageCodec::decodeAny(text.data(), (int)text.size(), fromText);
+	bool same = MessageCodec::decodeAny(binary.data(), (int)binary.size(), view) && view.type == fromText.type
+			&& view.key == fromText.keyStore && view.value == fromText.valueStore && view.success == fromText.success
+			&& transIDWire(view.transID) == transIDWire(fromText.transID);
+
+	printf("%-10s text %4zu B  encode %6.1f  decode %6.1f ns    binary %4zu B  encode %6.1f  decode %6.1f ns  %s (%zu)\n",
+			name, text.size(), textEncodeNs, textDecodeNs, binary.size(), binaryEncodeNs, binaryDecodeNs,
+			same ? "same fields" : "MISMATCH", sink & 1);
+}
+
+int main(int argc, char *argv[]) {
+	size_t keyBytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+	size_t valueBytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+	size_t n = argc > 3 ? strtoul(argv[3], NULL, 10) : 300000;
+
+	Address from("10.0.0.1:0");
+	string key(keyBytes, 'k');
+	string value(valueBytes, 'v');
+	Version version(12345ULL << 20, 1);
+
+	printf("%zu-byte keys, %zu-byte values, %zu iterations\n", keyBytes, valueBytes, n);
+	Message create(wireID(CREATE), from, CREATE, key, value, PRIMARY);
+	run("CREATE", create, &version, n);
+	Message update(wireID(UPDATE), from, UPDATE, key, value);
+	run("UPDATE", update, &version, n);
+	Message read(wireID(READ), from, READ, key);
+	run("READ", read, NULL, n);
+	Message remove(wireID(DELETE), from, DELETE, key);
+	run("DELETE", remove, NULL, n);
+	Message reply(wireID(UPDATE), from, REPLY, true);
+	run("REPLY", reply, NULL, n);
+	Message readReply(wireID(READ), from, READREPLY, key, value);
+	run("READREPLY", readReply, &version, n);
+	return 0;
+}
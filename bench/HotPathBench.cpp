@@ -0,0 +1,394 @@
+/**********************************
+ * FILE NAME: HotPathBench.cpp
+ *
+ * DESCRIPTION: Microbenchmarks of MP2Node's per-message and per-tick paths,
+ * 				each on its own with realistic input sizes: key hashing,
+ * 				replica lookup and ring refresh on rings of 10 to 10,000
+ * 				nodes, message encode / decode, quorum bookkeeping for reads
+ * 				and writes, the timeout scan, full walks of the local store
+ * 				and of its ring position index, and the stabilization pass
+ * 				over the local store. Reports ns and heap allocations
+ * 				(operator new) per operation.
+ *
+ * BUILD (from the project root, with the framework sources):
+ * 		g++ -std=c++11 -O2 -pthread -I. bench/HotPathBench.cpp MP2Node.cpp EmulNet.cpp Log.cpp Params.cpp \
+ * 			Member.cpp Node.cpp Message.cpp HashTable.cpp -o hotpathbench
+ * RUN:
+ * 		./hotpathbench [filter]		only the benchmarks whose name contains filter
+ **********************************/
+
+#include "MP2Node.h"
+#include <chrono>
+#include <random>
+#include <new>
+
+static unsigned long long allocations = 0;
+
+void * operator new(size_t size) {
+	allocations++;
+	void *p = malloc(size == 0 ? 1 : size);
+	if ( p == NULL ) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+static const char *filter = NULL;
+
+/**
+ * Runs body, which performs ops operations, and prints its cost per operation
+ */
+template <typename F>
+static void report(const string &name, size_t ops, F body) {
+	if ( filter != NULL && name.find(filter) == string::npos ) {
+		return;
+	}
+	unsigned long long before = allocations;
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	body();
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - t;
+	printf("%-44s %10.1f ns/op %8.2f allocs/op\n", name.c_str(), elapsed.count() / ops,
+			(double)(allocations - before) / ops);
+}
+
+static Address addressOf(int id) {
+	Address addr;
+	short port = 0;
+	memcpy(&addr.addr[0], &id, sizeof(int));
+	memcpy(&addr.addr[4], &port, sizeof(short));
+	return addr;
+}
+
+static vector<MemberListEntry> membersOf(int count) {
+	vector<MemberListEntry> list;
+	for ( int id = 1; id <= count; id++ ) {
+		list.push_back(MemberListEntry(id, 0, 0, 0));
+	}
+	return list;
+}
+
+static vector<string> makeKeys(size_t count, size_t length, unsigned int seed) {
+	mt19937 rng(seed);
+	vector<string> keys;
+	for ( size_t i = 0; i < count; i++ ) {
+		string key(length, 'a');
+		for ( size_t c = 0; c < length; c++ ) {
+			key[c] = (char)('a' + rng() % 26);
+		}
+		keys.push_back(key);
+	}
+	return keys;
+}
+
+/**
+ * CLASS NAME: BenchNode
+ *
+ * DESCRIPTION: Node 1 of a ring of the given size. Its CRUD log events go to
+ * 				a binary trace on /dev/null, so the framework's dbg.log
+ * 				writes are not part of what is measured.
+ */
+class BenchNode {
+public:
+	MP2Node *node;
+
+	BenchNode(Params *par, EmulNet *net, Log *log, int ringSize, int tokensPerNode = 1) {
+		Address addr = addressOf(1);
+		Member *member = new Member();
+		member->addr = addr;
+		member->inited = true;
+		member->inGroup = true;
+		member->bFailed = false;
+		member->memberList = membersOf(ringSize);
+		node = new MP2Node(member, par, net, log, &addr);
+		node->setVirtualNodes(tokensPerNode);
+		node->setLogTrace("/dev/null", false);
+		node->updateRing();
+	}
+
+	~BenchNode() {
+		delete node;
+	}
+};
+
+static void benchHash(const vector<string> &shortKeys, const vector<string> &longKeys, MP2Node *node) {
+	size_t n = 1000000;
+	size_t sum = 0;
+	report("hashFunction, 10-byte keys", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			sum += node->hashFunction(shortKeys[i & 1023]);
+		}
+	});
+	report("hashFunction, 64-byte keys", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			sum += node->hashFunction(longKeys[i & 1023]);
+		}
+	});
+	if ( sum == 1 ) {
+		printf("\n");
+	}
+}
+
+static void benchRing(Params *par, EmulNet *net, Log *log, const vector<string> &keys) {
+	static const int sizes[] = { 10, 100, 1000, 10000 };
+	for ( int s = 0; s < 4; s++ ) {
+		BenchNode bench(par, net, log, sizes[s]);
+		size_t n = 1000000;
+		size_t sum = 0;
+		report("findNodes, ring of " + to_string(sizes[s]), n, [&]() {
+			for ( size_t i = 0; i < n; i++ ) {
+				sum += bench.node->findNodes(keys[i & 1023]).size();
+			}
+		});
+		// every tick starts with this, membership unchanged
+		size_t ticks = max(10, 100000 / sizes[s]);
+		report("updateRing unchanged, ring of " + to_string(sizes[s]), ticks, [&]() {
+			for ( size_t i = 0; i < ticks; i++ ) {
+				bench.node->updateRing();
+			}
+		});
+		if ( sum == 1 ) {
+			printf("\n");
+		}
+	}
+}
+
+static void benchCodec(const vector<string> &keys) {
+	size_t n = 1000000;
+	Address from = addressOf(1);
+	string value(100, 'v');
+	Version version(12345ULL << 20, 1);
+	Message create(17, from, CREATE, keys[0], value, PRIMARY);
+	Message reply(17, from, READREPLY, value);
+
+	string out;
+	report("encode CREATE, binary, 100-byte value", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			create.key = keys[i & 1023];
+			MessageCodec::encode(out, create, (TransID)i, &version);
+		}
+	});
+	MessageView view;
+	size_t sum = 0;
+	report("decode CREATE, binary", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			MessageCodec::decode(out.data(), (int)out.size(), view);
+			sum += view.key.size();
+		}
+	});
+	report("encode READREPLY, binary", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			MessageCodec::encode(out, reply, (TransID)i, &version);
+		}
+	});
+
+	size_t textOps = n / 10;
+	string text;
+	report("encode CREATE, Message::toString", textOps, [&]() {
+		for ( size_t i = 0; i < textOps; i++ ) {
+			create.key = keys[i & 1023];
+			text = create.toString();
+		}
+	});
+	report("decode CREATE, Message(string)", textOps, [&]() {
+		for ( size_t i = 0; i < textOps; i++ ) {
+			Message decoded(text);
+			sum += decoded.key.size();
+		}
+	});
+	if ( sum == 1 ) {
+		printf("\n");
+	}
+}
+
+static void benchQuorum(Params *par, EmulNet *net, Log *log, const vector<string> &keys) {
+	PendingOp op;
+	op.replicas.resize(3);
+	op.required = 2;
+	size_t n = 1000000;
+	int decided = 0;
+	BenchNode bench(par, net, log, 10);
+	MP2Node *node = bench.node;
+	report("checkCreateReply, 3 replies for W=2", n, [&]() {
+		for ( size_t i = 0; i < n; i++ ) {
+			op.acks = 0;
+			op.nacks = 0;
+			decided += node->checkCreateReply(op, true);
+			decided += node->checkCreateReply(op, i % 7 != 0);
+			decided += node->checkCreateReply(op, true);
+		}
+	});
+
+	// whole coordinator round trips, a tick's worth of operations at a time
+	TransIDAllocator ids(*(int *)node->getMemberNode()->addr.addr);
+	string value(100, 'v');
+	Version version(12345ULL << 20, 1);
+	size_t perTick = 1000;
+	size_t ops = 200000;
+	report("READ: track, 3 READREPLY, expiry", ops, [&]() {
+		for ( size_t i = 0; i < ops; i++ ) {
+			const string &key = keys[i & 1023];
+			ReplicaView replicas = node->findNodes(key);
+			TransID id = ids.next(READ);
+			node->trackOperation(id, READ, key, "", replicas, CONSISTENCY_QUORUM);
+			for ( size_t r = 0; r < replicas.size(); r++ ) {
+				node->handleReadReply(*replicas[r].getAddress(), transIDWire(id), StrRef(value), version, false, false);
+			}
+			if ( i % perTick == perTick - 1 ) {
+				par->globaltime++;
+				node->checkForFailedReply();
+			}
+		}
+	});
+	report("UPDATE: track, 3 REPLY, expiry", ops, [&]() {
+		for ( size_t i = 0; i < ops; i++ ) {
+			const string &key = keys[i & 1023];
+			ReplicaView replicas = node->findNodes(key);
+			TransID id = ids.next(UPDATE);
+			node->trackOperation(id, UPDATE, key, value, replicas, CONSISTENCY_QUORUM)->version = version;
+			for ( size_t r = 0; r < replicas.size(); r++ ) {
+				node->handleWriteReply(*replicas[r].getAddress(), transIDWire(id), true);
+			}
+			if ( i % perTick == perTick - 1 ) {
+				par->globaltime++;
+				node->checkForFailedReply();
+			}
+		}
+	});
+	// drain what is still waiting for its deadline
+	par->globaltime += REPLY_TIMEOUT + 1;
+	node->checkForFailedReply();
+	if ( decided == 1 ) {
+		printf("\n");
+	}
+}
+
+static void benchTimeouts(Params *par, EmulNet *net, Log *log, const vector<string> &keys) {
+	static const size_t pending[] = { 1000, 10000, 100000 };
+	for ( int s = 0; s < 3; s++ ) {
+		BenchNode bench(par, net, log, 10);
+		MP2Node *node = bench.node;
+		TransIDAllocator ids(*(int *)node->getMemberNode()->addr.addr);
+		for ( size_t i = 0; i < pending[s]; i++ ) {
+			const string &key = keys[i & 1023];
+			node->trackOperation(ids.next(READ), READ, key, "", node->findNodes(key), CONSISTENCY_QUORUM);
+		}
+		size_t ticks = REPLY_TIMEOUT;
+		report("checkForFailedReply, none due, " + to_string(pending[s]) + " pending", ticks, [&]() {
+			for ( size_t t = 0; t < ticks; t++ ) {
+				par->globaltime++;
+				node->checkForFailedReply();
+			}
+		});
+		report("checkForFailedReply, per expired op of " + to_string(pending[s]), pending[s], [&]() {
+			par->globaltime++;
+			node->checkForFailedReply();
+		});
+	}
+}
+
+/**
+ * The two ways MP2Node walks its keys: StorageEngine::forEach over the whole
+ * store, and the RangeIndex buckets of each ring position resolved with
+ * findByHash, as stabilization and anti-entropy do. The index walk only runs
+ * on the default engine; MapStorage's findByHash scans the whole store.
+ */
+static void benchScan(MP2Node *node) {
+	size_t stored = 100000;
+	vector<string> keys = makeKeys(stored, 10, 7);
+	string value(100, 'v');
+	OpenHashStorage hashed;
+	MapStorage mapped;
+	RangeIndex index;
+	for ( size_t i = 0; i < stored; i++ ) {
+		hashed.create(keys[i], value);
+		mapped.create(keys[i], value);
+		index.add(node->hashFunction(keys[i]), StorageEngine::keyHash(keys[i]));
+	}
+
+	size_t bytes = 0;
+	StorageEngine *engines[] = { &hashed, &mapped };
+	for ( int e = 0; e < 2; e++ ) {
+		report(string("forEach, per key, ") + engines[e]->name(), stored, [&]() {
+			engines[e]->forEach([&](StrRef key, StrRef value) {
+				bytes += key.size() + value.size();
+			});
+		});
+	}
+	report(string("RangeIndex walk, per key, ") + hashed.name(), stored, [&]() {
+		for ( size_t pos = 0; pos < index.positions(); pos++ ) {
+			const vector<unsigned long long> &hashes = index.hashesAt(pos);
+			for ( size_t k = 0; k < hashes.size(); k++ ) {
+				hashed.findByHash(hashes[k], [&](StrRef key, StrRef value) {
+					bytes += key.size() + value.size();
+				});
+			}
+		}
+	});
+	if ( bytes == 1 ) {
+		printf("\n");
+	}
+}
+
+static void benchStabilization(Params *par, EmulNet *net, Log *log) {
+	size_t stored = 100000;
+	vector<string> keys = makeKeys(stored, 10, 7);
+	string value(100, 'v');
+	static const int tokens[] = { 1, 8 };
+	for ( int v = 0; v < 2; v++ ) {
+		BenchNode bench(par, net, log, 10, tokens[v]);
+		MP2Node *node = bench.node;
+		for ( size_t i = 0; i < stored; i++ ) {
+			node->createKeyValue(keys[i], value, PRIMARY, 0);
+		}
+		// one node joins, then leaves again
+		vector<MemberListEntry> &members = node->getMemberNode()->memberList;
+		// 1 token: neighbor check and Merkle exchange start; more: replicateMovedKeys walks the key index
+		string name = "ring change, " + to_string(stored) + " keys, " + to_string(tokens[v]) + (tokens[v] == 1 ? " token" : " tokens");
+		report(name, 2, [&]() {
+			members.push_back(MemberListEntry(11, 0, 0, 0));
+			node->updateRing();
+			members.pop_back();
+			node->updateRing();
+		});
+	}
+}
+
+int main(int argc, char *argv[]) {
+	filter = argc > 1 ? argv[1] : NULL;
+
+	Params par;
+	par.EN_GPSZ = 1;
+	par.MAX_MSG_SIZE = 4000;
+	par.DROP_MSG = 0;
+	par.dropmsg = 0;
+	par.MSG_DROP_PROB = 0;
+	par.globaltime = 1;
+	par.PORTNUM = 0;
+	EmulNet net(&par);
+	Log log(&par);
+
+	vector<string> shortKeys = makeKeys(1024, 10, 1);
+	vector<string> longKeys = makeKeys(1024, 64, 2);
+	{
+		BenchNode bench(&par, &net, &log, 10);
+		benchHash(shortKeys, longKeys, bench.node);
+	}
+	benchRing(&par, &net, &log, shortKeys);
+	benchCodec(shortKeys);
+	benchQuorum(&par, &net, &log, shortKeys);
+	benchTimeouts(&par, &net, &log, shortKeys);
+	{
+		BenchNode bench(&par, &net, &log, 10);
+		benchScan(bench.node);
+	}
+	benchStabilization(&par, &net, &log);
+	return 0;
+}
@@ -0,0 +1,629 @@
+/**********************************
+ * FILE NAME: KVBench.cpp
+ *
+ * DESCRIPTION: Workload benchmark of the key-value store: a cluster of MP2Nodes
+ * 				on EmulNet runs a YCSB-style mix of reads, updates and inserts,
+ * 				with node failures and joins at set ticks. Reports throughput,
+ * 				latency percentiles in ticks, messages and bytes per operation
+ * 				and how long re-replication takes after each membership change.
+ * 				Runs are deterministic for a seed, so a change to the store is
+ * 				compared against a baseline run with the same arguments.
+ * 				With engine=segment and a dataset several times memlimit, it
+ * 				shows how much heap the store needs per key through MP2Node.
+ *
+ * BUILD (from the project root, with the framework sources; MP1Node is not
+ * used, the membership lists are set directly):
+ * 		g++ -std=c++11 -O2 -pthread -I. bench/KVBench.cpp MP2Node.cpp EmulNet.cpp Log.cpp Params.cpp \
+ * 			Member.cpp Node.cpp Message.cpp HashTable.cpp -o kvbench
+ * RUN:
+ * 		./kvbench [name=value ...]
+ * 			nodes=10		cluster size at the start
+ * 			records=1000	keys inserted before the measured run
+ * 			operations=10000 rate=50	operations in the run, started per tick
+ * 			read=0.5 update=0.5 insert=0	operation mix (normalized)
+ * 			valuesize=100
+ * 			distribution=uniform|zipfian|latest theta=0.99
+ * 			events=fail@100:3,fail@150,join@300	ticks into the run; fail without
+ * 							a node index picks a live node at random
+ * 			detect=0		ticks before a failed node leaves the membership lists
+ * 			drop=0			EmulNet message drop probability during the run
+ * 			replicas=3 vnodes=1 threads=1 asynclog=0
+ * 			engine=open-hash|segment dir=/tmp/kvbench	segment: SegmentStorage files per
+ * 							node and shard under dir
+ * 			memlimit=0		MB; reports the process heap and replicated data against it
+ * 			seed=1 json=path	also append the results to path as one JSON line
+ **********************************/
+
+#include "MP2Node.h"
+#include "SegmentStorage.h"
+#include <chrono>
+#include <random>
+
+// ticks a recovery is waited for before it is reported as incomplete
+#define BENCH_RECOVERY_LIMIT	1000
+
+static map<string, string> options;
+
+static double option(const string &name, double fallback) {
+	map<string, string>::iterator it = options.find(name);
+	return it == options.end() ? fallback : atof(it->second.c_str());
+}
+
+static string option(const string &name, const string &fallback) {
+	map<string, string>::iterator it = options.find(name);
+	return it == options.end() ? fallback : it->second;
+}
+
+static unsigned long long fnv64(unsigned long long v) {
+	unsigned long long h = 1469598103934665603ULL;
+	for ( int i = 0; i < 8; i++ ) {
+		h = (h ^ ((v >> (8 * i)) & 0xff)) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static string keyOf(size_t i) {
+	return "user" + to_string(i);
+}
+
+// anonymous (heap) resident memory of this process, from /proc
+static size_t rssAnonBytes() {
+	FILE *f = fopen("/proc/self/status", "r");
+	if ( f == NULL ) {
+		return 0;
+	}
+	char line[256];
+	size_t kb = 0;
+	while ( fgets(line, sizeof(line), f) != NULL ) {
+		if ( sscanf(line, "RssAnon: %zu kB", &kb) == 1 ) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb * 1024;
+}
+
+/**
+ * CLASS NAME: ZipfianGenerator
+ *
+ * DESCRIPTION: Zipfian ranks in [0, n) by the method of Gray et al., as YCSB
+ * 				draws them: rank 0 is the most popular. The item count may
+ * 				grow as keys are inserted; the zeta sum is extended, not redone.
+ */
+class ZipfianGenerator {
+private:
+	double theta;
+	double zetan;
+	double zeta2;
+	double alpha;
+	double eta;
+	size_t n;
+
+public:
+	ZipfianGenerator(double theta) : theta(theta), zetan(0), zeta2(1 + pow(0.5, theta)), alpha(1 / (1 - theta)), eta(0), n(0) {}
+
+	void grow(size_t items) {
+		if ( items <= n ) {
+			return;
+		}
+		while ( n < items ) {
+			n++;
+			zetan += 1 / pow((double)n, theta);
+		}
+		eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+	}
+
+	size_t next(mt19937_64 &rng) {
+		if ( n < 2 ) {
+			return 0;
+		}
+		double u = uniform_real_distribution<double>(0, 1)(rng);
+		double uz = u * zetan;
+		if ( uz < 1 ) {
+			return 0;
+		}
+		if ( uz < zeta2 ) {
+			return 1;
+		}
+		return min(n - 1, (size_t)(n * pow(eta * u - eta + 1, alpha)));
+	}
+};
+
+/**
+ * STRUCT NAME: BenchEvent
+ *
+ * DESCRIPTION: A membership change at a tick of the run; node -1 on a failure
+ * 				picks a live node when it happens. Measured: ticks until every
+ * 				key is on all its replicas again.
+ */
+struct BenchEvent {
+	int tick;
+	bool join;
+	int node;
+	bool open;
+	int recoveryTicks;		// -1: not within BENCH_RECOVERY_LIMIT
+};
+
+/**
+ * CLASS NAME: BenchCluster
+ *
+ * DESCRIPTION: The nodes and the framework objects they share. Stands in for
+ * 				Application and MP1Node: the membership lists are rewritten
+ * 				when a node joins or a failure is detected, and the nodes run
+ * 				in order each tick as Application::mp2Run runs them. A failed
+ * 				node keeps its object (and metrics) but drops what it receives.
+ */
+class BenchCluster {
+public:
+	Params *par;
+	EmulNet *net;
+	Log *log;
+	// the membership lines MP1Node would log
+	LogBuffer membershipLog;
+	vector<MP2Node *> nodes;
+	vector<char> failed;
+	vector<char> listed;
+	// listed as each node's membership list last had it
+	vector<vector<char> > known;
+	map<string, int> indexOf;
+
+	BenchCluster(Params *par, EmulNet *net, Log *log) : par(par), net(net), log(log), membershipLog(log, par) {}
+
+	~BenchCluster() {
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			delete nodes[i];
+		}
+	}
+
+	static int discard(void *, char *buff, int) {
+		free(buff);
+		return 0;
+	}
+
+	int addNode() {
+		Address addr;
+		net->ENinit(&addr, par->PORTNUM);
+		Member *member = new Member();
+		member->addr = addr;
+		member->inited = true;
+		member->inGroup = true;
+		member->bFailed = false;
+		MP2Node *node = new MP2Node(member, par, net, log, &addr);
+		node->setReplicationFactor((int)option("replicas", 3));
+		node->setVirtualNodes((int)option("vnodes", 1));
+		if ( option("engine", "open-hash") == "segment" ) {
+			string dir = option("dir", "/tmp/kvbench") + "/node" + to_string(nodes.size());
+			node->setStorageFactory([dir](int shard, int shards) -> StorageEngine * {
+				string path = dir + "-" + to_string(shard) + "of" + to_string(shards);
+				::mkdir(path.c_str(), 0755);
+				SegmentStorage *store = new SegmentStorage(path);
+				store->clear();		// left over from an earlier run
+				return store;
+			});
+		}
+		node->setWorkerThreads((int)option("threads", 1));
+		indexOf[addr.getAddress()] = nodes.size();
+		nodes.push_back(node);
+		failed.push_back(false);
+		listed.push_back(true);
+		known.push_back(vector<char>());
+		par->EN_GPSZ = nodes.size();
+		refreshMembership();
+		return nodes.size() - 1;
+	}
+
+	void fail(int i) {
+		failed[i] = true;
+		nodes[i]->getMemberNode()->bFailed = true;
+	}
+
+	// what failure detection would leave in every live node's list
+	void refreshMembership() {
+		vector<MemberListEntry> list;
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			if ( listed[i] ) {
+				Address &addr = nodes[i]->getMemberNode()->addr;
+				list.push_back(MemberListEntry(*(int *)addr.addr, *(short *)&addr.addr[4], 0, par->getcurrtime()));
+			}
+		}
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			if ( failed[i] ) {
+				continue;
+			}
+			Member *member = nodes[i]->getMemberNode();
+			for ( size_t j = 0; j < nodes.size(); j++ ) {
+				bool wasListed = j < known[i].size() && known[i][j];
+				if ( listed[j] && !wasListed ) {
+					membershipLog.logNodeAdd(&member->addr, &nodes[j]->getMemberNode()->addr);
+				}
+				else if ( !listed[j] && wasListed ) {
+					membershipLog.logNodeRemove(&member->addr, &nodes[j]->getMemberNode()->addr);
+				}
+			}
+			known[i] = listed;
+			member->memberList = list;
+		}
+	}
+
+	void tick() {
+		par->globaltime++;
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			if ( failed[i] ) {
+				net->ENrecv(&nodes[i]->getMemberNode()->addr, discard, NULL, 1, NULL);
+				continue;
+			}
+			nodes[i]->updateRing();
+			nodes[i]->recvLoop();
+			nodes[i]->checkMessages();
+		}
+	}
+
+	int randomLive(mt19937_64 &rng) {
+		vector<int> live;
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			if ( !failed[i] ) {
+				live.push_back(i);
+			}
+		}
+		return live.empty() ? -1 : live[rng() % live.size()];
+	}
+
+	/**
+	 * Keys held by some live node that miss a copy on one of their current
+	 * replicas (as the first live node's ring places them)
+	 */
+	size_t underReplicated(size_t keys) {
+		int ringOwner = -1;
+		for ( size_t i = 0; i < nodes.size() && ringOwner < 0; i++ ) {
+			if ( !failed[i] ) {
+				ringOwner = i;
+			}
+		}
+		size_t missing = 0;
+		string value;
+		Version version;
+		for ( size_t k = 0; k < keys; k++ ) {
+			string key = keyOf(k);
+			bool held = false;
+			for ( size_t i = 0; i < nodes.size() && !held; i++ ) {
+				held = !failed[i] && nodes[i]->readVersioned(key, value, version);
+			}
+			if ( !held ) {
+				continue;
+			}
+			ReplicaView replicas = nodes[ringOwner]->findNodes(key);
+			for ( size_t r = 0; r < replicas.size(); r++ ) {
+				map<string, int>::iterator it = indexOf.find(replicas[r].getAddress()->getAddress());
+				if ( it == indexOf.end() || failed[it->second] || !nodes[it->second]->readVersioned(key, value, version) ) {
+					missing++;
+					break;
+				}
+			}
+		}
+		return missing;
+	}
+
+	MetricsShard operations() {
+		MetricsShard total;
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			MetricsShard node = nodes[i]->getMetrics().merged();
+			for ( int op = 0; op < METRICS_OPS; op++ ) {
+				total.ops[op].add(node.ops[op]);
+			}
+		}
+		return total;
+	}
+
+	void traffic(int type, unsigned long &messages, unsigned long long &bytes) {
+		messages = 0;
+		bytes = 0;
+		for ( size_t i = 0; i < nodes.size(); i++ ) {
+			messages += nodes[i]->getMetrics().getSentMessages(type);
+			bytes += nodes[i]->getMetrics().getSentBytes(type);
+		}
+	}
+
+	unsigned long decided() {
+		unsigned long total = 0;
+		MetricsShard ops = operations();
+		for ( int op = 0; op < METRICS_OPS; op++ ) {
+			total += ops.ops[op].outcomes[METRIC_SUCCEEDED] + ops.ops[op].outcomes[METRIC_FAILED] + ops.ops[op].outcomes[METRIC_TIMED_OUT];
+		}
+		return total;
+	}
+};
+
+static vector<BenchEvent> parseEvents(const string &spec) {
+	vector<BenchEvent> events;
+	stringstream in(spec);
+	string item;
+	while ( getline(in, item, ',') ) {
+		BenchEvent e = { 0, false, -1, false, -1 };
+		size_t at = item.find('@');
+		if ( at == string::npos ) {
+			continue;
+		}
+		e.join = item.compare(0, at, "join") == 0;
+		e.tick = atoi(item.c_str() + at + 1);
+		size_t colon = item.find(':', at);
+		if ( colon != string::npos ) {
+			e.node = atoi(item.c_str() + colon + 1);
+		}
+		events.push_back(e);
+	}
+	sort(events.begin(), events.end(), [](const BenchEvent &a, const BenchEvent &b) {
+		return a.tick < b.tick;
+	});
+	return events;
+}
+
+int main(int argc, char *argv[]) {
+	for ( int i = 1; i < argc; i++ ) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		if ( eq == string::npos ) {
+			fprintf(stderr, "usage: %s [name=value ...] (see bench/KVBench.cpp)\n", argv[0]);
+			return 1;
+		}
+		options[arg.substr(0, eq)] = arg.substr(eq + 1);
+	}
+	int nodeCount = (int)option("nodes", 10);
+	size_t records = (size_t)option("records", 1000);
+	size_t operations = (size_t)option("operations", 10000);
+	int rate = max(1, (int)option("rate", 50));
+	double readShare = option("read", 0.5);
+	double updateShare = option("update", 0.5);
+	double insertShare = option("insert", 0.0);
+	double shares = readShare + updateShare + insertShare;
+	size_t valueSize = (size_t)option("valuesize", 100);
+	string distribution = option("distribution", "uniform");
+	int detect = (int)option("detect", 0);
+	vector<BenchEvent> events = parseEvents(option("events", ""));
+	mt19937_64 rng((unsigned long long)option("seed", 1));
+	srand((unsigned int)option("seed", 1));
+	if ( shares <= 0 || (distribution != "uniform" && distribution != "zipfian" && distribution != "latest") ) {
+		fprintf(stderr, "bad operation mix or distribution\n");
+		return 1;
+	}
+	string engine = option("engine", "open-hash");
+	if ( engine != "open-hash" && engine != "segment" ) {
+		fprintf(stderr, "unknown engine %s\n", engine.c_str());
+		return 1;
+	}
+	if ( engine == "segment" && ::mkdir(option("dir", "/tmp/kvbench").c_str(), 0755) != 0 && errno != EEXIST ) {
+		perror(option("dir", "/tmp/kvbench").c_str());
+		return 1;
+	}
+	size_t baseHeap = rssAnonBytes();
+
+	Params par;
+	par.EN_GPSZ = nodeCount;
+	par.MAX_MSG_SIZE = 4000;
+	par.DROP_MSG = 0;
+	par.dropmsg = 0;
+	par.MSG_DROP_PROB = 0;
+	par.globaltime = 0;
+	par.PORTNUM = 0;
+	par.allNodesJoined = 1;
+	EmulNet net(&par);
+	// asynclog=1: the writer thread owns the process's Log and writes every line
+	Log directLog(&par);
+	std::shared_ptr<AsyncLog> logWriter;
+	if ( option("asynclog", 0) != 0 ) {
+		logWriter = AsyncLog::shared(&par);
+	}
+	BenchCluster cluster(&par, &net, logWriter ? logWriter->getLog() : &directLog);
+	for ( int i = 0; i < nodeCount; i++ ) {
+		cluster.addNode();
+	}
+	for ( int t = 0; t < 3; t++ ) {
+		cluster.tick();
+	}
+
+	// load phase: every record once, at the run rate; then let the writes settle
+	vector<string> values;
+	for ( int c = 0; c < 26; c++ ) {
+		values.push_back(string(valueSize, (char)('a' + c)));
+	}
+	for ( size_t k = 0; k < records; ) {
+		for ( int i = 0; i < rate && k < records; i++, k++ ) {
+			cluster.nodes[cluster.randomLive(rng)]->clientCreate(keyOf(k), values[k % 26]);
+		}
+		cluster.tick();
+	}
+	for ( int t = 0; t < REPLY_TIMEOUT + 5; t++ ) {
+		cluster.tick();
+	}
+	for ( size_t i = 0; i < cluster.nodes.size(); i++ ) {
+		cluster.nodes[i]->resetMetrics();
+	}
+	if ( option("drop", 0) > 0 ) {
+		par.DROP_MSG = 1;
+		par.dropmsg = 1;
+		par.MSG_DROP_PROB = option("drop", 0);
+	}
+
+	// run phase
+	ZipfianGenerator zipf(option("theta", 0.99));
+	size_t keys = records;
+	// reads and updates draw from the keys whose insert has been decided, as YCSB does
+	size_t acknowledged = records;
+	deque<pair<int, size_t> > inserted;		// (tick, keys) as inserts were started
+	zipf.grow(keys);
+	size_t issued = 0;
+	size_t nextEvent = 0;
+	vector<pair<int, int> > removals;			// (tick, node) a failure is detected
+	vector<BenchEvent> recoveries;
+	size_t openRecoveries = 0;
+	unsigned long lastDecided = 0;
+	int lastDecisionTick = 0;
+	int start = par.getcurrtime();
+	double checkSeconds = 0;
+	chrono::steady_clock::time_point wallStart = chrono::steady_clock::now();
+	for ( int tick = 0; ; tick++ ) {
+		for ( ; nextEvent < events.size() && events[nextEvent].tick == tick; nextEvent++ ) {
+			BenchEvent &e = events[nextEvent];
+			if ( e.join ) {
+				e.node = cluster.addNode();
+			}
+			else {
+				if ( e.node < 0 || e.node >= (int)cluster.nodes.size() || cluster.failed[e.node] ) {
+					e.node = cluster.randomLive(rng);
+				}
+				cluster.fail(e.node);
+				removals.push_back(make_pair(tick + detect, e.node));
+			}
+			e.open = true;
+			recoveries.push_back(e);
+			openRecoveries++;
+		}
+		for ( size_t i = 0; i < removals.size(); i++ ) {
+			if ( removals[i].first == tick ) {
+				cluster.listed[removals[i].second] = false;
+				cluster.refreshMembership();
+			}
+		}
+
+		for ( ; !inserted.empty() && inserted.front().first + REPLY_TIMEOUT < tick; inserted.pop_front() ) {
+			acknowledged = inserted.front().second;
+			zipf.grow(acknowledged);
+		}
+		for ( int i = 0; i < rate && issued < operations; i++, issued++ ) {
+			int coordinator = cluster.randomLive(rng);
+			double pick = uniform_real_distribution<double>(0, shares)(rng);
+			if ( pick >= readShare + updateShare || acknowledged == 0 ) {
+				cluster.nodes[coordinator]->clientCreate(keyOf(keys), values[issued % 26]);
+				inserted.push_back(make_pair(tick, ++keys));
+				continue;
+			}
+			size_t k;
+			if ( distribution == "uniform" ) {
+				k = rng() % acknowledged;
+			}
+			else if ( distribution == "zipfian" ) {
+				k = fnv64(zipf.next(rng)) % acknowledged;		// popular keys spread over the key space
+			}
+			else {
+				k = acknowledged - 1 - zipf.next(rng);		// the newest keys are the popular ones
+			}
+			if ( pick < readShare ) {
+				cluster.nodes[coordinator]->clientRead(keyOf(k));
+			}
+			else {
+				cluster.nodes[coordinator]->clientUpdate(keyOf(k), values[issued % 26]);
+			}
+		}
+		cluster.tick();
+
+		unsigned long decided = cluster.decided();
+		if ( decided != lastDecided ) {
+			lastDecided = decided;
+			lastDecisionTick = tick + 1;
+		}
+		if ( openRecoveries > 0 ) {
+			chrono::steady_clock::time_point t = chrono::steady_clock::now();
+			bool replicated = cluster.underReplicated(keys) == 0;
+			checkSeconds += chrono::duration<double>(chrono::steady_clock::now() - t).count();
+			for ( size_t i = 0; i < recoveries.size(); i++ ) {
+				BenchEvent &e = recoveries[i];
+				if ( e.open && (replicated || tick + 1 - e.tick >= BENCH_RECOVERY_LIMIT) ) {
+					e.recoveryTicks = replicated ? tick + 1 - e.tick : -1;
+					e.open = false;
+					openRecoveries--;
+				}
+			}
+		}
+		bool quiet = tick + 1 - lastDecisionTick > REPLY_TIMEOUT + 2;
+		if ( issued == operations && nextEvent == events.size() && openRecoveries == 0 && quiet ) {
+			break;
+		}
+	}
+	double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count() - checkSeconds;
+	int runTicks = par.getcurrtime() - start;
+
+	// results
+	static const char *opNames[METRICS_OPS] = { "insert", "read", "update", "delete" };
+	MetricsShard ops = cluster.operations();
+	HdrHistogram all;
+	unsigned long succeeded = 0;
+	for ( int op = 0; op < METRICS_OPS; op++ ) {
+		all.add(ops.ops[op].latency);
+		succeeded += ops.ops[op].outcomes[METRIC_SUCCEEDED];
+	}
+	unsigned long messages = 0, stabilizationMessages = 0;
+	unsigned long long bytes = 0, stabilizationBytes = 0;
+	for ( int type = 0; type < METRICS_MESSAGE_TYPES; type++ ) {
+		unsigned long m;
+		unsigned long long b;
+		cluster.traffic(type, m, b);
+		messages += m;
+		bytes += b;
+		if ( type == REPLICATE_BATCH || type == REPLICATE_BATCH_ACK || type == REPLICATE_REPAIR
+				|| type == MERKLE_DIGEST || type == MERKLE_PULL ) {
+			stabilizationMessages += m;
+			stabilizationBytes += b;
+		}
+	}
+	double perOp = lastDecided == 0 ? 0 : 1.0 / lastDecided;
+
+	printf("workload  %zu nodes, %zu records, %zu operations at %d/tick, read %.2f update %.2f insert %.2f, %zu-byte values, %s\n",
+			(size_t)nodeCount, records, operations, rate, readShare / shares, updateShare / shares, insertShare / shares,
+			valueSize, distribution.c_str());
+	printf("run       %d ticks, %lu decided (%lu succeeded), %.1f ops/tick, %.0f ops/s simulated\n",
+			runTicks, lastDecided, succeeded, lastDecisionTick == 0 ? 0 : (double)lastDecided / lastDecisionTick,
+			wallSeconds > 0 ? lastDecided / wallSeconds : 0);
+	printf("latency   p50 %lld p99 %lld p999 %lld max %d ticks\n", all.percentile(0.5), all.percentile(0.99), all.percentile(0.999), all.getMax());
+	for ( int op = 0; op < 3; op++ ) {
+		OpMetrics &m = ops.ops[op];
+		if ( m.started > 0 ) {
+			printf("  %-7s %8lu started %8lu ok %6lu failed %6lu timed out  p50 %lld p99 %lld p999 %lld\n", opNames[op], m.started,
+					m.outcomes[METRIC_SUCCEEDED], m.outcomes[METRIC_FAILED], m.outcomes[METRIC_TIMED_OUT],
+					m.latency.percentile(0.5), m.latency.percentile(0.99), m.latency.percentile(0.999));
+		}
+	}
+	printf("traffic   %.2f messages %.0f bytes per operation; stabilization %lu messages %llu bytes\n",
+			messages * perOp, bytes * perOp, stabilizationMessages, stabilizationBytes);
+	// every live key on every replica, as the store keeps it: key, version and value
+	double data = (double)keys * (keyOf(keys).size() + valueSize + 12) * option("replicas", 3) / 1048576.0;
+	double heap = (rssAnonBytes() - min(baseHeap, rssAnonBytes())) / 1048576.0;
+	printf("memory    %s engine: heap %.1f MB for %.1f MB of replicated data", engine.c_str(), heap, data);
+	if ( option("memlimit", 0) > 0 ) {
+		printf(", %.1fx a %.0f MB limit; heap %s it", data / option("memlimit", 0), option("memlimit", 0),
+				heap <= option("memlimit", 0) ? "within" : "over");
+	}
+	printf("\n");
+	for ( size_t i = 0; i < recoveries.size(); i++ ) {
+		BenchEvent &e = recoveries[i];
+		if ( e.recoveryTicks >= 0 ) {
+			printf("recovery  %s of node %d at tick %d: fully replicated after %d ticks\n",
+					e.join ? "join" : "failure", e.node, e.tick, e.recoveryTicks);
+		}
+		else {
+			printf("recovery  %s of node %d at tick %d: not fully replicated within %d ticks\n",
+					e.join ? "join" : "failure", e.node, e.tick, BENCH_RECOVERY_LIMIT);
+		}
+	}
+
+	string jsonPath = option("json", "");
+	if ( !jsonPath.empty() ) {
+		FILE *out = fopen(jsonPath.c_str(), "a");
+		if ( out == NULL ) {
+			perror(jsonPath.c_str());
+			return 1;
+		}
+		fprintf(out, "{\"nodes\":%d,\"records\":%zu,\"operations\":%zu,\"rate\":%d,\"distribution\":\"%s\",\"ticks\":%d,"
+				"\"decided\":%lu,\"succeeded\":%lu,\"opsPerTick\":%.3f,\"opsPerSecond\":%.0f,"
+				"\"p50\":%lld,\"p99\":%lld,\"p999\":%lld,\"max\":%d,\"messagesPerOp\":%.3f,\"bytesPerOp\":%.1f,"
+				"\"stabilizationMessages\":%lu,\"stabilizationBytes\":%llu,\"recoveryTicks\":[",
+				nodeCount, records, operations, rate, distribution.c_str(), runTicks, lastDecided, succeeded,
+				lastDecisionTick == 0 ? 0 : (double)lastDecided / lastDecisionTick, wallSeconds > 0 ? lastDecided / wallSeconds : 0,
+				all.percentile(0.5), all.percentile(0.99), all.percentile(0.999), all.getMax(), messages * perOp, bytes * perOp,
+				stabilizationMessages, stabilizationBytes);
+		for ( size_t i = 0; i < recoveries.size(); i++ ) {
+			fprintf(out, "%s%d", i == 0 ? "" : ",", recoveries[i].recoveryTicks);
+		}
+		fprintf(out, "]}\n");
+		fclose(out);
+	}
+	return 0;
+}
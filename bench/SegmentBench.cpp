@@ -0,0 +1,135 @@
+/**********************************
+ * FILE NAME: SegmentBench.cpp
+ *
+ * DESCRIPTION: Benchmark of SegmentStorage with a dataset five times a memory
+ * 				limit: load, random reads, overwrites and deletes, compaction
+ * 				and reopening, with the heap the engine uses alongside. The same
+ * 				through MP2Node: bench/KVBench.cpp engine=segment memlimit=...
+ *
+ * BUILD (from the project root, with the framework sources):
+ * 		g++ -std=c++11 -O2 -I. bench/SegmentBench.cpp HashTable.cpp -o segmentbench
+ * RUN:
+ * 		./segmentbench [memory limit MB] [value bytes] [directory]
+ **********************************/
+
+#include "SegmentStorage.h"
+#include <chrono>
+#include <random>
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+// anonymous (heap) resident memory of this process, from /proc
+static size_t rssAnonBytes() {
+	FILE *f = fopen("/proc/self/status", "r");
+	if ( f == NULL ) {
+		return 0;
+	}
+	char line[256];
+	size_t kb = 0;
+	while ( fgets(line, sizeof(line), f) != NULL ) {
+		if ( sscanf(line, "RssAnon: %zu kB", &kb) == 1 ) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb * 1024;
+}
+
+static string keyOf(size_t i) {
+	return "key" + to_string(i);
+}
+
+int main(int argc, char *argv[]) {
+	size_t limitMB = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	size_t valueBytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+	string dir = argc > 3 ? argv[3] : "/tmp/segmentbench";
+
+	size_t limit = limitMB << 20;
+	size_t n = 5 * limit / (valueBytes + 16);
+	// several segments per limit, so compaction has sealed segments to work on
+	size_t segmentBytes = min((size_t)SEGMENT_DEFAULT_BYTES, limit / 4);
+	if ( ::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST ) {
+		perror(dir.c_str());
+		return 1;
+	}
+
+	size_t baseHeap = rssAnonBytes();
+	printf("memory limit %zu MB, dataset %zu keys x %zu bytes = %.0f MB (%.1fx the limit)\n",
+			limitMB, n, valueBytes, n * (valueBytes + 16) / 1048576.0, (double)n * (valueBytes + 16) / limit);
+
+	mt19937 rng(42);
+	{
+		SegmentStorage store(dir, segmentBytes);
+		store.clear();
+		string value(valueBytes, 'v');
+
+		chrono::steady_clock::time_point t = chrono::steady_clock::now();
+		for ( size_t i = 0; i < n; i++ ) {
+			value[i % valueBytes] = (char)('a' + i % 26);
+			store.create(keyOf(i), value);
+		}
+		double s = secondsSince(t);
+		printf("load     %8.0f ops/s  %7.1f MB/s  index %.1f MB, process heap %.1f MB\n",
+				n / s, n * valueBytes / s / 1048576.0, store.memoryUsage() / 1048576.0, (rssAnonBytes() - baseHeap) / 1048576.0);
+
+		size_t reads = min(n, (size_t)1000000);
+		size_t hits = 0;
+		t = chrono::steady_clock::now();
+		for ( size_t i = 0; i < reads; i++ ) {
+			StrRef v;
+			hits += store.readRef(keyOf(rng() % n), v) && v.size() == valueBytes;
+		}
+		s = secondsSince(t);
+		printf("read     %8.0f ops/s  (%zu of %zu found, values not copied)\n", reads / s, hits, reads);
+
+		// overwrite 40% and delete 20% of the keys, leaving sealed segments mostly garbage
+		string newValue(valueBytes, 'u');
+		t = chrono::steady_clock::now();
+		for ( size_t i = 0; i < n; i++ ) {
+			if ( i % 5 < 2 ) {
+				store.update(keyOf(i), newValue);
+			}
+			else if ( i % 5 == 2 ) {
+				store.deleteKey(keyOf(i));
+			}
+		}
+		s = secondsSince(t);
+		printf("write    %8.0f ops/s  disk %.0f MB for %.0f MB live in %zu segments\n",
+				n * 3 / 5 / s, store.diskUsage() / 1048576.0, store.liveBytes() / 1048576.0, store.segmentCount());
+
+		t = chrono::steady_clock::now();
+		size_t steps = 0;
+		while ( store.compactStep() > 0 ) {
+			steps++;
+		}
+		s = secondsSince(t);
+		printf("compact  %8.2f s in %zu steps of %d bytes, %zu segments removed: disk %.0f MB in %zu segments\n",
+				s, steps, SEGMENT_COMPACT_STEP, store.getCompactedSegments(), store.diskUsage() / 1048576.0, store.segmentCount());
+
+		size_t bytes = 0;
+		t = chrono::steady_clock::now();
+		store.forEach([&bytes](StrRef k, StrRef v) {
+			bytes += k.size() + v.size();
+		});
+		s = secondsSince(t);
+		printf("iterate  %8.0f keys/s  %zu keys, %.0f MB\n", store.currentSize() / s, (size_t)store.currentSize(), bytes / 1048576.0);
+		store.flush();
+	}
+
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	SegmentStorage reopened(dir, segmentBytes);
+	double s = secondsSince(t);
+	size_t bad = 0;
+	for ( size_t i = 0; i < n; i += 97 ) {
+		string v = reopened.read(keyOf(i));
+		bool want = i % 5 != 2;
+		bad += want != !v.empty() || (i % 5 < 2 && v != string(valueBytes, 'u'));
+	}
+	printf("reopen   %8.2f s  %zu keys indexed, %zu sampled keys wrong, index %.1f MB\n",
+			s, (size_t)reopened.currentSize(), bad, reopened.memoryUsage() / 1048576.0);
+	reopened.clear();
+	return 0;
+}
@@ -0,0 +1,93 @@
+/**********************************
+ * FILE NAME: StorageBench.cpp
+ *
+ * DESCRIPTION: Microbenchmark of the storage engines behind MP2Node::ht:
+ * 				point operations and full iteration at 1M+ keys
+ *
+ * BUILD (from the project root, with the framework sources):
+ * 		g++ -std=c++11 -O2 -I. bench/StorageBench.cpp HashTable.cpp -o storagebench
+ * RUN:
+ * 		./storagebench [keys] [value bytes]
+ **********************************/
+
+#include "StorageEngine.h"
+#include "OpenHashStorage.h"
+#include <chrono>
+#include <random>
+
+static double nsSince(chrono::steady_clock::time_point start, size_t ops) {
+	chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / ops;
+}
+
+static void run(StorageEngine &store, const vector<string> &keys, const vector<string> &order,
+		const string &value, const string &newValue) {
+	size_t n = keys.size();
+	size_t hits = 0;
+
+	chrono::steady_clock::time_point t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		store.create(keys[i], value);
+	}
+	double createNs = nsSince(t, n);
+
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		hits += store.read(order[i]).size() == value.size();
+	}
+	double readNs = nsSince(t, n);
+
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		hits += store.read(order[i] + "~").empty();
+	}
+	double missNs = nsSince(t, n);
+
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		store.update(order[i], newValue);
+	}
+	double updateNs = nsSince(t, n);
+
+	size_t bytes = 0;
+	t = chrono::steady_clock::now();
+	store.forEach([&bytes](StrRef k, StrRef v) {
+		bytes += k.size() + v.size();
+	});
+	double scanNs = nsSince(t, n);
+
+	t = chrono::steady_clock::now();
+	for ( size_t i = 0; i < n; i++ ) {
+		store.deleteKey(order[i]);
+	}
+	double deleteNs = nsSince(t, n);
+
+	printf("%-10s create %7.1f  read %7.1f  miss %7.1f  update %7.1f  iterate %6.1f  delete %7.1f ns/op  (%zu checks, %zu bytes)\n",
+			store.name(), createNs, readNs, missNs, updateNs, scanNs, deleteNs, hits, bytes);
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t valueBytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+
+	vector<string> keys;
+	keys.reserve(n);
+	for ( size_t i = 0; i < n; i++ ) {
+		keys.push_back("key" + to_string(i));
+	}
+	vector<string> order(keys);
+	shuffle(order.begin(), order.end(), mt19937(42));
+	string value(valueBytes, 'v');
+	string newValue(valueBytes, 'u');
+
+	printf("%zu keys, %zu-byte values\n", n, valueBytes);
+	{
+		MapStorage store;
+		run(store, keys, order, value, newValue);
+	}
+	{
+		OpenHashStorage store;
+		run(store, keys, order, value, newValue);
+	}
+	return 0;
+}
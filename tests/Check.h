@@ -0,0 +1,41 @@
+/**********************************
+ * FILE NAME: Check.h
+ *
+ * DESCRIPTION: Assertion macros shared by the unit tests. A failed check
+ * 				prints its location and the test carries on; main() returns
+ * 				checkResult() so make check stops at the first failing test.
+ **********************************/
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+/**
+ * Header files
+ */
+#include "stdincludes.h"
+
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if ( !(cond) ) { \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			checkFailures++; \
+		} \
+	} while ( 0 )
+
+#define CHECK_EQ(a, b) \
+	do { \
+		long long checkA = (long long)(a), checkB = (long long)(b); \
+		if ( checkA != checkB ) { \
+			fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, checkA, checkB); \
+			checkFailures++; \
+		} \
+	} while ( 0 )
+
+static int checkResult(const char *test) {
+	printf("%s: %s\n", test, checkFailures == 0 ? "ok" : "FAILED");
+	return checkFailures == 0 ? 0 : 1;
+}
+
+#endif /* CHECK_H_ */
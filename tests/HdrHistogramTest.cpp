@@ -0,0 +1,103 @@
+/**********************************
+ * FILE NAME: HdrHistogramTest.cpp
+ *
+ * DESCRIPTION: Histogram percentiles against the exact order statistics:
+ * 				exact for small values, within the sub-bucket error above
+ **********************************/
+
+#include "Metrics.h"
+#include "Check.h"
+
+/**
+ * The sample percentile(p) stands for: the one at rank floor(p * n)
+ */
+static long long exactPercentile(vector<int> sorted, double p) {
+	size_t rank = (size_t)(p * sorted.size());
+	return sorted[min(rank, sorted.size() - 1)];
+}
+
+static void checkPercentiles(const HdrHistogram &h, vector<int> samples) {
+	sort(samples.begin(), samples.end());
+	double ps[] = { 0, 0.1, 0.5, 0.9, 0.99, 0.999, 1 };
+	for ( size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++ ) {
+		long long exact = exactPercentile(samples, ps[i]);
+		long long got = h.percentile(ps[i]);
+		// never below the true value, at most one sub-bucket above it
+		CHECK(got >= exact);
+		CHECK(exact < (1 << METRICS_SUB_BITS) ? got == exact : got - exact <= exact >> (METRICS_SUB_BITS - 1));
+		CHECK(got <= h.getMax());
+	}
+}
+
+static void testEmptyAndSmall() {
+	HdrHistogram h;
+	CHECK_EQ(h.percentile(0.5), -1);
+	CHECK_EQ(h.count(), 0);
+	vector<int> samples;
+	for ( int v = 0; v < 32; v++ ) {
+		for ( int k = 0; k <= v; k++ ) {
+			h.record(v);
+			samples.push_back(v);
+		}
+	}
+	checkPercentiles(h, samples);
+	CHECK_EQ(h.getMax(), 31);
+	CHECK_EQ(h.percentile(1), 31);
+}
+
+static void testWideRange() {
+	HdrHistogram h;
+	vector<int> samples;
+	unsigned int x = 12345;
+	long long sum = 0;
+	for ( int i = 0; i < 100000; i++ ) {
+		x = x * 1103515245 + 12345;
+		// spread over many powers of two
+		int v = (int)((x >> 8) % 1000000) >> ((x >> 4) % 16);
+		h.record(v);
+		samples.push_back(v);
+		sum += v;
+	}
+	checkPercentiles(h, samples);
+	CHECK_EQ(h.count(), samples.size());
+	CHECK(fabs(h.mean() - (double)sum / samples.size()) < 1e-6);
+	CHECK_EQ(h.getMax(), *max_element(samples.begin(), samples.end()));
+
+	// merging two halves gives the histogram of the whole
+	HdrHistogram a, b;
+	for ( size_t i = 0; i < samples.size(); i++ ) {
+		(i % 2 ? a : b).record(samples[i]);
+	}
+	a.add(b);
+	CHECK_EQ(a.count(), h.count());
+	CHECK_EQ(a.percentile(0.99), h.percentile(0.99));
+	CHECK_EQ(a.getMax(), h.getMax());
+
+	h.reset();
+	CHECK_EQ(h.count(), 0);
+	CHECK_EQ(h.percentile(0.99), -1);
+}
+
+static void testLargeValues() {
+	HdrHistogram h;
+	vector<int> samples;
+	for ( int shift = 0; shift < 31; shift++ ) {
+		int v = (1 << shift) + (1 << shift) / 3;
+		if ( v < 0 ) {
+			continue;
+		}
+		h.record(v);
+		samples.push_back(v);
+	}
+	h.record(2147483647);
+	samples.push_back(2147483647);
+	checkPercentiles(h, samples);
+	CHECK_EQ(h.percentile(1), 2147483647);
+}
+
+int main() {
+	testEmptyAndSmall();
+	testWideRange();
+	testLargeValues();
+	return checkResult("HdrHistogramTest");
+}
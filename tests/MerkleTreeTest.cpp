@@ -0,0 +1,149 @@
+/**********************************
+ * FILE NAME: MerkleTreeTest.cpp
+ *
+ * DESCRIPTION: A top-down comparison of two trees finds exactly the leaves
+ * 				that differ, with and without a mask, and the digest codec
+ **********************************/
+
+#include "MerkleTree.h"
+#include "Check.h"
+
+/**
+ * Descends from the root into children whose (masked) hashes differ
+ */
+static void diff(const MerkleTree &a, const MerkleTree &b, const vector<char> *mask, int level, size_t index,
+		set<size_t> &leaves) {
+	unsigned long long ha = mask ? a.maskedHash(level, index, *mask) : a.hash(level, index);
+	unsigned long long hb = mask ? b.maskedHash(level, index, *mask) : b.hash(level, index);
+	if ( ha == hb ) {
+		return;
+	}
+	if ( level == a.getDepth() ) {
+		leaves.insert(index);
+		return;
+	}
+	for ( size_t c = index * MERKLE_FANOUT; c < (index + 1) * MERKLE_FANOUT; c++ ) {
+		diff(a, b, mask, level + 1, c, leaves);
+	}
+}
+
+static void fill(MerkleTree &tree) {
+	for ( int i = 0; i < 2000; i++ ) {
+		tree.add(i % RING_SIZE, "key" + to_string(i), "value" + to_string(i));
+	}
+}
+
+static void testDiff() {
+	MerkleTree a, b;
+	CHECK_EQ(a.leafCount(), RING_SIZE);
+	CHECK_EQ(a.width(0), 1);
+	fill(a);
+	fill(b);
+	CHECK(a.hash(0, 0) == b.hash(0, 0));
+
+	set<size_t> expected;
+	// a changed value, an extra key, a missing key
+	b.remove(5, "key5", "value5");
+	b.add(5, "key5", "other");
+	expected.insert(5);
+	b.add(300, "extra", "x");
+	expected.insert(300);
+	b.remove(511, "key511", "value511");
+	expected.insert(511);
+
+	set<size_t> found;
+	diff(a, b, NULL, 0, 0, found);
+	CHECK(found == expected);
+
+	// undoing the changes restores the root
+	b.remove(5, "key5", "other");
+	b.add(5, "key5", "value5");
+	b.remove(300, "extra", "x");
+	b.add(511, "key511", "value511");
+	CHECK(a.hash(0, 0) == b.hash(0, 0));
+}
+
+static void testMaskedDiff() {
+	MerkleTree a, b;
+	fill(a);
+	fill(b);
+	b.add(10, "only-b", "x");
+	b.add(200, "only-b", "y");
+	b.add(400, "only-b", "z");
+
+	// a shared range that covers 10 and 400 but not 200
+	vector<char> mask(RING_SIZE, 0);
+	for ( size_t pos = 0; pos < RING_SIZE; pos++ ) {
+		mask[pos] = (pos < 100 || pos >= 350) ? 1 : 0;
+	}
+	set<size_t> found;
+	diff(a, b, &mask, 0, 0, found);
+	set<size_t> expected;
+	expected.insert(10);
+	expected.insert(400);
+	CHECK(found == expected);
+
+	// leaves outside the mask count for nothing
+	CHECK(a.overlaps(0, 0, mask));
+	vector<char> none(RING_SIZE, 0);
+	CHECK(!a.overlaps(0, 0, none));
+	CHECK_EQ(a.maskedHash(0, 0, none), 0);
+	vector<char> all(RING_SIZE, 1);
+	CHECK(a.maskedHash(0, 0, all) == a.hash(0, 0));
+}
+
+static void testDeferred() {
+	MerkleTree immediate, deferred;
+	fill(immediate);
+	deferred.setDeferred(true);
+	fill(deferred);
+	deferred.setDeferred(false);
+	for ( int level = 0; level <= immediate.getDepth(); level++ ) {
+		for ( size_t i = 0; i < immediate.width(level); i++ ) {
+			CHECK(immediate.hash(level, i) == deferred.hash(level, i));
+		}
+	}
+}
+
+static void testDigest() {
+	vector<pair<size_t, unsigned long long> > entries;
+	entries.push_back(make_pair((size_t)0, 0ULL));
+	entries.push_back(make_pair((size_t)7, 0x0123456789abcdefULL));
+	entries.push_back(make_pair((size_t)511, ~0ULL));
+	string payload;
+	MerkleDigest::encode(payload, 2, entries);
+
+	int level = -1;
+	vector<pair<size_t, unsigned long long> > decoded;
+	CHECK(MerkleDigest::decode(payload, level, decoded));
+	CHECK_EQ(level, 2);
+	CHECK(decoded == entries);
+
+	// cut between entries it decodes the ones before; cut inside one it is malformed
+	CHECK_EQ(payload.size(), 1 + 9 + 9 + 10);
+	for ( size_t cut = 1; cut < payload.size(); cut++ ) {
+		decoded.clear();
+		bool ok = MerkleDigest::decode(StrRef(payload.data(), cut), level, decoded);
+		CHECK_EQ(ok, cut == 1 || cut == 10 || cut == 19);
+	}
+
+	vector<size_t> leaves, decodedLeaves;
+	leaves.push_back(3);
+	leaves.push_back(130);
+	leaves.push_back(511);
+	string leafPayload;
+	MerkleDigest::encodeLeaves(leafPayload, leaves);
+	CHECK(MerkleDigest::decodeLeaves(leafPayload, decodedLeaves));
+	CHECK(decodedLeaves == leaves);
+	decodedLeaves.clear();
+	// 130 takes two bytes; cutting between them leaves a varint with no end
+	CHECK(!MerkleDigest::decodeLeaves(StrRef(leafPayload.data(), 2), decodedLeaves));
+}
+
+int main() {
+	testDiff();
+	testMaskedDiff();
+	testDeferred();
+	testDigest();
+	return checkResult("MerkleTreeTest");
+}
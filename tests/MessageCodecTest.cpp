@@ -0,0 +1,206 @@
+/**********************************
+ * FILE NAME: MessageCodecTest.cpp
+ *
+ * DESCRIPTION: Binary wire format round trips, rejection of truncated and
+ * 				malformed frames, the text fallback, and the chunk payload codec
+ **********************************/
+
+#include "MessageCodec.h"
+#include "BulkTransfer.h"
+#include "Check.h"
+
+static Address addressOf(int id, short port) {
+	Address a;
+	memcpy(a.addr, &id, sizeof(int));
+	memcpy(&a.addr[4], &port, sizeof(short));
+	return a;
+}
+
+// LEB128, written here rather than by the codec so malformed frames can be built
+static void varint(string &out, unsigned long long v) {
+	while ( v >= 0x80 ) {
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+static void testRoundTrip() {
+	Address from = addressOf(7, 3);
+	// binary-safe key and value, and a value long enough for a multi-byte length
+	string key("k\0ey", 4);
+	string value(300, 'v');
+	value[17] = '\0';
+	Version version(0x0102030405060708ULL, 99);
+	TransID transID = makeTransID(-5, UPDATE, 77);
+
+	for ( int type = CREATE; type <= READREPLY; type++ ) {
+		for ( int withVersion = 0; withVersion < 2; withVersion++ ) {
+			string out("prefix");
+			MessageCodec::encode(out, (MessageType)type, transID, from, key, value, TERTIARY, type == REPLY,
+					withVersion ? &version : NULL, WIRE_FLAG_LEASE);
+			MessageView view;
+			CHECK(MessageCodec::decode(out.data() + 6, out.size() - 6, view));
+			CHECK_EQ(view.type, type);
+			CHECK_EQ(view.replica, TERTIARY);
+			CHECK_EQ(view.success, type == REPLY);
+			CHECK(view.lease && !view.digest);
+			// only the wire ID travels; the full one is rebuilt from the issuer's node ID
+			CHECK(transIDFromWire(-5, (int)view.transID) == transID);
+			CHECK(view.fromAddr == from);
+			CHECK(view.key == key);
+			CHECK(view.value == value);
+			CHECK(withVersion ? view.version == version : view.version.isNull());
+			CHECK_EQ(MessageCodec::peekType(out.data() + 6, out.size() - 6), type);
+		}
+	}
+
+	// through a Message, only the fields its type uses go on the wire
+	Message reply(transIDWire(transID), from, REPLY, true);
+	string bytes = MessageCodec::encode(reply, transID);
+	MessageView view;
+	CHECK(MessageCodec::decodeAny(bytes.data(), bytes.size(), view));
+	CHECK(view.type == REPLY && view.success && view.key.empty() && view.value.empty());
+
+	// a digest reply carries the flag and no value
+	Message digest(transIDWire(transID), from, READREPLY, "", "");
+	bytes.clear();
+	MessageCodec::encode(bytes, digest, transID, &version, WIRE_FLAG_DIGEST);
+	CHECK(MessageCodec::decode(bytes.data(), bytes.size(), view));
+	CHECK(view.digest && !view.lease && view.value.empty() && view.version == version);
+
+	// smaller than the text format, version included
+	Message create(transIDWire(transID), addressOf(3, 0), CREATE, "key3", "value3", PRIMARY);
+	bytes.clear();
+	MessageCodec::encode(bytes, create, transID, &version);
+	CHECK(bytes.size() < create.toString().size());
+	bytes.clear();
+	MessageCodec::encode(bytes, reply, transID);
+	CHECK(bytes.size() < reply.toString().size());
+}
+
+static void testTruncatedAndMalformed() {
+	Address from = addressOf(1, 0);
+	Version version(5, 1);
+	string out;
+	MessageCodec::encode(out, CREATE, 9, from, "key", string(200, 'x'), PRIMARY, false, &version);
+
+	// every proper prefix is rejected, never read past
+	for ( size_t size = 0; size < out.size(); size++ ) {
+		string prefix = out.substr(0, size);
+		MessageView view;
+		CHECK(!MessageCodec::decode(prefix.data(), prefix.size(), view));
+	}
+
+	MessageView view;
+	string badMagic = out;
+	badMagic[0] = 0x00;
+	CHECK(!MessageCodec::decode(badMagic.data(), badMagic.size(), view));
+	string badVersion = out;
+	badVersion[0] = (char)(WIRE_MAGIC | (WIRE_VERSION + 1));
+	CHECK(!MessageCodec::decode(badVersion.data(), badVersion.size(), view));
+
+	// lengths that claim more bytes than the frame has
+	string longKey;
+	MessageCodec::encode(longKey, READ, 9, from, "", "", PRIMARY, false);
+	longKey.resize(WIRE_HEADER_SIZE);
+	varint(longKey, 1);
+	varint(longKey, 0);
+	varint(longKey, 1ULL << 40);
+	varint(longKey, 0);
+	longKey.append("abc");
+	CHECK(!MessageCodec::decode(longKey.data(), longKey.size(), view));
+
+	string longValue;
+	MessageCodec::encode(longValue, READ, 9, from, "", "", PRIMARY, false);
+	longValue.resize(WIRE_HEADER_SIZE);
+	varint(longValue, 1);
+	varint(longValue, 0);
+	varint(longValue, 2);
+	varint(longValue, ~0ULL);
+	longValue.append("abc");
+	CHECK(!MessageCodec::decode(longValue.data(), longValue.size(), view));
+
+	// address fields wider than Address holds
+	string wideNode;
+	MessageCodec::encode(wideNode, READ, 9, from, "", "", PRIMARY, false);
+	wideNode.resize(WIRE_HEADER_SIZE);
+	varint(wideNode, 1ULL << 32);
+	wideNode.append(3, '\0');
+	CHECK(!MessageCodec::decode(wideNode.data(), wideNode.size(), view));
+	string widePort;
+	MessageCodec::encode(widePort, READ, 9, from, "", "", PRIMARY, false);
+	widePort.resize(WIRE_HEADER_SIZE);
+	varint(widePort, 1);
+	varint(widePort, 1 << 16);
+	widePort.append(2, '\0');
+	CHECK(!MessageCodec::decode(widePort.data(), widePort.size(), view));
+
+	// a varint that never ends
+	string endless;
+	MessageCodec::encode(endless, READ, 9, from, "", "", PRIMARY, false);
+	endless.resize(WIRE_HEADER_SIZE);
+	endless.append(12, (char)0xff);
+	CHECK(!MessageCodec::decode(endless.data(), endless.size(), view));
+}
+
+static void testVarint() {
+	unsigned long long values[] = { 0, 1, 127, 128, 16383, 16384, 0xffffffffULL, ~0ULL };
+	for ( size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++ ) {
+		string out;
+		MessageCodec::putVarint(out, values[i]);
+		const unsigned char *p = (const unsigned char *)out.data();
+		const unsigned char *end = p + out.size();
+		unsigned long long v;
+		CHECK(MessageCodec::getVarint(p, end, v) && v == values[i] && p == end);
+		// and cut short
+		p = (const unsigned char *)out.data();
+		CHECK(!MessageCodec::getVarint(p, end - 1, v) || out.size() == 1);
+	}
+}
+
+static void testTextFallback() {
+	Address from = addressOf(4, 0);
+	Message msg(17, from, UPDATE, "key", "value", SECONDARY);
+	string text = msg.toString();
+	CHECK(!MessageCodec::isBinary(text.data(), text.size()));
+	CHECK_EQ(MessageCodec::peekType(text.data(), text.size()), UPDATE);
+	MessageView view;
+	CHECK(MessageCodec::decodeAny(text.data(), text.size(), view));
+	CHECK(view.type == UPDATE && view.replica == SECONDARY && view.transID == 17);
+	CHECK(view.key == "key" && view.value == "value");
+	CHECK(view.version.isNull());
+}
+
+static void testBatchCodec() {
+	string payload;
+	vector<pair<string, string> > pairs;
+	for ( int i = 0; i < 50; i++ ) {
+		pairs.push_back(make_pair("key" + to_string(i), string(i * 7, 'a' + i % 26)));
+		BatchCodec::appendPair(payload, pairs.back().first, pairs.back().second);
+	}
+	vector<pair<StrRef, StrRef> > unpacked;
+	CHECK(BatchCodec::unpack(payload, unpacked));
+	CHECK_EQ(unpacked.size(), pairs.size());
+	for ( size_t i = 0; i < unpacked.size() && i < pairs.size(); i++ ) {
+		CHECK(unpacked[i].first == pairs[i].first && unpacked[i].second == pairs[i].second);
+	}
+
+	// a cut anywhere inside the last pair is malformed
+	string last;
+	BatchCodec::appendPair(last, string("tail"), string("value"));
+	string whole = payload + last;
+	for ( size_t cut = payload.size() + 1; cut < whole.size(); cut++ ) {
+		unpacked.clear();
+		CHECK(!BatchCodec::unpack(StrRef(whole.data(), cut), unpacked));
+	}
+}
+
+int main() {
+	testRoundTrip();
+	testTruncatedAndMalformed();
+	testVarint();
+	testTextFallback();
+	testBatchCodec();
+	return checkResult("MessageCodecTest");
+}
@@ -0,0 +1,124 @@
+/**********************************
+ * FILE NAME: PendingOpTableTest.cpp
+ *
+ * DESCRIPTION: Transaction ID layout and allocator, and the coordinator's
+ * 				in-flight operation table under growth and churn
+ **********************************/
+
+#include <deque>
+#include <set>
+#include "PendingOpTable.h"
+#include "Check.h"
+
+static void testTransIDLayout() {
+	TransID id = makeTransID(42, UPDATE, 12345);
+	CHECK_EQ(transIDNode(id), 42);
+	CHECK_EQ(transIDOp(id), UPDATE);
+	CHECK_EQ(id & TRANSID_SEQ_MASK, 12345);
+	// the wire carries the low 32 bits; the coordinator adds its node ID back
+	CHECK(transIDFromWire(42, transIDWire(id)) == id);
+	CHECK(transIDFromWire(43, transIDWire(id)) != id);
+
+	// sequences wrap within their own bits
+	TransID wrapped = makeTransID(1, READ, TRANSID_SEQ_MASK + 5);
+	CHECK_EQ(transIDOp(wrapped), READ);
+	CHECK_EQ(wrapped & TRANSID_SEQ_MASK, 4);
+
+	// a node ID with the top bit set survives the round trip
+	TransID high = makeTransID(-2, DELETE, 7);
+	CHECK_EQ(transIDNode(high), -2);
+	CHECK(transIDFromWire(-2, transIDWire(high)) == high);
+
+	// wire IDs are never negative and differ between coordinators
+	CHECK(transIDWire(high) >= 0);
+	CHECK(transIDWire(makeTransID(-1, (MessageType)TRANSID_OP_REPLICATION, TRANSID_SEQ_MASK)) >= 0);
+	for ( int node = 1; node <= (int)TRANSID_NODE_MASK; node++ ) {
+		CHECK(transIDWire(makeTransID(node, CREATE, 0)) != transIDWire(makeTransID(node + 1, CREATE, 0)));
+	}
+	CHECK(transIDWire(makeTransID(0x0100000a, CREATE, 0)) != transIDWire(makeTransID(0x0200000a, CREATE, 0)));
+}
+
+static void testAllocator() {
+	TransIDAllocator ids(9);
+	set<TransID> seen;
+	for ( int i = 0; i < 1000; i++ ) {
+		seen.insert(ids.next(CREATE));
+		seen.insert(ids.next(READ));
+		seen.insert(ids.next((MessageType)TRANSID_OP_REPLICATION));
+	}
+	CHECK_EQ(seen.size(), 3000);
+	TransID next = ids.next(READ);
+	CHECK_EQ(transIDNode(next), 9);
+	CHECK_EQ(transIDOp(next), READ);
+	// every op type counts on its own
+	CHECK_EQ(next & TRANSID_SEQ_MASK, 1000);
+}
+
+static void testInsertFind() {
+	PendingOpTable table(8);
+	CHECK(table.empty());
+	for ( TransID id = 1; id <= 1000; id++ ) {
+		PendingOp *op = table.insert(id * 7919);
+		op->key = "key" + to_string(id);
+		op->acks = (int)id;
+	}
+	CHECK_EQ(table.size(), 1000);
+	// capacity grows so at most half the slots are used
+	CHECK(table.capacity() >= 2000);
+	for ( TransID id = 1; id <= 1000; id++ ) {
+		PendingOp *op = table.find(id * 7919);
+		CHECK(op != NULL && op->key == "key" + to_string(id) && op->acks == (int)id);
+	}
+	CHECK(table.find(1) == NULL);
+
+	// inserting a present ID returns the existing entry
+	PendingOp *again = table.insert(7919);
+	CHECK(again->key == "key1");
+	CHECK_EQ(table.size(), 1000);
+}
+
+static void testEraseChurn() {
+	PendingOpTable table(16);
+	TransIDAllocator ids(3);
+	deque<TransID> live;
+	for ( int round = 0; round < 20000; round++ ) {
+		TransID id = ids.next((MessageType)(round % 4));
+		table.insert(id)->key = to_string(id);
+		live.push_back(id);
+		// keep about 100 in flight, retiring the oldest and one in the middle
+		if ( live.size() > 100 ) {
+			CHECK(table.erase(live.front()));
+			live.pop_front();
+			TransID middle = live[live.size() / 2];
+			CHECK(table.erase(middle));
+			live.erase(live.begin() + live.size() / 2);
+		}
+	}
+	CHECK_EQ(table.size(), live.size());
+	for ( size_t i = 0; i < live.size(); i++ ) {
+		PendingOp *op = table.find(live[i]);
+		CHECK(op != NULL && op->key == to_string(live[i]));
+	}
+	CHECK(!table.erase(ids.next(READ)));
+
+	// a scan sees exactly the live entries
+	size_t scanned = 0;
+	for ( size_t i = 0; i < table.capacity(); i++ ) {
+		scanned += table.slot(i) != NULL ? 1 : 0;
+	}
+	CHECK_EQ(scanned, live.size());
+
+	// erased slots come back empty
+	TransID id = live.front();
+	table.erase(id);
+	PendingOp *fresh = table.insert(id);
+	CHECK(fresh->key.empty() && fresh->acks == 0 && fresh->replicas.empty());
+}
+
+int main() {
+	testTransIDLayout();
+	testAllocator();
+	testInsertFind();
+	testEraseChurn();
+	return checkResult("PendingOpTableTest");
+}
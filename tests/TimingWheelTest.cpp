@@ -0,0 +1,76 @@
+/**********************************
+ * FILE NAME: TimingWheelTest.cpp
+ *
+ * DESCRIPTION: Every timer fires exactly at its tick, on every level of the
+ * 				wheel and beyond it
+ **********************************/
+
+#include "TimingWheel.h"
+#include "Check.h"
+
+static void testFiresOnTime() {
+	TimingWheel wheel(100);
+	map<TransID, long> due;
+	// one-tick resolution at level 0, the level boundaries, the top level and the overflow list
+	long deltas[] = { 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144, 300000, 16777215, 16777216, 16777300 };
+	TransID id = 1;
+	for ( size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++, id++ ) {
+		wheel.schedule(id, 100 + deltas[i]);
+		due[id] = 100 + deltas[i];
+	}
+	// several timers on one tick
+	wheel.schedule(id, 200);
+	due[id++] = 200;
+	wheel.schedule(id, 200);
+	due[id++] = 200;
+	CHECK_EQ(wheel.size(), due.size());
+
+	map<TransID, long> fired;
+	vector<TransID> expired;
+	// step through the dense part, then jump: advance still fires each timer on its tick
+	for ( long t = 101; t <= 5000; t++ ) {
+		expired.clear();
+		wheel.advance(t, expired);
+		for ( size_t i = 0; i < expired.size(); i++ ) {
+			CHECK(fired.find(expired[i]) == fired.end());
+			fired[expired[i]] = t;
+		}
+	}
+	long checkpoints[] = { 262243, 262244, 300100, 16777315, 16777316, 16777400 };
+	for ( size_t c = 0; c < sizeof(checkpoints) / sizeof(checkpoints[0]); c++ ) {
+		expired.clear();
+		wheel.advance(checkpoints[c], expired);
+		for ( size_t i = 0; i < expired.size(); i++ ) {
+			fired[expired[i]] = checkpoints[c];
+		}
+	}
+	CHECK_EQ(wheel.size(), 0);
+	CHECK_EQ(fired.size(), due.size());
+	for ( map<TransID, long>::iterator it = due.begin(); it != due.end(); ++it ) {
+		CHECK_EQ(fired[it->first], it->second);
+	}
+}
+
+static void testPastAndPresent() {
+	TimingWheel wheel(50);
+	vector<TransID> expired;
+	// already due: fires on the next advance, even one that does not move the clock
+	wheel.schedule(1, 10);
+	wheel.schedule(2, 50);
+	wheel.advance(50, expired);
+	CHECK_EQ(expired.size(), 2);
+	CHECK_EQ(wheel.getTime(), 50);
+
+	expired.clear();
+	wheel.schedule(3, 51);
+	wheel.advance(50, expired);
+	CHECK(expired.empty());
+	wheel.advance(51, expired);
+	CHECK(expired.size() == 1 && expired[0] == 3);
+}
+
+int main() {
+	testFiresOnTime();
+	testPastAndPresent();
+	return checkResult("TimingWheelTest");
+}
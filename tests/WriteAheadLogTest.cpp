@@ -0,0 +1,136 @@
+/**********************************
+ * FILE NAME: WriteAheadLogTest.cpp
+ *
+ * DESCRIPTION: Replay returns every committed record in order and stops
+ * 				cleanly at a torn or corrupt tail
+ **********************************/
+
+#include <unistd.h>
+#include "WriteAheadLog.h"
+#include "Check.h"
+
+struct Replayed {
+	WalRecordType type;
+	string key;
+	string value;
+};
+
+static vector<Replayed> replayAll(const string &path) {
+	vector<Replayed> records;
+	unsigned long n = WriteAheadLog::replay(path, [&records](WalRecordType type, StrRef key, StrRef value) {
+		Replayed r = { type, key.str(), value.str() };
+		records.push_back(r);
+	});
+	CHECK_EQ(n, records.size());
+	return records;
+}
+
+static string tempPath() {
+	char path[] = "/tmp/waltestXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	close(fd);
+	return path;
+}
+
+static void testReplay() {
+	string path = tempPath();
+	{
+		WriteAheadLog wal(path);
+		CHECK(wal.isOpen());
+		wal.setShards(4);
+		// records of one key stay in order whichever shard they go through
+		wal.append(1, WAL_PUT, "a", "1");
+		wal.append(2, WAL_PUT, string("b\0", 2), string(100000, 'z'));
+		wal.append(1, WAL_PUT, "a", "2");
+		CHECK(wal.commit());
+		// appended but not committed yet: not in the file
+		wal.append(1, WAL_DELETE, "a");
+		CHECK_EQ(replayAll(path).size(), 3);
+		CHECK(wal.commit());
+	}
+	vector<Replayed> records = replayAll(path);
+	CHECK_EQ(records.size(), 4);
+	if ( records.size() == 4 ) {
+		vector<Replayed> a;
+		for ( size_t i = 0; i < records.size(); i++ ) {
+			if ( records[i].key == "a" ) {
+				a.push_back(records[i]);
+			}
+			else {
+				CHECK(records[i].type == WAL_PUT && records[i].key == string("b\0", 2));
+				CHECK(records[i].value == string(100000, 'z'));
+			}
+		}
+		CHECK(a.size() == 3 && a[0].value == "1" && a[1].value == "2");
+		CHECK(a.size() == 3 && a[2].type == WAL_DELETE && a[2].value.empty());
+	}
+
+	// reset empties the log
+	{
+		WriteAheadLog wal(path);
+		wal.append(0, WAL_PUT, "c", "3");
+		CHECK(wal.reset());
+		CHECK_EQ(wal.getFileBytes(), 0);
+	}
+	CHECK(replayAll(path).empty());
+	unlink(path.c_str());
+}
+
+static void testTornTail() {
+	string path = tempPath();
+	{
+		WriteAheadLog wal(path);
+		for ( int i = 0; i < 10; i++ ) {
+			wal.append(0, WAL_PUT, "key" + to_string(i), "value" + to_string(i));
+		}
+		CHECK(wal.commit());
+	}
+	off_t whole = 0;
+	{
+		FILE *f = fopen(path.c_str(), "rb");
+		fseek(f, 0, SEEK_END);
+		whole = ftell(f);
+		fclose(f);
+	}
+	// every record here has the same size
+	off_t recordBytes = whole / 10;
+	CHECK_EQ(recordBytes * 10, whole);
+
+	// a crash anywhere inside the last record leaves the nine before it
+	for ( off_t cut = whole - recordBytes + 1; cut < whole; cut++ ) {
+		CHECK(truncate(path.c_str(), cut) == 0);
+		vector<Replayed> records = replayAll(path);
+		CHECK_EQ(records.size(), 9);
+		CHECK(!records.empty() && records.back().key == "key8" && records.back().value == "value8");
+	}
+
+	// a flipped byte in record 5 ends replay before it
+	CHECK(truncate(path.c_str(), whole - recordBytes) == 0);
+	{
+		FILE *f = fopen(path.c_str(), "r+b");
+		fseek(f, recordBytes * 5 + WAL_RECORD_HEADER + 3, SEEK_SET);
+		fputc('!', f);
+		fclose(f);
+	}
+	CHECK_EQ(replayAll(path).size(), 5);
+
+	// a length running past the end of the file
+	{
+		FILE *f = fopen(path.c_str(), "r+b");
+		fseek(f, recordBytes * 2, SEEK_SET);
+		unsigned char huge[4] = { 0xff, 0xff, 0xff, 0x7f };
+		fwrite(huge, 1, 4, f);
+		fclose(f);
+	}
+	CHECK_EQ(replayAll(path).size(), 2);
+
+	unlink(path.c_str());
+	CHECK(replayAll(path).empty());
+}
+
+int main() {
+	testReplay();
+	testTornTail();
+	return checkResult("WriteAheadLogTest");
+}